@@ -0,0 +1,831 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+#include "../geometry/ray.h"
+#include "../geometry/vector.h"
+#include "../options/bvh_options.h"
+#include "../reader/object.h"
+#include "../utils/thread_pool.h"
+#include "bvh_node.h"
+#include "compressed_bvh.h"
+#include "lbvh.h"
+#include "packet_kernels.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Счётчик посещённых узлов по умолчанию: ничего не делает
+struct IgnoreNodeVisit {
+  void operator()() const {}
+};
+
+struct BvhStats {
+  double build_time_ms = 0.0;
+  size_t primitive_count = 0;
+  size_t node_count = 0;
+  size_t leaf_count = 0;
+  size_t max_depth = 0;
+  size_t min_leaf_size = 0;
+  size_t max_leaf_size = 0;
+  double average_leaf_size = 0.0;
+  // Стоимость обхода по SAH относительно площади корня
+  double sah_cost = 0.0;
+};
+
+class Bvh {
+public:
+  static constexpr size_t kMaxDepth = kBvhMaxDepth;
+
+  Bvh() = default;
+
+  Bvh(const std::vector<Object> &objects,
+      const std::vector<SphereObject> &sphere_objects,
+      const BvhOptions &options = {})
+      : Bvh(objects, sphere_objects, {}, options) {}
+
+  // instance_bounds - коробки экземпляров мешей в мировых координатах
+  Bvh(const std::vector<Object> &objects,
+      const std::vector<SphereObject> &sphere_objects,
+      std::span<const BoundingBox> instance_bounds, const BvhOptions &options)
+      : options_(options) {
+    auto start = std::chrono::steady_clock::now();
+    options_.max_leaf_size = std::max<size_t>(options_.max_leaf_size, 1);
+    options_.bin_count = std::max<size_t>(options_.bin_count, 2);
+
+    if (options_.split_method == BvhSplitMethod::kLbvh) {
+      ThreadPool pool{options_.threads};
+      LinearBvh linear = BuildLinearBvh(objects, sphere_objects,
+                                        instance_bounds,
+                                        options_.max_leaf_size, pool);
+      nodes_ = std::move(linear.nodes);
+      primitives_ = std::move(linear.primitives);
+    } else {
+      BuildTopDown(objects, sphere_objects, instance_bounds);
+    }
+
+    std::chrono::duration<double, std::milli> build_time =
+        std::chrono::steady_clock::now() - start;
+    CollectStats();
+    stats_.build_time_ms = build_time.count();
+    built_sah_cost_ = stats_.sah_cost;
+  }
+
+  // Дерево, построенное раньше, например прочитанное из кэша сцены
+  Bvh(std::vector<BvhNode> nodes, std::vector<BvhPrimitive> primitives,
+      const BvhOptions &options)
+      : options_(options), nodes_(std::move(nodes)),
+        primitives_(std::move(primitives)) {
+    CollectStats();
+    built_sah_cost_ = stats_.sah_cost;
+  }
+
+  const BvhOptions &GetOptions() const { return options_; }
+
+  const BvhStats &GetStats() const { return stats_; }
+
+  const std::vector<BvhNode> &GetNodes() const { return nodes_; }
+
+  const std::vector<FloatBvhNode> &GetFloatNodes() const {
+    return float_nodes_;
+  }
+
+  const CompressedBvhNodes &GetCompressedNodes() const {
+    return compressed_nodes_;
+  }
+
+  size_t GetNodeBytes() const {
+    return nodes_.size() * sizeof(BvhNode) +
+           float_nodes_.size() * sizeof(FloatBvhNode) +
+           compressed_nodes_.size() * sizeof(CompressedBvhNode);
+  }
+
+  // Переводит узлы во float для обхода в одинарной точности. Коробки
+  // округляются наружу, чтобы не терять попаданий; узлы в double после
+  // этого освобождаются, и обходить дерево можно только лучами FloatRay.
+  void ConvertToFloat() {
+    float_nodes_.reserve(nodes_.size());
+    for (const BvhNode &node : nodes_) {
+      float_nodes_.push_back(
+          {FloatBoundingBox(node.bounds), node.offset, node.count});
+    }
+    nodes_ = {};
+  }
+
+  // Переводит узлы в сжатый вид (CompressedBvhNode): по четыре ребёнка на
+  // узел в одной кэш-линии, коробки детей - 8-битные коды в сетке родителя.
+  // Двоичные узлы освобождаются; Traverse и TraverseAny работают в обеих
+  // точностях, а обход пучком, Refit и запись в кэш сцены - нет. Дерево,
+  // которое не сжимается (см. CompressBvhNodes), остаётся двоичным.
+  void Compress() {
+    auto compressed = float_nodes_.empty() ? CompressBvhNodes(nodes_)
+                                           : CompressBvhNodes(float_nodes_);
+    if (!compressed.has_value() || compressed->empty()) {
+      return;
+    }
+    compressed_nodes_ = std::move(*compressed);
+    nodes_ = {};
+    float_nodes_ = {};
+  }
+
+  bool IsCompressed() const { return !compressed_nodes_.empty(); }
+
+  const std::vector<BvhPrimitive> &GetPrimitives() const {
+    return primitives_;
+  }
+
+  // Пересчитывает коробки узлов под новые положения примитивов, не меняя
+  // структуру дерева: primitive_bounds(primitive) даёт новую коробку
+  // примитива. Узлы поддерева лежат в массиве подряд, и дети идут после
+  // родителя, поэтому поддеревья пересчитываются параллельно с конца, а
+  // затем последовательно - их общие предки. Статистика, включая
+  // SAH-стоимость, считается заново.
+  template <class BoundsFunc>
+  void Refit(BoundsFunc &&primitive_bounds, ThreadPool &pool) {
+    if (float_nodes_.empty()) {
+      RefitNodes(nodes_, primitive_bounds, pool);
+    } else {
+      RefitNodes(float_nodes_, primitive_bounds, pool);
+    }
+    double build_time_ms = stats_.build_time_ms;
+    CollectStats();
+    stats_.build_time_ms = build_time_ms;
+  }
+
+  // После Refit дерево обходится заметно дороже, чем сразу после
+  // построения, и его стоит построить заново
+  bool NeedsRebuild() const {
+    return stats_.sah_cost > options_.max_refit_cost_ratio * built_sah_cost_;
+  }
+
+  // Нумерует треугольники заново в порядке листьев, так что треугольники
+  // одного листа получают подряд идущие номера. Возвращает старые номера
+  // в новом порядке.
+  std::vector<uint32_t> ReorderTriangles() {
+    std::vector<uint32_t> order;
+    for (BvhPrimitive &primitive : primitives_) {
+      if (primitive.kind == PrimitiveKind::kTriangle) {
+        order.push_back(primitive.index);
+        primitive.index = order.size() - 1;
+      }
+    }
+    return order;
+  }
+
+  // Обходит узлы, которые пересекает луч, ближний ребёнок первым.
+  // visitor(primitives, t_max) проверяет примитивы листа и уменьшает t_max
+  // при попадании ближе текущего. Треугольники листа идут первыми и имеют
+  // подряд идущие индексы. count_node() вызывается для каждого узла.
+  // Точность обхода задаётся типом луча.
+  template <class T, class Visitor, class NodeCounter = IgnoreNodeVisit>
+  void Traverse(const BasicRay<T> &ray, T &t_max, Visitor &&visitor,
+                NodeCounter &&count_node = {}) const {
+    if (IsCompressed()) {
+      TraverseCompressed(ray, t_max, visitor, count_node);
+      return;
+    }
+    const auto &nodes = NodesOf<T>();
+    if (nodes.empty()) {
+      return;
+    }
+
+    BasicBoxRay<T> box_ray(ray);
+    if (box_ray.Intersect(nodes[0].bounds, t_max) > t_max) {
+      return;
+    }
+
+    std::array<uint32_t, kMaxDepth> stack;
+    size_t stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+      count_node();
+      const BasicBvhNode<T> &node = nodes[current];
+      if (node.IsLeaf()) {
+        visitor(GetLeafPrimitives(node), t_max);
+      } else {
+        uint32_t left = current + 1;
+        uint32_t right = node.offset;
+        T t_left = box_ray.Intersect(nodes[left].bounds, t_max);
+        T t_right = box_ray.Intersect(nodes[right].bounds, t_max);
+
+        if (t_left > t_right) {
+          std::swap(left, right);
+          std::swap(t_left, t_right);
+        }
+        if (t_left <= t_max) {
+          if (t_right <= t_max) {
+            stack[stack_size++] = right;
+          }
+          current = left;
+          continue;
+        }
+      }
+
+      // Дальний ребёнок мог стать ненужным после найденного попадания,
+      // но проверять это повторно дороже, чем лишний раз зайти в узел
+      if (stack_size == 0) {
+        return;
+      }
+      current = stack[--stack_size];
+    }
+  }
+
+  // Обход для запросов "есть ли хоть одно попадание ближе t_max": порядок
+  // детей не важен, обход прекращается, как только visitor вернёт true.
+  template <class T, class Visitor, class NodeCounter = IgnoreNodeVisit>
+  bool TraverseAny(const BasicRay<T> &ray, std::type_identity_t<T> t_max,
+                   Visitor &&visitor, NodeCounter &&count_node = {}) const {
+    if (IsCompressed()) {
+      return TraverseAnyCompressed(ray, t_max, visitor, count_node);
+    }
+    const auto &nodes = NodesOf<T>();
+    if (nodes.empty()) {
+      return false;
+    }
+
+    BasicBoxRay<T> box_ray(ray);
+    if (box_ray.Intersect(nodes[0].bounds, t_max) > t_max) {
+      return false;
+    }
+
+    std::array<uint32_t, kMaxDepth> stack;
+    size_t stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+      count_node();
+      const BasicBvhNode<T> &node = nodes[current];
+      if (node.IsLeaf()) {
+        if (visitor(GetLeafPrimitives(node), t_max)) {
+          return true;
+        }
+      } else {
+        uint32_t left = current + 1;
+        uint32_t right = node.offset;
+        bool hit_left = box_ray.Intersect(nodes[left].bounds, t_max) <= t_max;
+        bool hit_right = box_ray.Intersect(nodes[right].bounds, t_max) <= t_max;
+
+        if (hit_left || hit_right) {
+          if (hit_left && hit_right) {
+            stack[stack_size++] = right;
+          }
+          current = hit_left ? left : right;
+          continue;
+        }
+      }
+
+      if (stack_size == 0) {
+        return false;
+      }
+      current = stack[--stack_size];
+    }
+  }
+
+  // Обход пучком лучей: узел посещается, если его коробку пересекает хотя
+  // бы один луч, и дальше проверяются только такие лучи. visitor(primitives,
+  // lanes) проверяет примитивы листа для лучей из маски lanes и уменьшает
+  // их rays.t_max. Из двух детей первым идёт тот, в который раньше входит
+  // какой-нибудь луч пучка.
+  template <class Visitor, class NodeCounter = IgnoreNodeVisit>
+  void TraversePacket(const PacketRays &rays, uint32_t active,
+                      Visitor &&visitor, NodeCounter &&count_node = {}) const {
+    if (nodes_.empty()) {
+      return;
+    }
+
+    double t_near;
+    active = IntersectBoxPacket(nodes_[0].bounds, rays, active, &t_near);
+    if (active == 0) {
+      return;
+    }
+
+    std::array<PacketStackEntry, kMaxDepth> stack;
+    size_t stack_size = 0;
+    PacketStackEntry current = {0, active};
+
+    while (true) {
+      count_node();
+      const BvhNode &node = nodes_[current.node];
+      if (node.IsLeaf()) {
+        visitor(GetLeafPrimitives(node), current.lanes);
+      } else {
+        PacketStackEntry left = {current.node + 1, 0};
+        PacketStackEntry right = {node.offset, 0};
+        double t_left, t_right;
+        left.lanes = IntersectBoxPacket(nodes_[left.node].bounds, rays,
+                                        current.lanes, &t_left);
+        right.lanes = IntersectBoxPacket(nodes_[right.node].bounds, rays,
+                                         current.lanes, &t_right);
+
+        if (t_left > t_right) {
+          std::swap(left, right);
+        }
+        if (left.lanes != 0) {
+          if (right.lanes != 0) {
+            stack[stack_size++] = right;
+          }
+          current = left;
+          continue;
+        }
+        if (right.lanes != 0) {
+          current = right;
+          continue;
+        }
+      }
+
+      if (stack_size == 0) {
+        return;
+      }
+      current = stack[--stack_size];
+    }
+  }
+
+  // Пучковый вариант TraverseAny: visitor(primitives, lanes) возвращает
+  // маску лучей, нашедших препятствие, и они больше не проверяются. Обход
+  // заканчивается, когда препятствие найдено для всех лучей. Возвращает
+  // маску лучей с препятствием.
+  template <class Visitor, class NodeCounter = IgnoreNodeVisit>
+  uint32_t TraversePacketAny(const PacketRays &rays, uint32_t active,
+                             Visitor &&visitor,
+                             NodeCounter &&count_node = {}) const {
+    if (nodes_.empty()) {
+      return 0;
+    }
+
+    double t_near;
+    uint32_t pending =
+        IntersectBoxPacket(nodes_[0].bounds, rays, active, &t_near);
+    uint32_t occluded = 0;
+
+    std::array<PacketStackEntry, kMaxDepth> stack;
+    size_t stack_size = 0;
+    PacketStackEntry current = {0, pending};
+
+    while (current.lanes != 0) {
+      count_node();
+      const BvhNode &node = nodes_[current.node];
+      if (node.IsLeaf()) {
+        occluded |= visitor(GetLeafPrimitives(node), current.lanes);
+        pending &= ~occluded;
+        if (pending == 0) {
+          return occluded;
+        }
+      } else {
+        PacketStackEntry left = {current.node + 1, 0};
+        PacketStackEntry right = {node.offset, 0};
+        left.lanes = IntersectBoxPacket(nodes_[left.node].bounds, rays,
+                                        current.lanes, &t_near);
+        right.lanes = IntersectBoxPacket(nodes_[right.node].bounds, rays,
+                                         current.lanes, &t_near);
+
+        if (left.lanes != 0 || right.lanes != 0) {
+          if (left.lanes != 0 && right.lanes != 0) {
+            stack[stack_size++] = right;
+          }
+          current = left.lanes != 0 ? left : right;
+          continue;
+        }
+      }
+
+      // Лучи, уже нашедшие препятствие в другой ветке, не проверяются
+      current.lanes = 0;
+      while (current.lanes == 0 && stack_size > 0) {
+        current = stack[--stack_size];
+        current.lanes &= pending;
+      }
+    }
+    return occluded;
+  }
+
+private:
+  template <class T>
+  const std::vector<BasicBvhNode<T>> &NodesOf() const {
+    if constexpr (std::is_same_v<T, float>) {
+      return float_nodes_;
+    } else {
+      return nodes_;
+    }
+  }
+
+  template <class T>
+  std::span<const BvhPrimitive>
+  GetLeafPrimitives(const BasicBvhNode<T> &node) const {
+    return {primitives_.data() + node.offset, node.count};
+  }
+
+  // Стек сжатого обхода: узел добавляет в него до трёх детей сверх себя
+  static constexpr size_t kCompressedStackSize =
+      (kCompressedBvhWidth - 1) * kMaxDepth + 1;
+
+  // Листья, в которые входит луч, проверяются сразу, от ближнего к
+  // дальнему, а внутренние дети кладутся в стек так, чтобы ближний
+  // снимался первым
+  template <class T, class Visitor, class NodeCounter>
+  void TraverseCompressed(const BasicRay<T> &ray, T &t_max, Visitor &visitor,
+                          NodeCounter &count_node) const {
+    BasicBoxRay<T> box_ray(ray);
+    std::array<uint32_t, kCompressedStackSize> stack;
+    size_t stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+      count_node();
+      const CompressedBvhNode &node = compressed_nodes_[current];
+      std::array<T, kCompressedBvhWidth> t_near;
+      uint32_t hit =
+          IntersectCompressedChildren(node, box_ray, t_max, t_near.data());
+
+      std::array<uint32_t, kCompressedBvhWidth> order;
+      size_t hit_count = 0;
+      for (; hit != 0; hit &= hit - 1) {
+        uint32_t child = std::countr_zero(hit);
+        size_t position = hit_count++;
+        for (; position > 0 && t_near[order[position - 1]] > t_near[child];
+             --position) {
+          order[position] = order[position - 1];
+        }
+        order[position] = child;
+      }
+
+      for (size_t i = 0; i < hit_count; ++i) {
+        uint32_t child = order[i];
+        if (node.IsLeaf(child) && t_near[child] <= t_max) {
+          count_node();
+          visitor(GetLeafPrimitives(node, child), t_max);
+        }
+      }
+      for (size_t i = hit_count; i-- > 0;) {
+        if (!node.IsLeaf(order[i])) {
+          stack[stack_size++] = node.child[order[i]];
+        }
+      }
+
+      if (stack_size == 0) {
+        return;
+      }
+      current = stack[--stack_size];
+    }
+  }
+
+  template <class T, class Visitor, class NodeCounter>
+  bool TraverseAnyCompressed(const BasicRay<T> &ray, T t_max,
+                             Visitor &visitor, NodeCounter &count_node) const {
+    BasicBoxRay<T> box_ray(ray);
+    std::array<uint32_t, kCompressedStackSize> stack;
+    size_t stack_size = 0;
+    uint32_t current = 0;
+
+    while (true) {
+      count_node();
+      const CompressedBvhNode &node = compressed_nodes_[current];
+      std::array<T, kCompressedBvhWidth> t_near;
+      uint32_t hit =
+          IntersectCompressedChildren(node, box_ray, t_max, t_near.data());
+      for (; hit != 0; hit &= hit - 1) {
+        uint32_t child = std::countr_zero(hit);
+        if (!node.IsLeaf(child)) {
+          stack[stack_size++] = node.child[child];
+          continue;
+        }
+        count_node();
+        if (visitor(GetLeafPrimitives(node, child), t_max)) {
+          return true;
+        }
+      }
+
+      if (stack_size == 0) {
+        return false;
+      }
+      current = stack[--stack_size];
+    }
+  }
+
+  std::span<const BvhPrimitive>
+  GetLeafPrimitives(const CompressedBvhNode &node, uint32_t child) const {
+    return {primitives_.data() + node.child[child], node.count[child]};
+  }
+
+  struct PacketStackEntry {
+    uint32_t node;
+    uint32_t lanes;
+  };
+
+  struct BuildItem {
+    BoundingBox bounds;
+    BvhPrimitive primitive;
+    Vector centroid;
+  };
+
+  struct Split {
+    size_t axis = 0;
+    size_t bin = 0;
+    double cost = std::numeric_limits<double>::max();
+  };
+
+  // Сверху вниз по SAH или медиане
+  void BuildTopDown(const std::vector<Object> &objects,
+                    const std::vector<SphereObject> &sphere_objects,
+                    std::span<const BoundingBox> instance_bounds) {
+    std::vector<BuildItem> items;
+    items.reserve(objects.size() + sphere_objects.size() +
+                  instance_bounds.size());
+    auto add_item = [&](const BoundingBox &bounds, PrimitiveKind kind,
+                        size_t index) {
+      items.push_back({bounds, {kind, static_cast<uint32_t>(index)},
+                       bounds.Centroid()});
+    };
+    for (size_t i = 0; i < objects.size(); ++i) {
+      add_item(GetBoundingBox(objects[i].polygon), PrimitiveKind::kTriangle, i);
+    }
+    for (size_t i = 0; i < sphere_objects.size(); ++i) {
+      add_item(GetBoundingBox(sphere_objects[i].sphere), PrimitiveKind::kSphere,
+               i);
+    }
+    for (size_t i = 0; i < instance_bounds.size(); ++i) {
+      add_item(instance_bounds[i], PrimitiveKind::kInstance, i);
+    }
+
+    if (!items.empty()) {
+      nodes_.reserve(2 * items.size());
+      primitives_.reserve(items.size());
+      BuildRecursive(items, 0, items.size(), 0);
+    }
+  }
+
+  uint32_t BuildRecursive(std::vector<BuildItem> &items, size_t begin,
+                          size_t end, size_t depth) {
+    uint32_t node_index = nodes_.size();
+    nodes_.emplace_back();
+
+    BoundingBox bounds;
+    BoundingBox centroid_bounds;
+    for (size_t i = begin; i < end; ++i) {
+      bounds.Extend(items[i].bounds);
+      centroid_bounds.Extend(items[i].centroid);
+    }
+    nodes_[node_index].bounds = bounds;
+
+    size_t count = end - begin;
+    if (count <= 1 || depth + 1 >= kMaxDepth) {
+      MakeLeaf(items, begin, end, node_index);
+      return node_index;
+    }
+
+    size_t middle = begin;
+    if (options_.split_method == BvhSplitMethod::kSah) {
+      middle = PartitionSah(items, begin, end, bounds, centroid_bounds);
+      if (middle == begin && count > options_.max_leaf_size) {
+        // Разбиение невыгодно, но лист получается слишком большим
+        middle = PartitionMedian(items, begin, end, centroid_bounds);
+      }
+    } else if (count > options_.max_leaf_size) {
+      middle = PartitionMedian(items, begin, end, centroid_bounds);
+    }
+
+    if (middle == begin || middle == end) {
+      MakeLeaf(items, begin, end, node_index);
+      return node_index;
+    }
+
+    BuildRecursive(items, begin, middle, depth + 1);
+    uint32_t right = BuildRecursive(items, middle, end, depth + 1);
+    nodes_[node_index].offset = right;
+    return node_index;
+  }
+
+  // Делим по медиане центроидов вдоль самой длинной оси
+  size_t PartitionMedian(std::vector<BuildItem> &items, size_t begin,
+                         size_t end, const BoundingBox &centroid_bounds) {
+    size_t axis = centroid_bounds.LargestAxis();
+    size_t middle = begin + (end - begin) / 2;
+    std::nth_element(items.begin() + begin, items.begin() + middle,
+                     items.begin() + end,
+                     [axis](const BuildItem &lhs, const BuildItem &rhs) {
+                       return lhs.centroid[axis] < rhs.centroid[axis];
+                     });
+    return middle;
+  }
+
+  size_t GetBin(const BuildItem &item, size_t axis,
+                const BoundingBox &centroid_bounds) const {
+    double min = centroid_bounds.GetMin()[axis];
+    double extent = centroid_bounds.GetMax()[axis] - min;
+    auto bin = static_cast<size_t>(options_.bin_count *
+                                   (item.centroid[axis] - min) / extent);
+    return std::min(bin, options_.bin_count - 1);
+  }
+
+  // Бинированный SAH: центроиды раскладываются по корзинам вдоль каждой оси,
+  // и среди границ между корзинами выбирается самая дешёвая. Возвращает
+  // begin, если листом оставить дешевле.
+  size_t PartitionSah(std::vector<BuildItem> &items, size_t begin, size_t end,
+                      const BoundingBox &bounds,
+                      const BoundingBox &centroid_bounds) {
+    struct Bin {
+      BoundingBox bounds;
+      size_t count = 0;
+    };
+
+    size_t bin_count = options_.bin_count;
+    std::vector<Bin> bins(bin_count);
+    std::vector<double> right_area(bin_count);
+    Split best;
+
+    for (size_t axis = 0; axis < 3; ++axis) {
+      if (centroid_bounds.Extent()[axis] <= 0.0) {
+        continue;
+      }
+
+      std::fill(bins.begin(), bins.end(), Bin{});
+      for (size_t i = begin; i < end; ++i) {
+        Bin &bin = bins[GetBin(items[i], axis, centroid_bounds)];
+        bin.bounds.Extend(items[i].bounds);
+        ++bin.count;
+      }
+
+      BoundingBox right_bounds;
+      for (size_t bin = bin_count - 1; bin > 0; --bin) {
+        right_bounds.Extend(bins[bin].bounds);
+        right_area[bin] = right_bounds.SurfaceArea();
+      }
+
+      BoundingBox left_bounds;
+      size_t left_count = 0;
+      for (size_t bin = 0; bin + 1 < bin_count; ++bin) {
+        left_bounds.Extend(bins[bin].bounds);
+        left_count += bins[bin].count;
+        size_t right_count = (end - begin) - left_count;
+        if (left_count == 0 || right_count == 0) {
+          continue;
+        }
+
+        double cost = left_bounds.SurfaceArea() * left_count +
+                      right_area[bin + 1] * right_count;
+        if (cost < best.cost) {
+          best = {axis, bin, cost};
+        }
+      }
+    }
+
+    if (best.cost == std::numeric_limits<double>::max()) {
+      return begin;
+    }
+
+    double area = bounds.SurfaceArea();
+    double split_cost = options_.traversal_cost;
+    if (area > 0.0) {
+      split_cost += options_.intersection_cost * best.cost / area;
+    }
+    double leaf_cost = options_.intersection_cost * (end - begin);
+    if (split_cost >= leaf_cost && end - begin <= options_.max_leaf_size) {
+      return begin;
+    }
+
+    auto middle = std::partition(
+        items.begin() + begin, items.begin() + end,
+        [&](const BuildItem &item) {
+          return GetBin(item, best.axis, centroid_bounds) <= best.bin;
+        });
+    return middle - items.begin();
+  }
+
+  void MakeLeaf(const std::vector<BuildItem> &items, size_t begin, size_t end,
+                uint32_t node_index) {
+    nodes_[node_index].offset = primitives_.size();
+    nodes_[node_index].count = end - begin;
+    // Сначала треугольники, потом сферы и экземпляры
+    for (PrimitiveKind kind : {PrimitiveKind::kTriangle, PrimitiveKind::kSphere,
+                               PrimitiveKind::kInstance}) {
+      for (size_t i = begin; i < end; ++i) {
+        if (items[i].primitive.kind == kind) {
+          primitives_.push_back(items[i].primitive);
+        }
+      }
+    }
+  }
+
+  template <class T, class BoundsFunc>
+  void RefitNodes(std::vector<BasicBvhNode<T>> &nodes,
+                  BoundsFunc &primitive_bounds, ThreadPool &pool) {
+    if (nodes.empty()) {
+      return;
+    }
+    auto refit_node = [&](uint32_t index) {
+      BasicBvhNode<T> &node = nodes[index];
+      if (node.IsLeaf()) {
+        BoundingBox bounds;
+        for (const BvhPrimitive &primitive : GetLeafPrimitives(node)) {
+          bounds.Extend(primitive_bounds(primitive));
+        }
+        node.bounds = BasicBoundingBox<T>(bounds);
+      } else {
+        node.bounds = nodes[index + 1].bounds;
+        node.bounds.Extend(nodes[node.offset].bounds);
+      }
+    };
+    // Поддерево занимает номера от своего корня до самого правого листа
+    auto subtree_end = [&](uint32_t index) {
+      while (!nodes[index].IsLeaf()) {
+        index = nodes[index].offset;
+      }
+      return index + 1;
+    };
+
+    std::vector<uint32_t> subtrees = {0};
+    std::vector<uint32_t> ancestors;
+    bool expanded = true;
+    while (expanded && subtrees.size() < 4 * pool.ThreadCount()) {
+      expanded = false;
+      std::vector<uint32_t> next;
+      for (uint32_t index : subtrees) {
+        if (nodes[index].IsLeaf()) {
+          next.push_back(index);
+          continue;
+        }
+        ancestors.push_back(index);
+        next.push_back(index + 1);
+        next.push_back(nodes[index].offset);
+        expanded = true;
+      }
+      subtrees = std::move(next);
+    }
+
+    pool.ParallelFor(subtrees.size(), [&](size_t i, size_t) {
+      uint32_t root = subtrees[i];
+      for (uint32_t index = subtree_end(root); index-- > root;) {
+        refit_node(index);
+      }
+    });
+    std::sort(ancestors.begin(), ancestors.end(), std::greater{});
+    for (uint32_t index : ancestors) {
+      refit_node(index);
+    }
+  }
+
+  // Считается по узлам в той точности, в которой они сейчас хранятся
+  void CollectStats() {
+    if (float_nodes_.empty()) {
+      CollectStats(nodes_);
+    } else {
+      CollectStats(float_nodes_);
+    }
+  }
+
+  template <class T>
+  void CollectStats(const std::vector<BasicBvhNode<T>> &nodes) {
+    stats_ = {};
+    stats_.primitive_count = primitives_.size();
+    stats_.node_count = nodes.size();
+    if (nodes.empty()) {
+      return;
+    }
+
+    stats_.min_leaf_size = std::numeric_limits<size_t>::max();
+    double root_area = nodes[0].bounds.SurfaceArea();
+
+    std::vector<std::pair<uint32_t, size_t>> stack = {{0, 0}};
+    while (!stack.empty()) {
+      auto [index, depth] = stack.back();
+      stack.pop_back();
+
+      const BasicBvhNode<T> &node = nodes[index];
+      double relative_area =
+          root_area > 0.0 ? node.bounds.SurfaceArea() / root_area : 1.0;
+      stats_.max_depth = std::max(stats_.max_depth, depth);
+
+      if (node.IsLeaf()) {
+        ++stats_.leaf_count;
+        stats_.min_leaf_size = std::min<size_t>(stats_.min_leaf_size, node.count);
+        stats_.max_leaf_size = std::max<size_t>(stats_.max_leaf_size, node.count);
+        stats_.sah_cost +=
+            options_.intersection_cost * node.count * relative_area;
+      } else {
+        stats_.sah_cost += options_.traversal_cost * relative_area;
+        stack.push_back({index + 1, depth + 1});
+        stack.push_back({node.offset, depth + 1});
+      }
+    }
+
+    stats_.average_leaf_size =
+        static_cast<double>(stats_.primitive_count) / stats_.leaf_count;
+  }
+
+  BvhOptions options_;
+  BvhStats stats_;
+  // SAH-стоимость сразу после построения, с ней сравнивается NeedsRebuild
+  double built_sah_cost_ = 0.0;
+  std::vector<BvhNode> nodes_;
+  std::vector<FloatBvhNode> float_nodes_;
+  CompressedBvhNodes compressed_nodes_;
+  std::vector<BvhPrimitive> primitives_;
+};
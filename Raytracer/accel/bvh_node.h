@@ -0,0 +1,32 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Глубже обход не заходит: стеки обхода имеют фиксированный размер
+constexpr size_t kBvhMaxDepth = 64;
+
+// kInstance - экземпляр меша, у которого своё BVH
+enum class PrimitiveKind : uint32_t { kTriangle, kSphere, kInstance };
+
+struct BvhPrimitive {
+  PrimitiveKind kind;
+  uint32_t index;
+};
+
+// Узел хранится в порядке обхода в глубину: левый ребёнок идёт сразу за
+// родителем, offset указывает на правого. У листа offset - начало диапазона
+// примитивов, count - их число.
+template <class T>
+struct BasicBvhNode {
+  BasicBoundingBox<T> bounds;
+  uint32_t offset = 0;
+  uint32_t count = 0;
+
+  bool IsLeaf() const { return count > 0; }
+};
+
+using BvhNode = BasicBvhNode<double>;
+using FloatBvhNode = BasicBvhNode<float>;
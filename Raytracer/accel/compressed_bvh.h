@@ -0,0 +1,323 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+#include "../utils/aligned_allocator.h"
+#include "bvh_node.h"
+#include "triangle_kernels.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+constexpr size_t kCompressedBvhWidth = 4;
+
+// Узел сжатого BVH: до четырёх детей в одной кэш-линии. Коробки детей
+// хранятся 8-битными числами в сетке узла: граница по оси равна
+// origin + q * 2^exponent. Сетка покрывает коробку узла, а границы детей
+// округлены наружу, так что раскодированная коробка содержит исходную.
+// Ребёнок с count = 0 - узел с номером child, иначе лист с примитивами
+// [child, child + count).
+struct alignas(kCacheLineSize) CompressedBvhNode {
+  std::array<float, 3> origin;
+  std::array<int8_t, 3> exponent;
+  // Бит i - у узла есть ребёнок i
+  uint8_t child_mask = 0;
+  std::array<std::array<uint8_t, kCompressedBvhWidth>, 3> lower;
+  std::array<std::array<uint8_t, kCompressedBvhWidth>, 3> upper;
+  std::array<uint32_t, kCompressedBvhWidth> child;
+  std::array<uint16_t, kCompressedBvhWidth> count;
+
+  bool IsLeaf(size_t index) const { return count[index] > 0; }
+
+  float GetScale(size_t axis) const {
+    return std::bit_cast<float>(static_cast<uint32_t>(exponent[axis] + 127)
+                                << 23);
+  }
+
+  // q * 2^exponent вычисляется точно, так что и скалярный, и SIMD-код
+  // получают границу одним округлением сложения
+  float Decode(size_t axis, uint8_t value) const {
+    return origin[axis] + static_cast<float>(value) * GetScale(axis);
+  }
+
+  template <class T = double>
+  BasicBoundingBox<T> GetChildBounds(size_t index) const {
+    BasicVector<T> min, max;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      min[axis] = Decode(axis, lower[axis][index]);
+      max[axis] = Decode(axis, upper[axis][index]);
+    }
+    return {min, max};
+  }
+};
+
+static_assert(sizeof(CompressedBvhNode) == kCacheLineSize);
+
+using CompressedBvhNodes = AlignedVector<CompressedBvhNode>;
+
+// Сетка одной оси узла: origin не больше lower, а 255 шагов доходят до
+// upper. nullopt, если границы не помещаются во float.
+std::optional<std::pair<float, int8_t>> MakeCompressedGrid(double lower,
+                                                           double upper) {
+  float origin = static_cast<float>(lower);
+  if (origin > lower) {
+    origin = std::nextafter(origin, std::numeric_limits<float>::lowest());
+  }
+  if (!std::isfinite(origin) || !std::isfinite(upper)) {
+    return std::nullopt;
+  }
+
+  int exponent = -126;
+  double step = (upper - origin) / 255.0;
+  if (step > 0.0) {
+    std::frexp(step, &exponent);
+    exponent = std::max(exponent, -126);
+  }
+  // Сложение во float могло округлиться вниз
+  for (; exponent <= 127; ++exponent) {
+    float scale =
+        std::bit_cast<float>(static_cast<uint32_t>(exponent + 127) << 23);
+    if (origin + 255.0f * scale >= upper) {
+      return std::pair{origin, static_cast<int8_t>(exponent)};
+    }
+  }
+  return std::nullopt;
+}
+
+// Наибольший код не больше lower и наименьший не меньше upper
+std::pair<uint8_t, uint8_t> QuantizeInterval(const CompressedBvhNode &node,
+                                             size_t axis, double lower,
+                                             double upper) {
+  double scale = node.GetScale(axis);
+  double low = std::floor((lower - node.origin[axis]) / scale);
+  double high = std::ceil((upper - node.origin[axis]) / scale);
+  auto low_code = static_cast<uint8_t>(std::clamp(low, 0.0, 255.0));
+  auto high_code = static_cast<uint8_t>(std::clamp(high, 0.0, 255.0));
+  while (low_code > 0 && node.Decode(axis, low_code) > lower) {
+    --low_code;
+  }
+  while (high_code < 255 && node.Decode(axis, high_code) < upper) {
+    ++high_code;
+  }
+  return {low_code, high_code};
+}
+
+// Сворачивает поддерево двоичного узла binary_index в сжатые узлы,
+// дописывая их в out в порядке обхода в глубину
+template <class T>
+bool AppendCompressedNode(const std::vector<BasicBvhNode<T>> &nodes,
+                          uint32_t binary_index, CompressedBvhNodes &out) {
+  std::array<uint32_t, kCompressedBvhWidth> children;
+  size_t child_count = 0;
+  if (nodes[binary_index].IsLeaf()) {
+    children[child_count++] = binary_index;
+  } else {
+    children[child_count++] = binary_index + 1;
+    children[child_count++] = nodes[binary_index].offset;
+  }
+  // Внутренний ребёнок с наибольшей площадью заменяется своими детьми,
+  // пока они помещаются в узел
+  while (child_count < kCompressedBvhWidth) {
+    size_t best = child_count;
+    for (size_t i = 0; i < child_count; ++i) {
+      if (!nodes[children[i]].IsLeaf() &&
+          (best == child_count ||
+           nodes[children[i]].bounds.SurfaceArea() >
+               nodes[children[best]].bounds.SurfaceArea())) {
+        best = i;
+      }
+    }
+    if (best == child_count) {
+      break;
+    }
+    children[child_count++] = nodes[children[best]].offset;
+    ++children[best];
+  }
+
+  CompressedBvhNode node{};
+  const BasicBoundingBox<T> &bounds = nodes[binary_index].bounds;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    auto grid = MakeCompressedGrid(bounds.GetMin()[axis],
+                                   bounds.GetMax()[axis]);
+    if (!grid) {
+      return false;
+    }
+    std::tie(node.origin[axis], node.exponent[axis]) = *grid;
+  }
+
+  uint32_t index = out.size();
+  out.emplace_back();
+  for (size_t i = 0; i < child_count; ++i) {
+    const BasicBvhNode<T> &child = nodes[children[i]];
+    for (size_t axis = 0; axis < 3; ++axis) {
+      std::tie(node.lower[axis][i], node.upper[axis][i]) =
+          QuantizeInterval(node, axis, child.bounds.GetMin()[axis],
+                           child.bounds.GetMax()[axis]);
+    }
+    node.child_mask |= 1 << i;
+    if (child.IsLeaf()) {
+      if (child.count > std::numeric_limits<uint16_t>::max()) {
+        return false;
+      }
+      node.child[i] = child.offset;
+      node.count[i] = child.count;
+    } else {
+      node.child[i] = out.size();
+      if (!AppendCompressedNode(nodes, children[i], out)) {
+        return false;
+      }
+    }
+  }
+  out[index] = node;
+  return true;
+}
+
+// nullopt, если дерево не сжимается: лист больше 65535 примитивов или
+// коробка за пределами float
+template <class T>
+std::optional<CompressedBvhNodes>
+CompressBvhNodes(const std::vector<BasicBvhNode<T>> &nodes) {
+  CompressedBvhNodes compressed;
+  if (nodes.empty()) {
+    return compressed;
+  }
+  compressed.reserve(nodes.size() / 2 + 1);
+  if (!AppendCompressedNode(nodes, 0, compressed)) {
+    return std::nullopt;
+  }
+  compressed.shrink_to_fit();
+  return compressed;
+}
+
+// Ядра проверяют луч сразу со всеми детьми узла: возвращают маску детей,
+// коробки которых луч пересекает на [0, t_max], и расстояния до входа в
+// них в t_near. Результат совпадает с BasicBoxRay::Intersect для
+// раскодированных коробок бит в бит.
+template <class T>
+using CompressedNodeKernel = uint32_t (*)(const CompressedBvhNode &node,
+                                          const BasicBoxRay<T> &ray, T t_max,
+                                          T *t_near);
+
+template <class T>
+uint32_t IntersectCompressedChildrenScalar(const CompressedBvhNode &node,
+                                           const BasicBoxRay<T> &ray,
+                                           std::type_identity_t<T> t_max,
+                                           T *t_near) {
+  uint32_t hit = 0;
+  for (size_t child = 0; child < kCompressedBvhWidth; ++child) {
+    if ((node.child_mask >> child & 1) == 0) {
+      continue;
+    }
+    t_near[child] = ray.Intersect(node.GetChildBounds<T>(child), t_max);
+    if (t_near[child] <= t_max) {
+      hit |= uint32_t{1} << child;
+    }
+  }
+  return hit;
+}
+
+#ifdef RAYTRACER_X86_KERNELS
+
+// Четыре 8-битных кода в четыре float
+__attribute__((target("avx2"))) inline __m128
+DecodeCompressedAxis(const CompressedBvhNode &node, size_t axis,
+                     const std::array<uint8_t, kCompressedBvhWidth> &codes) {
+  __m128i bytes = _mm_cvtsi32_si128(std::bit_cast<int32_t>(codes));
+  __m128 values = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(bytes));
+  return _mm_add_ps(_mm_set1_ps(node.origin[axis]),
+                    _mm_mul_ps(values, _mm_set1_ps(node.GetScale(axis))));
+}
+
+// Дети раскодируются во float, а slab-тест идёт в точности луча: для
+// double четыре ребёнка занимают регистр AVX2
+__attribute__((target("avx2"))) RAYTRACER_NO_FP_CONTRACT uint32_t
+IntersectCompressedChildrenAvx2(const CompressedBvhNode &node,
+                                const BoxRay &ray, double t_max,
+                                double *t_near) {
+  const __m256d robust_factor = _mm256_set1_pd(1.0 + 1e-12);
+  __m256d near = _mm256_setzero_pd();
+  __m256d far = _mm256_set1_pd(t_max);
+  for (size_t axis = 0; axis < 3; ++axis) {
+    __m256d origin = _mm256_set1_pd(ray.GetOrigin()[axis]);
+    __m256d inv_direction = _mm256_set1_pd(ray.GetInvDirection()[axis]);
+    __m256d lower =
+        _mm256_cvtps_pd(DecodeCompressedAxis(node, axis, node.lower[axis]));
+    __m256d upper =
+        _mm256_cvtps_pd(DecodeCompressedAxis(node, axis, node.upper[axis]));
+    __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(lower, origin), inv_direction);
+    __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(upper, origin), inv_direction);
+    // Сравнения и выбор как в BoxRay::Intersect, включая случаи с NaN
+    __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+    __m256d low = _mm256_blendv_pd(t0, t1, swap);
+    __m256d high =
+        _mm256_mul_pd(_mm256_blendv_pd(t1, t0, swap), robust_factor);
+    near = _mm256_blendv_pd(near, low, _mm256_cmp_pd(low, near, _CMP_GT_OQ));
+    far = _mm256_blendv_pd(far, high, _mm256_cmp_pd(high, far, _CMP_LT_OQ));
+  }
+  _mm256_storeu_pd(t_near, near);
+  return _mm256_movemask_pd(_mm256_cmp_pd(near, far, _CMP_LE_OQ)) &
+         node.child_mask;
+}
+
+__attribute__((target("avx2"))) RAYTRACER_NO_FP_CONTRACT uint32_t
+IntersectCompressedChildrenAvx2(const CompressedBvhNode &node,
+                                const FloatBoxRay &ray, float t_max,
+                                float *t_near) {
+  const __m128 robust_factor = _mm_set1_ps(1.0f + 1e-6f);
+  __m128 near = _mm_setzero_ps();
+  __m128 far = _mm_set1_ps(t_max);
+  for (size_t axis = 0; axis < 3; ++axis) {
+    __m128 origin = _mm_set1_ps(ray.GetOrigin()[axis]);
+    __m128 inv_direction = _mm_set1_ps(ray.GetInvDirection()[axis]);
+    __m128 lower = DecodeCompressedAxis(node, axis, node.lower[axis]);
+    __m128 upper = DecodeCompressedAxis(node, axis, node.upper[axis]);
+    __m128 t0 = _mm_mul_ps(_mm_sub_ps(lower, origin), inv_direction);
+    __m128 t1 = _mm_mul_ps(_mm_sub_ps(upper, origin), inv_direction);
+    __m128 swap = _mm_cmp_ps(t0, t1, _CMP_GT_OQ);
+    __m128 low = _mm_blendv_ps(t0, t1, swap);
+    __m128 high = _mm_mul_ps(_mm_blendv_ps(t1, t0, swap), robust_factor);
+    near = _mm_blendv_ps(near, low, _mm_cmp_ps(low, near, _CMP_GT_OQ));
+    far = _mm_blendv_ps(far, high, _mm_cmp_ps(high, far, _CMP_LT_OQ));
+  }
+  _mm_storeu_ps(t_near, near);
+  return _mm_movemask_ps(_mm_cmp_ps(near, far, _CMP_LE_OQ)) & node.child_mask;
+}
+
+#endif
+
+template <class T = double>
+CompressedNodeKernel<T> GetCompressedNodeKernel(TriangleKernelKind kind) {
+#ifdef RAYTRACER_X86_KERNELS
+  if (kind != TriangleKernelKind::kScalar) {
+    return IntersectCompressedChildrenAvx2;
+  }
+#endif
+  return IntersectCompressedChildrenScalar<T>;
+}
+
+const CompressedNodeKernel<double> kCompressedNodeKernel =
+    GetCompressedNodeKernel(DetectTriangleKernel());
+
+const CompressedNodeKernel<float> kFloatCompressedNodeKernel =
+    GetCompressedNodeKernel<float>(DetectTriangleKernel());
+
+uint32_t IntersectCompressedChildren(const CompressedBvhNode &node,
+                                     const BoxRay &ray, double t_max,
+                                     double *t_near) {
+  return kCompressedNodeKernel(node, ray, t_max, t_near);
+}
+
+uint32_t IntersectCompressedChildren(const CompressedBvhNode &node,
+                                     const FloatBoxRay &ray, float t_max,
+                                     float *t_near) {
+  return kFloatCompressedNodeKernel(node, ray, t_max, t_near);
+}
@@ -0,0 +1,403 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+#include "../geometry/vector.h"
+#include "../reader/object.h"
+#include "../utils/thread_pool.h"
+#include "bvh_node.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Линейное построение BVH (LBVH, Karras 2012). Центроиды примитивов
+// кодируются 63-битными кодами Мортона, примитивы сортируются по кодам,
+// и дерево получается делением отсортированного массива по старшему
+// различающемуся биту кода. Каждый узел такого дерева находится
+// независимо от остальных, поэтому все шаги идут параллельно. Дерево
+// получается хуже, чем по SAH, зато строится во много раз быстрее.
+
+constexpr size_t kMortonBitsPerAxis = 21;
+
+// Раздвигает младшие 21 бит x так, что между ними встают по два нуля
+uint64_t SpreadMortonBits(uint64_t x) {
+  x &= (uint64_t{1} << kMortonBitsPerAxis) - 1;
+  x = (x | x << 32) & 0x001f00000000ffffULL;
+  x = (x | x << 16) & 0x001f0000ff0000ffULL;
+  x = (x | x << 8) & 0x100f00f00f00f00fULL;
+  x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+  x = (x | x << 2) & 0x1249249249249249ULL;
+  return x;
+}
+
+// Код Мортона точки внутри bounds: биты осей чередуются, x - старший
+uint64_t GetMortonCode(const Vector &point, const BoundingBox &bounds) {
+  const double scale = (uint64_t{1} << kMortonBitsPerAxis) - 1;
+  uint64_t code = 0;
+  for (size_t axis = 0; axis < 3; ++axis) {
+    double min = bounds.GetMin()[axis];
+    double extent = bounds.GetMax()[axis] - min;
+    double relative = extent > 0.0 ? (point[axis] - min) / extent : 0.0;
+    auto cell =
+        static_cast<uint64_t>(std::clamp(relative, 0.0, 1.0) * scale);
+    code |= SpreadMortonBits(cell) << (2 - axis);
+  }
+  return code;
+}
+
+// Устойчивая LSD-сортировка по младшим key_bits битам ключа, по 11 бит за
+// проход; values переставляются вместе с ключами. Массив делится на блоки
+// по числу исполнителей: блоки параллельно считают гистограммы цифр, по
+// префиксным суммам каждый блок узнаёт, куда класть свои элементы, и
+// раскладывает их тоже параллельно. Проходы, в которых у всех ключей одна
+// и та же цифра, пропускаются.
+void ParallelRadixSort(std::vector<uint64_t> &keys,
+                       std::vector<uint32_t> &values, size_t key_bits,
+                       ThreadPool &pool) {
+  constexpr size_t kDigitBits = 11;
+  constexpr size_t kDigits = size_t{1} << kDigitBits;
+  // Меньшие блоки не окупают синхронизацию
+  constexpr size_t kMinBlockSize = 1 << 14;
+
+  size_t count = keys.size();
+  size_t block_count =
+      std::clamp<size_t>(count / kMinBlockSize, 1, pool.ThreadCount());
+  auto block_begin = [&](size_t block) { return block * count / block_count; };
+
+  std::vector<uint64_t> sorted_keys(count);
+  std::vector<uint32_t> sorted_values(count);
+  std::vector<std::array<size_t, kDigits>> offsets(block_count);
+
+  for (size_t shift = 0; shift < key_bits; shift += kDigitBits) {
+    pool.ParallelFor(block_count, [&](size_t block, size_t) {
+      auto &histogram = offsets[block];
+      histogram.fill(0);
+      for (size_t i = block_begin(block); i < block_begin(block + 1); ++i) {
+        ++histogram[(keys[i] >> shift) & (kDigits - 1)];
+      }
+    });
+
+    bool single_digit = false;
+    for (size_t digit = 0; digit < kDigits && !single_digit; ++digit) {
+      size_t digit_count = 0;
+      for (const auto &histogram : offsets) {
+        digit_count += histogram[digit];
+      }
+      single_digit = digit_count == count;
+    }
+    if (single_digit) {
+      continue;
+    }
+
+    // Блок кладёт цифру после всех меньших цифр и после той же цифры из
+    // предыдущих блоков
+    size_t total = 0;
+    for (size_t digit = 0; digit < kDigits; ++digit) {
+      for (auto &histogram : offsets) {
+        size_t digit_count = histogram[digit];
+        histogram[digit] = total;
+        total += digit_count;
+      }
+    }
+
+    pool.ParallelFor(block_count, [&](size_t block, size_t) {
+      auto &next = offsets[block];
+      for (size_t i = block_begin(block); i < block_begin(block + 1); ++i) {
+        size_t position = next[(keys[i] >> shift) & (kDigits - 1)]++;
+        sorted_keys[position] = keys[i];
+        sorted_values[position] = values[i];
+      }
+    });
+    keys.swap(sorted_keys);
+    values.swap(sorted_values);
+  }
+}
+
+// Переписывает дерево в порядке обхода в глубину, пропуская узлы, до
+// которых обход не доходит
+std::vector<BvhNode> CompactBvhNodes(const std::vector<BvhNode> &nodes) {
+  std::vector<BvhNode> compact;
+  compact.reserve(nodes.size());
+  // Пары (старый узел, новый родитель, которому нужен offset правого ребёнка)
+  std::vector<std::pair<uint32_t, uint32_t>> stack = {{0, 0}};
+  while (!stack.empty()) {
+    auto [index, parent] = stack.back();
+    stack.pop_back();
+    // У левого ребёнка номер известен заранее, у правого - записываем
+    if (!compact.empty() && parent + 1 != compact.size()) {
+      compact[parent].offset = compact.size();
+    }
+    uint32_t position = compact.size();
+    compact.push_back(nodes[index]);
+    if (!nodes[index].IsLeaf()) {
+      stack.push_back({nodes[index].offset, position});
+      stack.push_back({index + 1, position});
+    }
+  }
+  return compact;
+}
+
+struct LinearBvh {
+  std::vector<BvhNode> nodes;
+  std::vector<BvhPrimitive> primitives;
+};
+
+// Строит дерево в том же формате, что и Bvh: узлы в порядке обхода в
+// глубину, в листе не больше max_leaf_size примитивов, треугольники листа
+// идут первыми. Результат не зависит от числа потоков.
+LinearBvh BuildLinearBvh(const std::vector<Object> &objects,
+                         const std::vector<SphereObject> &sphere_objects,
+                         std::span<const BoundingBox> instance_bounds,
+                         size_t max_leaf_size, ThreadPool &pool) {
+  const size_t triangle_count = objects.size();
+  const size_t sphere_end = triangle_count + sphere_objects.size();
+  const size_t count = sphere_end + instance_bounds.size();
+  LinearBvh result;
+  if (count == 0) {
+    return result;
+  }
+
+  // Параллельные шаги делят номера на блоки подряд идущих: задача пула
+  // на каждый номер стоила бы дороже самой работы
+  const size_t block_count = std::min(count, 4 * pool.ThreadCount());
+  auto block_begin = [&](size_t block) { return block * count / block_count; };
+  auto parallel_for = [&](size_t size, auto &&func) {
+    size_t blocks = std::min(size, block_count);
+    pool.ParallelFor(blocks, [&](size_t block, size_t) {
+      for (size_t i = block * size / blocks; i < (block + 1) * size / blocks;
+           ++i) {
+        func(i);
+      }
+    });
+  };
+
+  std::vector<BoundingBox> boxes(count);
+  std::vector<BoundingBox> block_centroid_bounds(block_count);
+  pool.ParallelFor(block_count, [&](size_t block, size_t) {
+    for (size_t i = block_begin(block); i < block_begin(block + 1); ++i) {
+      if (i < triangle_count) {
+        boxes[i] = GetBoundingBox(objects[i].polygon);
+      } else if (i < sphere_end) {
+        boxes[i] = GetBoundingBox(sphere_objects[i - triangle_count].sphere);
+      } else {
+        boxes[i] = instance_bounds[i - sphere_end];
+      }
+      block_centroid_bounds[block].Extend(boxes[i].Centroid());
+    }
+  });
+  BoundingBox centroid_bounds;
+  for (const BoundingBox &bounds : block_centroid_bounds) {
+    centroid_bounds.Extend(bounds);
+  }
+
+  std::vector<uint64_t> codes(count);
+  std::vector<uint32_t> order(count);
+  parallel_for(count, [&](size_t i) {
+    codes[i] = GetMortonCode(boxes[i].Centroid(), centroid_bounds);
+    order[i] = i;
+  });
+  ParallelRadixSort(codes, order, 3 * kMortonBitsPerAxis, pool);
+
+  // Листья - примитивы в порядке кодов
+  std::vector<BoundingBox> leaf_bounds(count);
+  result.primitives.resize(count);
+  parallel_for(count, [&](size_t i) {
+    uint32_t index = order[i];
+    leaf_bounds[i] = boxes[index];
+    if (index < triangle_count) {
+      result.primitives[i] = {PrimitiveKind::kTriangle, index};
+    } else if (index < sphere_end) {
+      result.primitives[i] = {PrimitiveKind::kSphere,
+                              static_cast<uint32_t>(index - triangle_count)};
+    } else {
+      result.primitives[i] = {PrimitiveKind::kInstance,
+                              static_cast<uint32_t>(index - sphere_end)};
+    }
+  });
+
+  // Ссылка на ребёнка: лист (примитив) помечен старшим битом
+  constexpr uint32_t kLeafFlag = uint32_t{1} << 31;
+  const size_t internal_count = count - 1;
+  std::vector<uint32_t> first(internal_count), last(internal_count);
+  std::vector<uint32_t> left(internal_count), right(internal_count);
+  std::vector<uint32_t> parent(internal_count), leaf_parent(count);
+
+  // Длина общего префикса кодов i и j; равные коды различаются номерами
+  auto common_prefix = [&](int64_t i, int64_t j) {
+    if (j < 0 || j >= static_cast<int64_t>(count)) {
+      return -1;
+    }
+    if (codes[i] == codes[j]) {
+      return 64 + std::countl_zero(static_cast<uint32_t>(i ^ j));
+    }
+    return std::countl_zero(codes[i] ^ codes[j]);
+  };
+
+  // Внутренний узел i покрывает отрезок листьев, один конец которого - i;
+  // второй конец и точка деления находятся двоичным поиском
+  parallel_for(internal_count, [&](size_t node) {
+    auto i = static_cast<int64_t>(node);
+    int64_t direction =
+        common_prefix(i, i + 1) > common_prefix(i, i - 1) ? 1 : -1;
+    int min_prefix = common_prefix(i, i - direction);
+
+    int64_t max_length = 2;
+    while (common_prefix(i, i + max_length * direction) > min_prefix) {
+      max_length *= 2;
+    }
+    int64_t length = 0;
+    for (int64_t step = max_length / 2; step >= 1; step /= 2) {
+      if (common_prefix(i, i + (length + step) * direction) > min_prefix) {
+        length += step;
+      }
+    }
+    int64_t j = i + length * direction;
+
+    int node_prefix = common_prefix(i, j);
+    int64_t split = 0;
+    int64_t step = length;
+    do {
+      step = (step + 1) / 2;
+      if (common_prefix(i, i + (split + step) * direction) > node_prefix) {
+        split += step;
+      }
+    } while (step > 1);
+    auto gamma = static_cast<uint32_t>(i + split * direction +
+                                       std::min<int64_t>(direction, 0));
+
+    first[node] = std::min(i, j);
+    last[node] = std::max(i, j);
+    if (first[node] == gamma) {
+      left[node] = gamma | kLeafFlag;
+      leaf_parent[gamma] = node;
+    } else {
+      left[node] = gamma;
+      parent[gamma] = node;
+    }
+    if (last[node] == gamma + 1) {
+      right[node] = (gamma + 1) | kLeafFlag;
+      leaf_parent[gamma + 1] = node;
+    } else {
+      right[node] = gamma + 1;
+      parent[gamma + 1] = node;
+    }
+  });
+
+  // Коробки и число узлов результата в поддеревьях считаются снизу вверх:
+  // из каждого листа поднимаемся, пока не придём в узел первыми, - второй
+  // пришедший уже видит коробку соседнего поддерева
+  std::vector<BoundingBox> internal_bounds(internal_count);
+  std::vector<uint32_t> subtree_size(internal_count);
+  auto visits = std::make_unique<std::atomic<uint32_t>[]>(internal_count);
+  auto child_bounds = [&](uint32_t child) -> const BoundingBox & {
+    return child & kLeafFlag ? leaf_bounds[child & ~kLeafFlag]
+                             : internal_bounds[child];
+  };
+  auto child_size = [&](uint32_t child) {
+    return child & kLeafFlag ? 1 : subtree_size[child];
+  };
+  // Отрезок не больше max_leaf_size примитивов становится одним листом
+  auto is_leaf = [&](uint32_t child) {
+    return (child & kLeafFlag) ||
+           last[child] - first[child] + 1 <= max_leaf_size;
+  };
+
+  if (internal_count > 0) {
+    parallel_for(count, [&](size_t leaf) {
+      uint32_t node = leaf_parent[leaf];
+      while (visits[node].fetch_add(1, std::memory_order_acq_rel) == 1) {
+        internal_bounds[node] = child_bounds(left[node]);
+        internal_bounds[node].Extend(child_bounds(right[node]));
+        subtree_size[node] =
+            is_leaf(node)
+                ? 1
+                : 1 + child_size(left[node]) + child_size(right[node]);
+        if (node == 0) {
+          break;
+        }
+        node = parent[node];
+      }
+    });
+  }
+
+  // Раскладка в порядке обхода в глубину: левое поддерево занимает
+  // subtree_size узлов сразу за родителем. Верхние уровни раскладываются
+  // последовательно, пока не наберётся достаточно поддеревьев, а
+  // поддеревья - параллельно.
+  struct Task {
+    uint32_t child;
+    uint32_t position;
+    uint32_t depth;
+  };
+  const uint32_t root = internal_count > 0 ? 0 : kLeafFlag;
+  result.nodes.resize(child_size(root));
+
+  std::atomic<bool> truncated = false;
+  auto emit = [&](const Task &task, auto &&push) {
+    uint32_t child = task.child;
+    uint32_t begin = child & kLeafFlag ? child & ~kLeafFlag : first[child];
+    uint32_t end = child & kLeafFlag ? begin + 1 : last[child] + 1;
+    BvhNode &node = result.nodes[task.position];
+    node.bounds = child_bounds(child);
+
+    // На предельной глубине поддерево сворачивается в лист, а его узлы,
+    // учтённые в subtree_size, остаются дырой, которую потом убираем
+    bool truncate = !is_leaf(child) && task.depth + 1 >= kBvhMaxDepth;
+    if (truncate) {
+      truncated.store(true, std::memory_order_relaxed);
+    }
+    if (is_leaf(child) || truncate) {
+      node.offset = begin;
+      node.count = end - begin;
+      std::stable_partition(
+          result.primitives.begin() + begin, result.primitives.begin() + end,
+          [](const BvhPrimitive &primitive) {
+            return primitive.kind == PrimitiveKind::kTriangle;
+          });
+      return;
+    }
+    uint32_t right_position = task.position + 1 + child_size(left[child]);
+    node.offset = right_position;
+    node.count = 0;
+    push(Task{left[child], task.position + 1, task.depth + 1});
+    push(Task{right[child], right_position, task.depth + 1});
+  };
+
+  std::vector<Task> subtrees = {{root, 0, 0}};
+  const size_t wanted_subtrees = 4 * pool.ThreadCount();
+  bool expanded = true;
+  while (expanded && subtrees.size() < wanted_subtrees) {
+    expanded = false;
+    std::vector<Task> next;
+    for (const Task &task : subtrees) {
+      if (is_leaf(task.child)) {
+        next.push_back(task);
+        continue;
+      }
+      emit(task, [&](const Task &child_task) { next.push_back(child_task); });
+      expanded = true;
+    }
+    subtrees = std::move(next);
+  }
+
+  pool.ParallelFor(subtrees.size(), [&](size_t index, size_t) {
+    std::vector<Task> stack = {subtrees[index]};
+    while (!stack.empty()) {
+      Task task = stack.back();
+      stack.pop_back();
+      emit(task, [&](const Task &child_task) { stack.push_back(child_task); });
+    }
+  });
+
+  if (truncated) {
+    result.nodes = CompactBvhNodes(result.nodes);
+  }
+  return result;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+#include "../geometry/ray.h"
+#include "../geometry/transform.h"
+#include "../geometry/vector.h"
+#include "../options/bvh_options.h"
+#include "../reader/object.h"
+#include "bvh.h"
+#include "triangle_store.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Меш, который может встречаться в сцене много раз. Его треугольники в
+// собственных координатах хранятся один раз вместе со своим BVH (нижний
+// уровень), а экземпляры только ссылаются на него.
+struct Mesh {
+  std::string name;
+  std::vector<Object> objects;
+  Bvh bvh;
+  // Номера объектов в порядке triangles
+  std::vector<uint32_t> triangle_order;
+  TriangleStore triangles;
+
+  Mesh(std::string name, std::vector<Object> objects)
+      : name(std::move(name)), objects(std::move(objects)) {}
+
+  void BuildAccelerator(const BvhOptions &options) {
+    bvh = Bvh(objects, {}, options);
+    triangle_order = bvh.ReorderTriangles();
+    triangles = TriangleStore(objects, triangle_order);
+  }
+
+  BoundingBox GetBounds() const {
+    return bvh.GetNodes().empty() ? BoundingBox() : bvh.GetNodes()[0].bounds;
+  }
+};
+
+// Экземпляр меша: to_world переводит координаты меша в мировые
+struct Instance {
+  uint32_t mesh = 0;
+  Transform to_world;
+  Transform to_object;
+
+  Instance(uint32_t mesh, const Transform &to_world)
+      : mesh(mesh), to_world(to_world), to_object(to_world.Inverse()) {}
+
+  // Нормаль из координат меша в мировые, не нормированная
+  Vector NormalToWorld(const Vector &normal) const {
+    return to_object.ApplyTransposed(normal);
+  }
+};
+
+// Луч в координатах экземпляра. Направление после преобразования заново
+// нормируется, поэтому расстояние вдоль луча там в scale раз больше
+// мирового.
+struct InstanceRay {
+  Ray ray;
+  double scale;
+};
+
+InstanceRay ToInstanceSpace(const Instance &instance, const Ray &ray) {
+  Vector direction = instance.to_object.ApplyToVector(ray.GetDirection());
+  return {Ray(instance.to_object.ApplyToPoint(ray.GetOrigin()), direction),
+          Length(direction)};
+}
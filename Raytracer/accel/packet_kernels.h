@@ -0,0 +1,346 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+#include "../geometry/ray.h"
+#include "../utils/aligned_allocator.h"
+#include "triangle_kernels.h"
+#include "triangle_store.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Пучок до kMaxSize лучей, которые обходят BVH вместе. Компоненты лежат
+// отдельными массивами, чтобы ядра проверяли несколько лучей одной
+// инструкцией; сами лучи хранятся для скалярных проверок. Набор лучей
+// задаётся битовой маской: бит i - луч i.
+struct PacketRays {
+  static constexpr size_t kMaxSize = 16;
+
+  size_t size = 0;
+  std::array<Ray, kMaxSize> rays;
+  alignas(kCacheLineSize) std::array<double, kMaxSize> origin_x = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> origin_y = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> origin_z = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> direction_x = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> direction_y = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> direction_z = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> inv_direction_x = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> inv_direction_y = {};
+  alignas(kCacheLineSize) std::array<double, kMaxSize> inv_direction_z = {};
+  // Дальняя граница отрезка; при поиске ближайшего попадания - расстояние
+  // до лучшего найденного
+  alignas(kCacheLineSize) std::array<double, kMaxSize> t_max = {};
+
+  void Clear() { size = 0; }
+
+  void Add(const Ray &ray, double max_distance) {
+    size_t lane = size++;
+    const Vector &origin = ray.GetOrigin();
+    const Vector &direction = ray.GetDirection();
+    rays[lane] = ray;
+    origin_x[lane] = origin[0];
+    origin_y[lane] = origin[1];
+    origin_z[lane] = origin[2];
+    direction_x[lane] = direction[0];
+    direction_y[lane] = direction[1];
+    direction_z[lane] = direction[2];
+    inv_direction_x[lane] = 1.0 / direction[0];
+    inv_direction_y[lane] = 1.0 / direction[1];
+    inv_direction_z[lane] = 1.0 / direction[2];
+    t_max[lane] = max_distance;
+  }
+
+  uint32_t AllLanes() const { return (uint32_t{1} << size) - 1; }
+};
+
+// Треугольники, в которые попали лучи пучка; расстояния - в PacketRays::t_max
+struct PacketTriangleHits {
+  std::array<uint32_t, PacketRays::kMaxSize> index = {};
+  std::array<double, PacketRays::kMaxSize> u = {};
+  std::array<double, PacketRays::kMaxSize> v = {};
+};
+
+// Ядра повторяют вычисления одиночного луча бит в бит, поэтому пучок
+// находит те же попадания, что и лучи по отдельности. Для этого и
+// векторные ядра, и скалярное пересечение собираются без слияния в FMA
+// (RAYTRACER_NO_FP_CONTRACT).
+
+// Лучи из active, пересекающие коробку на отрезке [0, t_max]. В *t_near
+// записывается ближайший вход среди них.
+using PacketBoxKernel = uint32_t (*)(const BoundingBox &box,
+                                     const PacketRays &rays, uint32_t active,
+                                     double *t_near);
+
+// Проверяет треугольники [first, first + count) для лучей из active. Лучам,
+// нашедшим попадание ближе t_max, уменьшает t_max и записывает треугольник
+// в hits; возвращает маску таких лучей.
+using PacketTriangleKernel = uint32_t (*)(const TriangleStore &store,
+                                          uint32_t first, uint32_t count,
+                                          PacketRays &rays, uint32_t active,
+                                          PacketTriangleHits *hits);
+
+uint32_t IntersectBoxPacketScalar(const BoundingBox &box,
+                                  const PacketRays &rays, uint32_t active,
+                                  double *t_near) {
+  uint32_t hit = 0;
+  *t_near = std::numeric_limits<double>::infinity();
+  for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1) {
+    size_t lane = std::countr_zero(lanes);
+    BoxRay box_ray({rays.origin_x[lane], rays.origin_y[lane],
+                    rays.origin_z[lane]},
+                   {rays.inv_direction_x[lane], rays.inv_direction_y[lane],
+                    rays.inv_direction_z[lane]});
+    double t = box_ray.Intersect(box, rays.t_max[lane]);
+    if (t <= rays.t_max[lane]) {
+      hit |= uint32_t{1} << lane;
+      *t_near = std::min(*t_near, t);
+    }
+  }
+  return hit;
+}
+
+uint32_t IntersectTrianglesPacketScalar(const TriangleStore &store,
+                                        uint32_t first, uint32_t count,
+                                        PacketRays &rays, uint32_t active,
+                                        PacketTriangleHits *hits) {
+  uint32_t found = 0;
+  for (uint32_t lanes = active; lanes != 0; lanes &= lanes - 1) {
+    size_t lane = std::countr_zero(lanes);
+    TriangleBatchHit hit;
+    if (IntersectTrianglesScalar(store, first, count, rays.rays[lane],
+                                 rays.t_max[lane], &hit)) {
+      rays.t_max[lane] = hit.hit.distance;
+      hits->index[lane] = hit.index;
+      hits->u[lane] = hit.hit.u;
+      hits->v[lane] = hit.hit.v;
+      found |= uint32_t{1} << lane;
+    }
+  }
+  return found;
+}
+
+#ifdef RAYTRACER_X86_KERNELS
+
+// Маска полос регистра по четырём младшим битам bits
+__attribute__((target("avx2"))) inline __m256d GroupLaneMask(uint32_t bits) {
+  const __m256i lane_bits = _mm256_set_epi64x(8, 4, 2, 1);
+  return _mm256_castsi256_pd(_mm256_cmpeq_epi64(
+      _mm256_and_si256(_mm256_set1_epi64x(bits), lane_bits), lane_bits));
+}
+
+// Четыре луча на регистр; для двойной точности это вся ширина AVX2
+__attribute__((target("avx2"))) RAYTRACER_NO_FP_CONTRACT uint32_t
+IntersectBoxPacketAvx2(const BoundingBox &box, const PacketRays &rays,
+                       uint32_t active, double *t_near) {
+  const __m256d robust_factor = _mm256_set1_pd(1.0 + 1e-12);
+  const __m256d infinity =
+      _mm256_set1_pd(std::numeric_limits<double>::infinity());
+
+  const double *origins[3] = {rays.origin_x.data(), rays.origin_y.data(),
+                              rays.origin_z.data()};
+  const double *inv_directions[3] = {rays.inv_direction_x.data(),
+                                     rays.inv_direction_y.data(),
+                                     rays.inv_direction_z.data()};
+
+  uint32_t hit = 0;
+  __m256d nearest = infinity;
+  for (size_t group = 0; group < rays.size; group += 4) {
+    uint32_t group_active = (active >> group) & 0xF;
+    if (group_active == 0) {
+      continue;
+    }
+
+    __m256d near = _mm256_setzero_pd();
+    __m256d far = _mm256_load_pd(rays.t_max.data() + group);
+    for (size_t axis = 0; axis < 3; ++axis) {
+      __m256d origin = _mm256_load_pd(origins[axis] + group);
+      __m256d inv_direction = _mm256_load_pd(inv_directions[axis] + group);
+      __m256d t0 = _mm256_mul_pd(
+          _mm256_sub_pd(_mm256_set1_pd(box.GetMin()[axis]), origin),
+          inv_direction);
+      __m256d t1 = _mm256_mul_pd(
+          _mm256_sub_pd(_mm256_set1_pd(box.GetMax()[axis]), origin),
+          inv_direction);
+      // Сравнения и выбор как в BoxRay::Intersect, включая случаи с NaN
+      __m256d swap = _mm256_cmp_pd(t0, t1, _CMP_GT_OQ);
+      __m256d low = _mm256_blendv_pd(t0, t1, swap);
+      __m256d high =
+          _mm256_mul_pd(_mm256_blendv_pd(t1, t0, swap), robust_factor);
+      near = _mm256_blendv_pd(near, low, _mm256_cmp_pd(low, near, _CMP_GT_OQ));
+      far = _mm256_blendv_pd(far, high, _mm256_cmp_pd(high, far, _CMP_LT_OQ));
+    }
+
+    __m256d inside = _mm256_cmp_pd(near, far, _CMP_LE_OQ);
+    uint32_t group_hit = _mm256_movemask_pd(inside) & group_active;
+    if (group_hit == 0) {
+      continue;
+    }
+    hit |= group_hit << group;
+
+    __m256d lanes = GroupLaneMask(group_hit);
+    nearest = _mm256_min_pd(nearest, _mm256_blendv_pd(infinity, near, lanes));
+  }
+
+  alignas(32) double lanes[4];
+  _mm256_store_pd(lanes, nearest);
+  *t_near = std::min({lanes[0], lanes[1], lanes[2], lanes[3]});
+  return hit;
+}
+
+// Один треугольник на все лучи группы: данные треугольника размножаются по
+// полосам, а лучи берутся из пучка
+__attribute__((target("avx2"))) RAYTRACER_NO_FP_CONTRACT uint32_t
+IntersectTrianglesPacketAvx2(const TriangleStore &store, uint32_t first,
+                             uint32_t count, PacketRays &rays,
+                             uint32_t active, PacketTriangleHits *hits) {
+  const __m256d epsilon = _mm256_set1_pd(1e-6);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d sign_mask = _mm256_set1_pd(-0.0);
+
+  uint32_t found = 0;
+  const uint32_t end = first + count;
+  for (size_t group = 0; group < rays.size; group += 4) {
+    uint32_t group_active = (active >> group) & 0xF;
+    if (group_active == 0) {
+      continue;
+    }
+    __m256d valid_lanes = GroupLaneMask(group_active);
+
+    const __m256d ox = _mm256_load_pd(rays.origin_x.data() + group);
+    const __m256d oy = _mm256_load_pd(rays.origin_y.data() + group);
+    const __m256d oz = _mm256_load_pd(rays.origin_z.data() + group);
+    const __m256d dx = _mm256_load_pd(rays.direction_x.data() + group);
+    const __m256d dy = _mm256_load_pd(rays.direction_y.data() + group);
+    const __m256d dz = _mm256_load_pd(rays.direction_z.data() + group);
+
+    __m256d best_t = _mm256_load_pd(rays.t_max.data() + group);
+    __m256d best_u = zero;
+    __m256d best_v = zero;
+    __m256d best_index = zero;
+    __m256d updated = zero;
+
+    for (uint32_t i = first; i < end; ++i) {
+      __m256d e1x = _mm256_set1_pd(store.GetEdge1Data(0)[i]);
+      __m256d e1y = _mm256_set1_pd(store.GetEdge1Data(1)[i]);
+      __m256d e1z = _mm256_set1_pd(store.GetEdge1Data(2)[i]);
+      __m256d e2x = _mm256_set1_pd(store.GetEdge2Data(0)[i]);
+      __m256d e2y = _mm256_set1_pd(store.GetEdge2Data(1)[i]);
+      __m256d e2z = _mm256_set1_pd(store.GetEdge2Data(2)[i]);
+
+      __m256d px =
+          _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+      __m256d py =
+          _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+      __m256d pz =
+          _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+      __m256d determinant = _mm256_add_pd(
+          _mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)),
+          _mm256_mul_pd(e1z, pz));
+      __m256d valid = _mm256_and_pd(
+          valid_lanes, _mm256_cmp_pd(_mm256_andnot_pd(sign_mask, determinant),
+                                     epsilon, _CMP_GE_OQ));
+      if (_mm256_movemask_pd(valid) == 0) {
+        continue;
+      }
+
+      __m256d inv_determinant = _mm256_div_pd(one, determinant);
+      __m256d sx =
+          _mm256_sub_pd(ox, _mm256_set1_pd(store.GetVertex0Data(0)[i]));
+      __m256d sy =
+          _mm256_sub_pd(oy, _mm256_set1_pd(store.GetVertex0Data(1)[i]));
+      __m256d sz =
+          _mm256_sub_pd(oz, _mm256_set1_pd(store.GetVertex0Data(2)[i]));
+      __m256d u = _mm256_mul_pd(
+          inv_determinant,
+          _mm256_add_pd(
+              _mm256_add_pd(_mm256_mul_pd(sx, px), _mm256_mul_pd(sy, py)),
+              _mm256_mul_pd(sz, pz)));
+      valid = _mm256_and_pd(valid, _mm256_cmp_pd(u, zero, _CMP_GE_OQ));
+      valid = _mm256_and_pd(valid, _mm256_cmp_pd(u, one, _CMP_LE_OQ));
+
+      __m256d qx =
+          _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+      __m256d qy =
+          _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+      __m256d qz =
+          _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+      __m256d v = _mm256_mul_pd(
+          inv_determinant,
+          _mm256_add_pd(
+              _mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+              _mm256_mul_pd(dz, qz)));
+      valid = _mm256_and_pd(valid, _mm256_cmp_pd(v, zero, _CMP_GE_OQ));
+      valid = _mm256_and_pd(
+          valid, _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ));
+
+      __m256d t = _mm256_mul_pd(
+          inv_determinant,
+          _mm256_add_pd(
+              _mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)),
+              _mm256_mul_pd(e2z, qz)));
+      valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, epsilon, _CMP_GT_OQ));
+      valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, best_t, _CMP_LT_OQ));
+
+      best_t = _mm256_blendv_pd(best_t, t, valid);
+      best_u = _mm256_blendv_pd(best_u, u, valid);
+      best_v = _mm256_blendv_pd(best_v, v, valid);
+      best_index = _mm256_blendv_pd(best_index, _mm256_set1_pd(i), valid);
+      updated = _mm256_or_pd(updated, valid);
+    }
+
+    uint32_t group_found = _mm256_movemask_pd(updated);
+    if (group_found == 0) {
+      continue;
+    }
+    alignas(32) double t[4], u[4], v[4], index[4];
+    _mm256_store_pd(t, best_t);
+    _mm256_store_pd(u, best_u);
+    _mm256_store_pd(v, best_v);
+    _mm256_store_pd(index, best_index);
+    for (uint32_t lanes = group_found; lanes != 0; lanes &= lanes - 1) {
+      size_t lane = std::countr_zero(lanes);
+      rays.t_max[group + lane] = t[lane];
+      hits->index[group + lane] = static_cast<uint32_t>(index[lane]);
+      hits->u[group + lane] = u[lane];
+      hits->v[group + lane] = v[lane];
+    }
+    found |= group_found << group;
+  }
+  return found;
+}
+
+#endif
+
+struct PacketKernels {
+  PacketBoxKernel box;
+  PacketTriangleKernel triangles;
+};
+
+// Лучи пучка идут по полосам, так что AVX-512 дал бы выигрыш только на
+// пучках больше 4x4; используется то же ядро AVX2
+PacketKernels GetPacketKernels(TriangleKernelKind kind) {
+#ifdef RAYTRACER_X86_KERNELS
+  if (kind != TriangleKernelKind::kScalar) {
+    return {IntersectBoxPacketAvx2, IntersectTrianglesPacketAvx2};
+  }
+#endif
+  return {IntersectBoxPacketScalar, IntersectTrianglesPacketScalar};
+}
+
+const PacketKernels kPacketKernels = GetPacketKernels(DetectTriangleKernel());
+
+uint32_t IntersectBoxPacket(const BoundingBox &box, const PacketRays &rays,
+                            uint32_t active, double *t_near) {
+  return kPacketKernels.box(box, rays, active, t_near);
+}
+
+uint32_t IntersectTrianglesPacket(const TriangleStore &store, uint32_t first,
+                                  uint32_t count, PacketRays &rays,
+                                  uint32_t active, PacketTriangleHits *hits) {
+  return kPacketKernels.triangles(store, first, count, rays, active, hits);
+}
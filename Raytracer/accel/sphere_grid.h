@@ -0,0 +1,245 @@
+#pragma once
+
+#include "../geometry/bounding_box.h"
+#include "../geometry/ray.h"
+#include "../geometry/vector.h"
+#include "../reader/object.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+// Сетка выгоднее BVH, когда сфер много и они почти одного размера: тогда
+// сфера задевает всего несколько ячеек, а ячейка - несколько сфер
+constexpr size_t kSphereGridMinSpheres = 1024;
+// Доля сфер среди всех примитивов сцены
+constexpr double kSphereGridMinShare = 0.9;
+// Во сколько раз самая большая сфера может быть больше средней
+constexpr double kSphereGridMaxRadiusRatio = 4.0;
+
+bool IsSphereGridSuitable(const std::vector<SphereObject> &spheres,
+                          size_t other_primitive_count) {
+  size_t total = spheres.size() + other_primitive_count;
+  if (spheres.size() < kSphereGridMinSpheres ||
+      spheres.size() < kSphereGridMinShare * total) {
+    return false;
+  }
+  double radius_sum = 0.0;
+  double max_radius = 0.0;
+  for (const SphereObject &obj : spheres) {
+    radius_sum += obj.sphere.GetRadius();
+    max_radius = std::max(max_radius, obj.sphere.GetRadius());
+  }
+  return max_radius <=
+         kSphereGridMaxRadiusRatio * radius_sum / spheres.size();
+}
+
+// Равномерная сетка над сферами. Ячейка хранит номера всех сфер, коробки
+// которых её задевают; луч проходит ячейки по порядку (3D-DDA, Amanatides
+// и Woo, 1987) и останавливается, как только найденное попадание ближе
+// выхода из текущей ячейки.
+class SphereGrid {
+public:
+  // Ячеек примерно в kCellsPerSphere раз больше, чем сфер, и они близки к
+  // кубам; по одной оси - не больше kMaxResolution
+  static constexpr double kCellsPerSphere = 2.0;
+  static constexpr size_t kMaxResolution = 1024;
+
+  SphereGrid() = default;
+
+  explicit SphereGrid(const std::vector<SphereObject> &spheres) {
+    auto start = std::chrono::steady_clock::now();
+    if (spheres.empty()) {
+      return;
+    }
+    for (const SphereObject &obj : spheres) {
+      bounds_.Extend(GetBoundingBox(obj.sphere));
+    }
+
+    Vector extent = bounds_.Extent();
+    double max_extent = std::max({extent[0], extent[1], extent[2]});
+    double cells_per_unit =
+        max_extent > 0.0
+            ? std::cbrt(kCellsPerSphere * spheres.size()) / max_extent
+            : 0.0;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      resolution_[axis] = std::clamp<size_t>(
+          static_cast<size_t>(extent[axis] * cells_per_unit), 1,
+          kMaxResolution);
+      cell_size_[axis] = extent[axis] / resolution_[axis];
+      inv_cell_size_[axis] =
+          cell_size_[axis] > 0.0 ? 1.0 / cell_size_[axis] : 0.0;
+    }
+
+    // Два прохода: число сфер в ячейках, затем сами номера
+    cell_starts_.assign(resolution_[0] * resolution_[1] * resolution_[2] + 1,
+                        0);
+    auto for_each_cell = [&](const Sphere &sphere, auto &&func) {
+      BoundingBox box = GetBoundingBox(sphere);
+      std::array<size_t, 3> lower = GetCell(box.GetMin());
+      std::array<size_t, 3> upper = GetCell(box.GetMax());
+      for (size_t z = lower[2]; z <= upper[2]; ++z) {
+        for (size_t y = lower[1]; y <= upper[1]; ++y) {
+          for (size_t x = lower[0]; x <= upper[0]; ++x) {
+            func(GetCellIndex({x, y, z}));
+          }
+        }
+      }
+    };
+    for (const SphereObject &obj : spheres) {
+      for_each_cell(obj.sphere, [&](size_t cell) { ++cell_starts_[cell + 1]; });
+    }
+    for (size_t cell = 1; cell < cell_starts_.size(); ++cell) {
+      cell_starts_[cell] += cell_starts_[cell - 1];
+    }
+    sphere_indices_.resize(cell_starts_.back());
+    std::vector<uint32_t> fill(cell_starts_.begin(), cell_starts_.end() - 1);
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      for_each_cell(spheres[i].sphere,
+                    [&](size_t cell) { sphere_indices_[fill[cell]++] = i; });
+    }
+
+    std::chrono::duration<double, std::milli> build_time =
+        std::chrono::steady_clock::now() - start;
+    build_time_ms_ = build_time.count();
+  }
+
+  bool IsEmpty() const { return sphere_indices_.empty(); }
+
+  const BoundingBox &GetBounds() const { return bounds_; }
+
+  const std::array<size_t, 3> &GetResolution() const { return resolution_; }
+
+  size_t GetCellCount() const { return cell_starts_.size() - 1; }
+
+  // Сумма по ячейкам: сфера, задевающая несколько ячеек, считается в
+  // каждой
+  size_t GetReferenceCount() const { return sphere_indices_.size(); }
+
+  size_t GetBytes() const {
+    return cell_starts_.size() * sizeof(uint32_t) +
+           sphere_indices_.size() * sizeof(uint32_t);
+  }
+
+  double GetBuildTimeMs() const { return build_time_ms_; }
+
+  std::span<const uint32_t> GetCellSpheres(size_t cell) const {
+    return {sphere_indices_.data() + cell_starts_[cell],
+            cell_starts_[cell + 1] - cell_starts_[cell]};
+  }
+
+  // Обходит ячейки, которые пересекает луч, от ближней к дальней.
+  // visitor(spheres, t_max) проверяет сферы ячейки и уменьшает t_max при
+  // попадании ближе текущего. Сфера из нескольких ячеек проверяется в
+  // каждой из них.
+  template <class Visitor>
+  void Traverse(const Ray &ray, double &t_max, Visitor &&visitor) const {
+    WalkCells(ray, t_max, [&](size_t cell, double t_exit) {
+      visitor(GetCellSpheres(cell), t_max);
+      return t_max <= t_exit;
+    });
+  }
+
+  // Обход до первого попадания ближе t_max: visitor(spheres, t_max)
+  // возвращает true, если оно найдено
+  template <class Visitor>
+  bool TraverseAny(const Ray &ray, double t_max, Visitor &&visitor) const {
+    bool found = false;
+    WalkCells(ray, t_max, [&](size_t cell, double) {
+      found = visitor(GetCellSpheres(cell), t_max);
+      return found;
+    });
+    return found;
+  }
+
+private:
+  std::array<size_t, 3> GetCell(const Vector &point) const {
+    std::array<size_t, 3> cell;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      double position =
+          (point[axis] - bounds_.GetMin()[axis]) * inv_cell_size_[axis];
+      cell[axis] = static_cast<size_t>(
+          std::clamp(position, 0.0, resolution_[axis] - 1.0));
+    }
+    return cell;
+  }
+
+  size_t GetCellIndex(const std::array<size_t, 3> &cell) const {
+    return (cell[2] * resolution_[1] + cell[1]) * resolution_[0] + cell[0];
+  }
+
+  // func(cell, t_exit) вызывается для ячеек на луче по порядку; обход
+  // заканчивается, когда func вернёт true или луч выйдет из сетки. Каждая
+  // ячейка, которую отрезок [0, t_max] задевает, посещается: точка входа
+  // прижимается к сетке, а соседняя ячейка выбирается по ближайшей
+  // границе.
+  template <class CellFunc>
+  void WalkCells(const Ray &ray, double t_max, CellFunc &&func) const {
+    if (IsEmpty()) {
+      return;
+    }
+    BoxRay box_ray(ray);
+    double t_enter = box_ray.Intersect(bounds_, t_max);
+    if (t_enter > t_max) {
+      return;
+    }
+
+    const Vector &origin = ray.GetOrigin();
+    const Vector &direction = ray.GetDirection();
+    std::array<size_t, 3> cell = GetCell(origin + t_enter * direction);
+    std::array<double, 3> t_next;
+    std::array<double, 3> t_delta;
+    std::array<int, 3> step;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      double cell_min = bounds_.GetMin()[axis] + cell[axis] * cell_size_[axis];
+      if (direction[axis] > 0.0) {
+        step[axis] = 1;
+        t_next[axis] = (cell_min + cell_size_[axis] - origin[axis]) /
+                       direction[axis];
+        t_delta[axis] = cell_size_[axis] / direction[axis];
+      } else if (direction[axis] < 0.0) {
+        step[axis] = -1;
+        t_next[axis] = (cell_min - origin[axis]) / direction[axis];
+        t_delta[axis] = -cell_size_[axis] / direction[axis];
+      } else {
+        step[axis] = 0;
+        t_next[axis] = std::numeric_limits<double>::infinity();
+        t_delta[axis] = 0.0;
+      }
+    }
+
+    while (true) {
+      size_t axis = t_next[0] < t_next[1]
+                        ? (t_next[0] < t_next[2] ? 0 : 2)
+                        : (t_next[1] < t_next[2] ? 1 : 2);
+      if (func(GetCellIndex(cell), t_next[axis])) {
+        return;
+      }
+      if (t_next[axis] > t_max) {
+        return;
+      }
+      if ((step[axis] < 0 && cell[axis] == 0) ||
+          (step[axis] > 0 && cell[axis] + 1 == resolution_[axis])) {
+        return;
+      }
+      cell[axis] += step[axis];
+      t_next[axis] += t_delta[axis];
+    }
+  }
+
+  BoundingBox bounds_;
+  std::array<size_t, 3> resolution_ = {0, 0, 0};
+  Vector cell_size_;
+  Vector inv_cell_size_;
+  // Номера сфер ячейки c - sphere_indices_[cell_starts_[c],
+  // cell_starts_[c + 1])
+  std::vector<uint32_t> cell_starts_ = {0};
+  std::vector<uint32_t> sphere_indices_;
+  double build_time_ms_ = 0.0;
+};
@@ -0,0 +1,533 @@
+#pragma once
+
+#include "../geometry/ray.h"
+#include "triangle_store.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RAYTRACER_X86_KERNELS
+#endif
+
+// Ядра пересекают один луч сразу с диапазоном треугольников
+// [first, first + count) из TriangleStore и возвращают ближайшее попадание
+// ближе t_max. При равных расстояниях побеждает меньший индекс, как в
+// последовательном обходе, поэтому все ядра дают одинаковый результат.
+
+struct TriangleBatchHit {
+  uint32_t index;
+  TriangleHit hit;
+};
+
+enum class TriangleKernelKind { kScalar, kAvx2, kAvx512 };
+
+// Ядро одинарной точности считает во float и луч, и треугольники; в
+// TriangleBatchHit расстояние и координаты переводятся в double без потерь
+template <class T>
+using BasicTriangleKernel = bool (*)(const BasicTriangleStore<T> &store,
+                                     uint32_t first, uint32_t count,
+                                     const BasicRay<T> &ray, T t_max,
+                                     TriangleBatchHit *result);
+
+using TriangleKernel = BasicTriangleKernel<double>;
+using FloatTriangleKernel = BasicTriangleKernel<float>;
+
+template <class T>
+RAYTRACER_NO_FP_CONTRACT bool
+IntersectTrianglesScalar(const BasicTriangleStore<T> &store, uint32_t first,
+                         uint32_t count, const BasicRay<T> &ray,
+                         std::type_identity_t<T> t_max,
+                         TriangleBatchHit *result) {
+  bool found = false;
+  for (uint32_t index = first; index < first + count; ++index) {
+    auto hit = store.Intersect(index, ray);
+    if (hit.has_value() && hit->distance < t_max) {
+      t_max = hit->distance;
+      *result = {index, *hit};
+      found = true;
+    }
+  }
+  return found;
+}
+
+#ifdef RAYTRACER_X86_KERNELS
+
+// Выбирает из полос ближайшее попадание, при равенстве - с меньшим индексом
+template <class T, class Index, size_t Width>
+bool ReduceLanes(const T (&t)[Width], const T (&u)[Width],
+                 const T (&v)[Width], const Index (&index)[Width], T t_max,
+                 TriangleBatchHit *result) {
+  size_t best = Width;
+  for (size_t lane = 0; lane < Width; ++lane) {
+    if (t[lane] >= t_max) {
+      continue;
+    }
+    if (best == Width || t[lane] < t[best] ||
+        (t[lane] == t[best] && index[lane] < index[best])) {
+      best = lane;
+    }
+  }
+
+  if (best == Width) {
+    return false;
+  }
+  *result = {static_cast<uint32_t>(index[best]), {t[best], u[best], v[best]}};
+  return true;
+}
+
+__attribute__((target("avx2"))) RAYTRACER_NO_FP_CONTRACT bool
+IntersectTrianglesAvx2(const TriangleStore &store, uint32_t first,
+                       uint32_t count, const Ray &ray, double t_max,
+                       TriangleBatchHit *result) {
+  const __m256d epsilon = _mm256_set1_pd(1e-6);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  const __m256d sign_mask = _mm256_set1_pd(-0.0);
+  const __m256d lane_offsets = _mm256_set_pd(3.0, 2.0, 1.0, 0.0);
+
+  const Vector &origin = ray.GetOrigin();
+  const Vector &direction = ray.GetDirection();
+  const __m256d ox = _mm256_set1_pd(origin[0]);
+  const __m256d oy = _mm256_set1_pd(origin[1]);
+  const __m256d oz = _mm256_set1_pd(origin[2]);
+  const __m256d dx = _mm256_set1_pd(direction[0]);
+  const __m256d dy = _mm256_set1_pd(direction[1]);
+  const __m256d dz = _mm256_set1_pd(direction[2]);
+
+  __m256d best_t = _mm256_set1_pd(t_max);
+  __m256d best_u = zero;
+  __m256d best_v = zero;
+  __m256d best_index = zero;
+
+  const uint32_t end = first + count;
+  for (uint32_t i = first; i < end; i += 4) {
+    __m256d index = _mm256_add_pd(_mm256_set1_pd(i), lane_offsets);
+    __m256d valid =
+        _mm256_cmp_pd(index, _mm256_set1_pd(end), _CMP_LT_OQ);
+
+    __m256d e1x = _mm256_loadu_pd(store.GetEdge1Data(0) + i);
+    __m256d e1y = _mm256_loadu_pd(store.GetEdge1Data(1) + i);
+    __m256d e1z = _mm256_loadu_pd(store.GetEdge1Data(2) + i);
+    __m256d e2x = _mm256_loadu_pd(store.GetEdge2Data(0) + i);
+    __m256d e2y = _mm256_loadu_pd(store.GetEdge2Data(1) + i);
+    __m256d e2z = _mm256_loadu_pd(store.GetEdge2Data(2) + i);
+
+    __m256d px = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+    __m256d py = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+    __m256d pz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+    __m256d determinant = _mm256_add_pd(
+        _mm256_add_pd(_mm256_mul_pd(e1x, px), _mm256_mul_pd(e1y, py)),
+        _mm256_mul_pd(e1z, pz));
+    valid = _mm256_and_pd(
+        valid, _mm256_cmp_pd(_mm256_andnot_pd(sign_mask, determinant),
+                             epsilon, _CMP_GE_OQ));
+    if (_mm256_movemask_pd(valid) == 0) {
+      continue;
+    }
+
+    __m256d inv_determinant = _mm256_div_pd(one, determinant);
+    __m256d sx = _mm256_sub_pd(ox, _mm256_loadu_pd(store.GetVertex0Data(0) + i));
+    __m256d sy = _mm256_sub_pd(oy, _mm256_loadu_pd(store.GetVertex0Data(1) + i));
+    __m256d sz = _mm256_sub_pd(oz, _mm256_loadu_pd(store.GetVertex0Data(2) + i));
+    __m256d u = _mm256_mul_pd(
+        inv_determinant,
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(sx, px), _mm256_mul_pd(sy, py)),
+            _mm256_mul_pd(sz, pz)));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(u, zero, _CMP_GE_OQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(u, one, _CMP_LE_OQ));
+
+    __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+    __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+    __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+    __m256d v = _mm256_mul_pd(
+        inv_determinant,
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+            _mm256_mul_pd(dz, qz)));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_pd(
+        valid, _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ));
+
+    __m256d t = _mm256_mul_pd(
+        inv_determinant,
+        _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)),
+            _mm256_mul_pd(e2z, qz)));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, epsilon, _CMP_GT_OQ));
+    valid = _mm256_and_pd(valid, _mm256_cmp_pd(t, best_t, _CMP_LT_OQ));
+
+    best_t = _mm256_blendv_pd(best_t, t, valid);
+    best_u = _mm256_blendv_pd(best_u, u, valid);
+    best_v = _mm256_blendv_pd(best_v, v, valid);
+    best_index = _mm256_blendv_pd(best_index, index, valid);
+  }
+
+  alignas(32) double t[4], u[4], v[4], index[4];
+  _mm256_store_pd(t, best_t);
+  _mm256_store_pd(u, best_u);
+  _mm256_store_pd(v, best_v);
+  _mm256_store_pd(index, best_index);
+  return ReduceLanes(t, u, v, index, t_max, result);
+}
+
+__attribute__((target("avx512f"))) RAYTRACER_NO_FP_CONTRACT bool
+IntersectTrianglesAvx512(const TriangleStore &store, uint32_t first,
+                         uint32_t count, const Ray &ray, double t_max,
+                         TriangleBatchHit *result) {
+  const __m512d epsilon = _mm512_set1_pd(1e-6);
+  const __m512d zero = _mm512_setzero_pd();
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512d lane_offsets =
+      _mm512_set_pd(7.0, 6.0, 5.0, 4.0, 3.0, 2.0, 1.0, 0.0);
+
+  const Vector &origin = ray.GetOrigin();
+  const Vector &direction = ray.GetDirection();
+  const __m512d ox = _mm512_set1_pd(origin[0]);
+  const __m512d oy = _mm512_set1_pd(origin[1]);
+  const __m512d oz = _mm512_set1_pd(origin[2]);
+  const __m512d dx = _mm512_set1_pd(direction[0]);
+  const __m512d dy = _mm512_set1_pd(direction[1]);
+  const __m512d dz = _mm512_set1_pd(direction[2]);
+
+  __m512d best_t = _mm512_set1_pd(t_max);
+  __m512d best_u = zero;
+  __m512d best_v = zero;
+  __m512d best_index = zero;
+
+  const uint32_t end = first + count;
+  for (uint32_t i = first; i < end; i += 8) {
+    __m512d index = _mm512_add_pd(_mm512_set1_pd(i), lane_offsets);
+    __mmask8 valid = _mm512_cmp_pd_mask(index, _mm512_set1_pd(end), _CMP_LT_OQ);
+
+    __m512d e1x = _mm512_loadu_pd(store.GetEdge1Data(0) + i);
+    __m512d e1y = _mm512_loadu_pd(store.GetEdge1Data(1) + i);
+    __m512d e1z = _mm512_loadu_pd(store.GetEdge1Data(2) + i);
+    __m512d e2x = _mm512_loadu_pd(store.GetEdge2Data(0) + i);
+    __m512d e2y = _mm512_loadu_pd(store.GetEdge2Data(1) + i);
+    __m512d e2z = _mm512_loadu_pd(store.GetEdge2Data(2) + i);
+
+    __m512d px = _mm512_sub_pd(_mm512_mul_pd(dy, e2z), _mm512_mul_pd(dz, e2y));
+    __m512d py = _mm512_sub_pd(_mm512_mul_pd(dz, e2x), _mm512_mul_pd(dx, e2z));
+    __m512d pz = _mm512_sub_pd(_mm512_mul_pd(dx, e2y), _mm512_mul_pd(dy, e2x));
+    __m512d determinant = _mm512_add_pd(
+        _mm512_add_pd(_mm512_mul_pd(e1x, px), _mm512_mul_pd(e1y, py)),
+        _mm512_mul_pd(e1z, pz));
+    valid = _mm512_mask_cmp_pd_mask(valid, _mm512_abs_pd(determinant), epsilon,
+                                    _CMP_GE_OQ);
+    if (valid == 0) {
+      continue;
+    }
+
+    __m512d inv_determinant = _mm512_div_pd(one, determinant);
+    __m512d sx = _mm512_sub_pd(ox, _mm512_loadu_pd(store.GetVertex0Data(0) + i));
+    __m512d sy = _mm512_sub_pd(oy, _mm512_loadu_pd(store.GetVertex0Data(1) + i));
+    __m512d sz = _mm512_sub_pd(oz, _mm512_loadu_pd(store.GetVertex0Data(2) + i));
+    __m512d u = _mm512_mul_pd(
+        inv_determinant,
+        _mm512_add_pd(
+            _mm512_add_pd(_mm512_mul_pd(sx, px), _mm512_mul_pd(sy, py)),
+            _mm512_mul_pd(sz, pz)));
+    valid = _mm512_mask_cmp_pd_mask(valid, u, zero, _CMP_GE_OQ);
+    valid = _mm512_mask_cmp_pd_mask(valid, u, one, _CMP_LE_OQ);
+
+    __m512d qx = _mm512_sub_pd(_mm512_mul_pd(sy, e1z), _mm512_mul_pd(sz, e1y));
+    __m512d qy = _mm512_sub_pd(_mm512_mul_pd(sz, e1x), _mm512_mul_pd(sx, e1z));
+    __m512d qz = _mm512_sub_pd(_mm512_mul_pd(sx, e1y), _mm512_mul_pd(sy, e1x));
+    __m512d v = _mm512_mul_pd(
+        inv_determinant,
+        _mm512_add_pd(
+            _mm512_add_pd(_mm512_mul_pd(dx, qx), _mm512_mul_pd(dy, qy)),
+            _mm512_mul_pd(dz, qz)));
+    valid = _mm512_mask_cmp_pd_mask(valid, v, zero, _CMP_GE_OQ);
+    valid = _mm512_mask_cmp_pd_mask(valid, _mm512_add_pd(u, v), one,
+                                    _CMP_LE_OQ);
+
+    __m512d t = _mm512_mul_pd(
+        inv_determinant,
+        _mm512_add_pd(
+            _mm512_add_pd(_mm512_mul_pd(e2x, qx), _mm512_mul_pd(e2y, qy)),
+            _mm512_mul_pd(e2z, qz)));
+    valid = _mm512_mask_cmp_pd_mask(valid, t, epsilon, _CMP_GT_OQ);
+    valid = _mm512_mask_cmp_pd_mask(valid, t, best_t, _CMP_LT_OQ);
+
+    best_t = _mm512_mask_blend_pd(valid, best_t, t);
+    best_u = _mm512_mask_blend_pd(valid, best_u, u);
+    best_v = _mm512_mask_blend_pd(valid, best_v, v);
+    best_index = _mm512_mask_blend_pd(valid, best_index, index);
+  }
+
+  alignas(64) double t[8], u[8], v[8], index[8];
+  _mm512_store_pd(t, best_t);
+  _mm512_store_pd(u, best_u);
+  _mm512_store_pd(v, best_v);
+  _mm512_store_pd(index, best_index);
+  return ReduceLanes(t, u, v, index, t_max, result);
+}
+
+// Во float в регистр помещается вдвое больше треугольников. Номера
+// треугольников хранятся целыми: float точно представляет только номера
+// до 2^24.
+__attribute__((target("avx2"))) RAYTRACER_NO_FP_CONTRACT bool
+IntersectTrianglesAvx2(const FloatTriangleStore &store, uint32_t first,
+                       uint32_t count, const FloatRay &ray, float t_max,
+                       TriangleBatchHit *result) {
+  const __m256 epsilon = _mm256_set1_ps(1e-6f);
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 sign_mask = _mm256_set1_ps(-0.0f);
+  const __m256i lane_offsets = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+
+  const FloatVector &origin = ray.GetOrigin();
+  const FloatVector &direction = ray.GetDirection();
+  const __m256 ox = _mm256_set1_ps(origin[0]);
+  const __m256 oy = _mm256_set1_ps(origin[1]);
+  const __m256 oz = _mm256_set1_ps(origin[2]);
+  const __m256 dx = _mm256_set1_ps(direction[0]);
+  const __m256 dy = _mm256_set1_ps(direction[1]);
+  const __m256 dz = _mm256_set1_ps(direction[2]);
+
+  __m256 best_t = _mm256_set1_ps(t_max);
+  __m256 best_u = zero;
+  __m256 best_v = zero;
+  __m256i best_index = _mm256_setzero_si256();
+
+  const uint32_t end = first + count;
+  for (uint32_t i = first; i < end; i += 8) {
+    __m256i index = _mm256_add_epi32(_mm256_set1_epi32(i), lane_offsets);
+    // Номера меньше 2^31, так что знаковое сравнение корректно
+    __m256 valid = _mm256_castsi256_ps(
+        _mm256_cmpgt_epi32(_mm256_set1_epi32(end), index));
+
+    __m256 e1x = _mm256_loadu_ps(store.GetEdge1Data(0) + i);
+    __m256 e1y = _mm256_loadu_ps(store.GetEdge1Data(1) + i);
+    __m256 e1z = _mm256_loadu_ps(store.GetEdge1Data(2) + i);
+    __m256 e2x = _mm256_loadu_ps(store.GetEdge2Data(0) + i);
+    __m256 e2y = _mm256_loadu_ps(store.GetEdge2Data(1) + i);
+    __m256 e2z = _mm256_loadu_ps(store.GetEdge2Data(2) + i);
+
+    __m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+    __m256 determinant = _mm256_add_ps(
+        _mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)),
+        _mm256_mul_ps(e1z, pz));
+    valid = _mm256_and_ps(
+        valid, _mm256_cmp_ps(_mm256_andnot_ps(sign_mask, determinant),
+                             epsilon, _CMP_GE_OQ));
+    if (_mm256_movemask_ps(valid) == 0) {
+      continue;
+    }
+
+    __m256 inv_determinant = _mm256_div_ps(one, determinant);
+    __m256 sx = _mm256_sub_ps(ox, _mm256_loadu_ps(store.GetVertex0Data(0) + i));
+    __m256 sy = _mm256_sub_ps(oy, _mm256_loadu_ps(store.GetVertex0Data(1) + i));
+    __m256 sz = _mm256_sub_ps(oz, _mm256_loadu_ps(store.GetVertex0Data(2) + i));
+    __m256 u = _mm256_mul_ps(
+        inv_determinant,
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)),
+            _mm256_mul_ps(sz, pz)));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+
+    __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+    __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+    __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+    __m256 v = _mm256_mul_ps(
+        inv_determinant,
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+            _mm256_mul_ps(dz, qz)));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+    valid = _mm256_and_ps(
+        valid, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+
+    __m256 t = _mm256_mul_ps(
+        inv_determinant,
+        _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+            _mm256_mul_ps(e2z, qz)));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, epsilon, _CMP_GT_OQ));
+    valid = _mm256_and_ps(valid, _mm256_cmp_ps(t, best_t, _CMP_LT_OQ));
+
+    best_t = _mm256_blendv_ps(best_t, t, valid);
+    best_u = _mm256_blendv_ps(best_u, u, valid);
+    best_v = _mm256_blendv_ps(best_v, v, valid);
+    best_index =
+        _mm256_blendv_epi8(best_index, index, _mm256_castps_si256(valid));
+  }
+
+  alignas(32) float t[8], u[8], v[8];
+  alignas(32) uint32_t index[8];
+  _mm256_store_ps(t, best_t);
+  _mm256_store_ps(u, best_u);
+  _mm256_store_ps(v, best_v);
+  _mm256_store_si256(reinterpret_cast<__m256i *>(index), best_index);
+  return ReduceLanes(t, u, v, index, t_max, result);
+}
+
+__attribute__((target("avx512f"))) RAYTRACER_NO_FP_CONTRACT bool
+IntersectTrianglesAvx512(const FloatTriangleStore &store, uint32_t first,
+                         uint32_t count, const FloatRay &ray, float t_max,
+                         TriangleBatchHit *result) {
+  const __m512 epsilon = _mm512_set1_ps(1e-6f);
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512i lane_offsets = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8,
+                                                7, 6, 5, 4, 3, 2, 1, 0);
+
+  const FloatVector &origin = ray.GetOrigin();
+  const FloatVector &direction = ray.GetDirection();
+  const __m512 ox = _mm512_set1_ps(origin[0]);
+  const __m512 oy = _mm512_set1_ps(origin[1]);
+  const __m512 oz = _mm512_set1_ps(origin[2]);
+  const __m512 dx = _mm512_set1_ps(direction[0]);
+  const __m512 dy = _mm512_set1_ps(direction[1]);
+  const __m512 dz = _mm512_set1_ps(direction[2]);
+
+  __m512 best_t = _mm512_set1_ps(t_max);
+  __m512 best_u = zero;
+  __m512 best_v = zero;
+  __m512i best_index = _mm512_setzero_si512();
+
+  // Дополнения хранилища хватает только на 8 треугольников, поэтому хвост
+  // короче 16 читается с маской
+  const uint32_t end = first + count;
+  for (uint32_t i = first; i < end; i += 16) {
+    __m512i index = _mm512_add_epi32(_mm512_set1_epi32(i), lane_offsets);
+    __mmask16 valid =
+        _mm512_cmplt_epu32_mask(index, _mm512_set1_epi32(end));
+
+    __m512 e1x = _mm512_maskz_loadu_ps(valid, store.GetEdge1Data(0) + i);
+    __m512 e1y = _mm512_maskz_loadu_ps(valid, store.GetEdge1Data(1) + i);
+    __m512 e1z = _mm512_maskz_loadu_ps(valid, store.GetEdge1Data(2) + i);
+    __m512 e2x = _mm512_maskz_loadu_ps(valid, store.GetEdge2Data(0) + i);
+    __m512 e2y = _mm512_maskz_loadu_ps(valid, store.GetEdge2Data(1) + i);
+    __m512 e2z = _mm512_maskz_loadu_ps(valid, store.GetEdge2Data(2) + i);
+
+    __m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(dz, e2y));
+    __m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(dx, e2z));
+    __m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(dy, e2x));
+    __m512 determinant = _mm512_add_ps(
+        _mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)),
+        _mm512_mul_ps(e1z, pz));
+    valid = _mm512_mask_cmp_ps_mask(valid, _mm512_abs_ps(determinant), epsilon,
+                                    _CMP_GE_OQ);
+    if (valid == 0) {
+      continue;
+    }
+
+    __m512 inv_determinant = _mm512_div_ps(one, determinant);
+    __m512 sx = _mm512_sub_ps(
+        ox, _mm512_maskz_loadu_ps(valid, store.GetVertex0Data(0) + i));
+    __m512 sy = _mm512_sub_ps(
+        oy, _mm512_maskz_loadu_ps(valid, store.GetVertex0Data(1) + i));
+    __m512 sz = _mm512_sub_ps(
+        oz, _mm512_maskz_loadu_ps(valid, store.GetVertex0Data(2) + i));
+    __m512 u = _mm512_mul_ps(
+        inv_determinant,
+        _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(sx, px), _mm512_mul_ps(sy, py)),
+            _mm512_mul_ps(sz, pz)));
+    valid = _mm512_mask_cmp_ps_mask(valid, u, zero, _CMP_GE_OQ);
+    valid = _mm512_mask_cmp_ps_mask(valid, u, one, _CMP_LE_OQ);
+
+    __m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(sz, e1y));
+    __m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(sx, e1z));
+    __m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(sy, e1x));
+    __m512 v = _mm512_mul_ps(
+        inv_determinant,
+        _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)),
+            _mm512_mul_ps(dz, qz)));
+    valid = _mm512_mask_cmp_ps_mask(valid, v, zero, _CMP_GE_OQ);
+    valid = _mm512_mask_cmp_ps_mask(valid, _mm512_add_ps(u, v), one,
+                                    _CMP_LE_OQ);
+
+    __m512 t = _mm512_mul_ps(
+        inv_determinant,
+        _mm512_add_ps(
+            _mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)),
+            _mm512_mul_ps(e2z, qz)));
+    valid = _mm512_mask_cmp_ps_mask(valid, t, epsilon, _CMP_GT_OQ);
+    valid = _mm512_mask_cmp_ps_mask(valid, t, best_t, _CMP_LT_OQ);
+
+    best_t = _mm512_mask_blend_ps(valid, best_t, t);
+    best_u = _mm512_mask_blend_ps(valid, best_u, u);
+    best_v = _mm512_mask_blend_ps(valid, best_v, v);
+    best_index = _mm512_mask_blend_epi32(valid, best_index, index);
+  }
+
+  alignas(64) float t[16], u[16], v[16];
+  alignas(64) uint32_t index[16];
+  _mm512_store_ps(t, best_t);
+  _mm512_store_ps(u, best_u);
+  _mm512_store_ps(v, best_v);
+  _mm512_store_si512(index, best_index);
+  return ReduceLanes(t, u, v, index, t_max, result);
+}
+
+#endif
+
+bool IsTriangleKernelSupported(TriangleKernelKind kind) {
+#ifdef RAYTRACER_X86_KERNELS
+  __builtin_cpu_init();
+  switch (kind) {
+  case TriangleKernelKind::kAvx512:
+    return __builtin_cpu_supports("avx512f");
+  case TriangleKernelKind::kAvx2:
+    return __builtin_cpu_supports("avx2");
+  case TriangleKernelKind::kScalar:
+    return true;
+  }
+#endif
+  return kind == TriangleKernelKind::kScalar;
+}
+
+template <class T = double>
+BasicTriangleKernel<T> GetTriangleKernel(TriangleKernelKind kind) {
+#ifdef RAYTRACER_X86_KERNELS
+  switch (kind) {
+  case TriangleKernelKind::kAvx512:
+    return IntersectTrianglesAvx512;
+  case TriangleKernelKind::kAvx2:
+    return IntersectTrianglesAvx2;
+  case TriangleKernelKind::kScalar:
+    break;
+  }
+#endif
+  return IntersectTrianglesScalar<T>;
+}
+
+// Самое широкое ядро, которое поддерживает процессор
+TriangleKernelKind DetectTriangleKernel() {
+  for (auto kind : {TriangleKernelKind::kAvx512, TriangleKernelKind::kAvx2}) {
+    if (IsTriangleKernelSupported(kind)) {
+      return kind;
+    }
+  }
+  return TriangleKernelKind::kScalar;
+}
+
+const TriangleKernel kTriangleKernel =
+    GetTriangleKernel(DetectTriangleKernel());
+
+const FloatTriangleKernel kFloatTriangleKernel =
+    GetTriangleKernel<float>(DetectTriangleKernel());
+
+bool IntersectTriangles(const TriangleStore &store, uint32_t first,
+                        uint32_t count, const Ray &ray, double t_max,
+                        TriangleBatchHit *result) {
+  return kTriangleKernel(store, first, count, ray, t_max, result);
+}
+
+bool IntersectTriangles(const FloatTriangleStore &store, uint32_t first,
+                        uint32_t count, const FloatRay &ray, float t_max,
+                        TriangleBatchHit *result) {
+  return kFloatTriangleKernel(store, first, count, ray, t_max, result);
+}
@@ -0,0 +1,213 @@
+#pragma once
+
+#include "../geometry/ray.h"
+#include "../geometry/triangle.h"
+#include "../geometry/vector.h"
+#include "../reader/material.h"
+#include "../reader/object.h"
+#include "../utils/aligned_allocator.h"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+// Компилятор вправе слить умножение и сложение в FMA (-mfma,
+// -march=native), и тогда скалярное пересечение округляло бы иначе, чем
+// векторные ядра. Все пересечения треугольников считаются без слияния.
+#if defined(__GNUC__) && !defined(__clang__)
+#define RAYTRACER_NO_FP_CONTRACT __attribute__((optimize("fp-contract=off")))
+#else
+#define RAYTRACER_NO_FP_CONTRACT
+#endif
+
+struct TriangleHit {
+  double distance;
+  // Барицентрические координаты при второй и третьей вершинах
+  double u;
+  double v;
+};
+
+// Треугольники сцены в виде структуры массивов: первая вершина и два ребра
+// посчитаны заранее и лежат покомпонентно в выровненных по кэш-линии
+// массивах, чтобы ядро пересечения читало память подряд. Координаты
+// хранятся в T: рёбра считаются в double и затем округляются.
+template <class T>
+class BasicTriangleStore {
+public:
+  // Массивы дополняются kPadding вырожденными треугольниками, чтобы
+  // SIMD-ядра могли читать целый регистр, начиная с любого треугольника
+  static constexpr size_t kPadding = 8;
+
+  BasicTriangleStore() = default;
+
+  // order - индексы объектов в том порядке, в котором их нужно сложить
+  BasicTriangleStore(const std::vector<Object> &objects,
+                     const std::vector<uint32_t> &order) {
+    size_t count = order.size();
+    size_t padded_count = count + kPadding;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      vertex0_[axis].resize(padded_count);
+      edge1_[axis].resize(padded_count);
+      edge2_[axis].resize(padded_count);
+      normal_indices_[axis].resize(count);
+    }
+    material_indices_.resize(count);
+
+    std::unordered_map<const Material *, uint32_t> material_ids;
+    for (size_t i = 0; i < count; ++i) {
+      const Object &obj = objects[order[i]];
+      SetTriangle(i, obj.polygon);
+      for (size_t axis = 0; axis < 3; ++axis) {
+        normal_indices_[axis][i] = obj.normal_indices[axis];
+      }
+
+      auto [it, inserted] =
+          material_ids.emplace(obj.material, materials_.size());
+      if (inserted) {
+        materials_.push_back(obj.material);
+      }
+      material_indices_[i] = it->second;
+    }
+  }
+
+  size_t Size() const { return material_indices_.size(); }
+
+  // Новое положение треугольника; нормали и материал остаются прежними.
+  // Разные треугольники можно обновлять из разных потоков.
+  void SetTriangle(size_t index, const Triangle &polygon) {
+    Vector edge1 = polygon[1] - polygon[0];
+    Vector edge2 = polygon[2] - polygon[0];
+    for (size_t axis = 0; axis < 3; ++axis) {
+      vertex0_[axis][index] = static_cast<T>(polygon[0][axis]);
+      edge1_[axis][index] = static_cast<T>(edge1[axis]);
+      edge2_[axis][index] = static_cast<T>(edge2[axis]);
+    }
+  }
+
+  // Память под вершины и рёбра, которые читает обход
+  size_t GetGeometryBytes() const {
+    return 3 * 3 * vertex0_[0].size() * sizeof(T);
+  }
+
+  const T *GetVertex0Data(size_t axis) const { return vertex0_[axis].data(); }
+
+  const T *GetEdge1Data(size_t axis) const { return edge1_[axis].data(); }
+
+  const T *GetEdge2Data(size_t axis) const { return edge2_[axis].data(); }
+
+  BasicVector<T> GetVertex0(size_t index) const {
+    return {vertex0_[0][index], vertex0_[1][index], vertex0_[2][index]};
+  }
+
+  BasicVector<T> GetEdge1(size_t index) const {
+    return {edge1_[0][index], edge1_[1][index], edge1_[2][index]};
+  }
+
+  BasicVector<T> GetEdge2(size_t index) const {
+    return {edge2_[0][index], edge2_[1][index], edge2_[2][index]};
+  }
+
+  BasicTriangle<T> GetTriangle(size_t index) const {
+    BasicVector<T> vertex0 = GetVertex0(index);
+    return {vertex0, vertex0 + GetEdge1(index), vertex0 + GetEdge2(index)};
+  }
+
+  // Нормаль плоскости треугольника, не ориентированная относительно луча;
+  // для затенения всегда считается в double
+  Vector GetGeometricNormal(size_t index) const {
+    return CrossProduct(Vector(GetEdge1(index)), Vector(GetEdge2(index)))
+        .Normalized();
+  }
+
+  bool HasNormals(size_t index) const {
+    return normal_indices_[0][index] != Object::kNoNormal;
+  }
+
+  std::array<int, 3> GetNormalIndices(size_t index) const {
+    return {normal_indices_[0][index], normal_indices_[1][index],
+            normal_indices_[2][index]};
+  }
+
+  uint32_t GetMaterialIndex(size_t index) const {
+    return material_indices_[index];
+  }
+
+  const Material *GetMaterial(size_t index) const {
+    return materials_[material_indices_[index]];
+  }
+
+  // Переводит указатели на материалы по таблице remap; материалы, которых
+  // в ней нет, остаются прежними. Нужен копии сцены, см. Scene::Clone
+  void RemapMaterials(
+      const std::unordered_map<const Material *, const Material *> &remap) {
+    for (const Material *&material : materials_) {
+      if (auto it = remap.find(material); it != remap.end()) {
+        material = it->second;
+      }
+    }
+  }
+
+  // Мёллер-Трумбор по заранее посчитанным рёбрам
+  RAYTRACER_NO_FP_CONTRACT std::optional<TriangleHit>
+  Intersect(size_t index, const BasicRay<T> &ray) const {
+    const T epsilon = T(1e-6);
+
+    const BasicVector<T> &origin = ray.GetOrigin();
+    const BasicVector<T> &direction = ray.GetDirection();
+
+    T e1x = edge1_[0][index], e1y = edge1_[1][index], e1z = edge1_[2][index];
+    T e2x = edge2_[0][index], e2y = edge2_[1][index], e2z = edge2_[2][index];
+
+    T px = direction[1] * e2z - direction[2] * e2y;
+    T py = direction[2] * e2x - direction[0] * e2z;
+    T pz = direction[0] * e2y - direction[1] * e2x;
+    T determinant = e1x * px + e1y * py + e1z * pz;
+
+    if (std::fabs(determinant) < epsilon) {
+      return std::nullopt;
+    }
+
+    T inv_determinant = T(1) / determinant;
+    T sx = origin[0] - vertex0_[0][index];
+    T sy = origin[1] - vertex0_[1][index];
+    T sz = origin[2] - vertex0_[2][index];
+    T u = inv_determinant * (sx * px + sy * py + sz * pz);
+
+    if (u < T(0) || u > T(1)) {
+      return std::nullopt;
+    }
+
+    T qx = sy * e1z - sz * e1y;
+    T qy = sz * e1x - sx * e1z;
+    T qz = sx * e1y - sy * e1x;
+    T v = inv_determinant *
+          (direction[0] * qx + direction[1] * qy + direction[2] * qz);
+
+    if (v < T(0) || (u + v) > T(1)) {
+      return std::nullopt;
+    }
+
+    T t = inv_determinant * (e2x * qx + e2y * qy + e2z * qz);
+
+    if (t <= epsilon) {
+      return std::nullopt;
+    }
+
+    return TriangleHit{t, u, v};
+  }
+
+private:
+  std::array<AlignedVector<T>, 3> vertex0_;
+  std::array<AlignedVector<T>, 3> edge1_;
+  std::array<AlignedVector<T>, 3> edge2_;
+  std::array<AlignedVector<int32_t>, 3> normal_indices_;
+  AlignedVector<uint32_t> material_indices_;
+  std::vector<const Material *> materials_;
+};
+
+using TriangleStore = BasicTriangleStore<double>;
+using FloatTriangleStore = BasicTriangleStore<float>;
@@ -0,0 +1,123 @@
+// Скорость построения BVH: треугольники CERF_Free.obj размножаются в N копий
+// (со сдвигом, как в bench_raytracer_load), и по ним строится дерево каждым
+// способом. Печатает время построения, число треугольников в секунду и
+// SAH-стоимость дерева. Затем копии деформируются волной, как кадры анимации,
+// и для каждого кадра сравнивается Bvh::Refit с построением заново.
+// Использование: bench_raytracer_bvh [--threads N] [N...]
+
+#include "../accel/bvh.h"
+#include "../reader/scene_cache.h"
+#include "../utils/utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+std::vector<Object> CopyObjects(const std::vector<Object> &source,
+                                int copies) {
+  std::vector<Object> objects;
+  objects.reserve(source.size() * copies);
+  for (int copy = 0; copy < copies; ++copy) {
+    Vector shift(200.0 * (copy % 32), 200.0 * (copy / 32 % 32),
+                 200.0 * (copy / 1024));
+    for (const Object &obj : source) {
+      Object shifted = obj;
+      shifted.polygon = {obj.polygon[0] + shift, obj.polygon[1] + shift,
+                         obj.polygon[2] + shift};
+      objects.push_back(shifted);
+    }
+  }
+  return objects;
+}
+
+// Вершины сдвигаются по вертикали волной, бегущей вдоль x
+Vector Deform(const Vector &point, double phase) {
+  return point + Vector(0., 20. * std::sin(point[0] / 50. + phase), 0.);
+}
+
+void RunAnimation(const std::vector<Object> &source, size_t threads) {
+  constexpr int kFrames = 8;
+  std::vector<Object> objects = source;
+  BvhOptions options{.split_method = BvhSplitMethod::kSah, .threads = threads};
+  Bvh bvh(objects, {}, options);
+  ThreadPool pool{threads};
+
+  std::printf("\n%10s %12s %12s %16s %16s\n", "frame", "refit, ms",
+              "build, ms", "refit sah cost", "build sah cost");
+  for (int frame = 1; frame <= kFrames; ++frame) {
+    double phase = 0.4 * frame;
+    for (size_t i = 0; i < objects.size(); ++i) {
+      const Triangle &triangle = source[i].polygon;
+      objects[i].polygon = {Deform(triangle[0], phase),
+                            Deform(triangle[1], phase),
+                            Deform(triangle[2], phase)};
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bvh.Refit(
+        [&](const BvhPrimitive &primitive) {
+          return GetBoundingBox(objects[primitive.index].polygon);
+        },
+        pool);
+    std::chrono::duration<double, std::milli> refit_time =
+        std::chrono::steady_clock::now() - start;
+
+    Bvh rebuilt(objects, {}, options);
+    std::printf("%10d %12.1f %12.1f %16.2f %16.2f\n", frame,
+                refit_time.count(), rebuilt.GetStats().build_time_ms,
+                bvh.GetStats().sah_cost, rebuilt.GetStats().sah_cost);
+  }
+}
+
+int main(int argc, char **argv) {
+  size_t threads = 0;
+  std::vector<int> scales;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string_view{argv[i]} == "--threads" && i + 1 < argc) {
+      threads = std::atoi(argv[++i]);
+    } else {
+      scales.push_back(std::atoi(argv[i]));
+    }
+  }
+  if (scales.empty()) {
+    scales = {1, 10, 100, 1000};
+  }
+
+  auto deer_path =
+      GetRelativeDir(__FILE__, "../tests/test_cases/deer") / "CERF_Free.obj";
+  Scene deer = ReadScene(deer_path, {}, {.mode = SceneCacheMode::kDisabled});
+
+  std::pair<const char *, BvhSplitMethod> methods[] = {
+      {"median", BvhSplitMethod::kMedian},
+      {"sah", BvhSplitMethod::kSah},
+      {"lbvh", BvhSplitMethod::kLbvh}};
+
+  std::printf("threads: %zu\n", ThreadPool::ResolveThreadCount(threads));
+  std::printf("%10s %12s %8s %12s %14s %10s\n", "copies", "triangles",
+              "method", "build, ms", "triangles/s", "sah cost");
+  for (int copies : scales) {
+    auto objects = CopyObjects(deer.GetObjects(), copies);
+    for (auto [name, method] : methods) {
+      // Лучшее из трёх, чтобы не мерить прогрев памяти
+      double build_ms = 0.0;
+      double sah_cost = 0.0;
+      for (int run = 0; run < 3; ++run) {
+        Bvh bvh(objects, {}, {.split_method = method, .threads = threads});
+        const BvhStats &stats = bvh.GetStats();
+        build_ms = run == 0 ? stats.build_time_ms
+                            : std::min(build_ms, stats.build_time_ms);
+        sah_cost = stats.sah_cost;
+      }
+      std::printf("%10d %12zu %8s %12.1f %14.0f %10.2f\n", copies,
+                  objects.size(), name, build_ms,
+                  objects.size() / (build_ms / 1000.0), sah_cost);
+    }
+  }
+
+  RunAnimation(CopyObjects(deer.GetObjects(), scales.back()), threads);
+}
@@ -0,0 +1,144 @@
+// Время загрузки сцены: CERF_Free.obj размножается в N копий (со сдвигом,
+// чтобы BVH строилось по честной геометрии), и каждая копия читается
+// ReadScene, а затем из двоичного кэша. Использование: bench_raytracer_load [N...]
+
+#include "../reader/scene.h"
+#include "../reader/scene_cache.h"
+#include "../reader/text_scanner.h"
+#include "../utils/mapped_file.h"
+#include "../utils/utils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Пишет сцену из copies копий исходной и возвращает число граней
+size_t WriteScaledScene(const std::filesystem::path &source,
+                        const std::filesystem::path &target, int copies) {
+  MappedFile file(source);
+
+  std::string header;
+  std::vector<std::string_view> body;
+  size_t vertex_count = 0, texture_count = 0, normal_count = 0;
+  size_t face_count = 0;
+
+  LineScanner lines(file.View());
+  std::string_view line;
+  while (lines.NextLine(line)) {
+    TokenScanner tokens(line);
+    std::string_view command = tokens.NextToken();
+    if (command == "v" || command == "vt" || command == "vn" ||
+        command == "f") {
+      body.push_back(line);
+      vertex_count += command == "v";
+      texture_count += command == "vt";
+      normal_count += command == "vn";
+      face_count += command == "f";
+    } else if (command == "mtllib" || command == "usemtl" || command == "P") {
+      header.append(line).push_back('\n');
+    }
+  }
+
+  std::ofstream out(target, std::ios::binary);
+  out << header;
+
+  std::string buffer;
+  char number[64];
+  for (int copy = 0; copy < copies; ++copy) {
+    // Копии раскладываются сеткой 32 x 32 x ...
+    double shift[3] = {200.0 * (copy % 32), 200.0 * (copy / 32 % 32),
+                       200.0 * (copy / 1024)};
+    size_t offsets[3] = {copy * vertex_count, copy * texture_count,
+                         copy * normal_count};
+
+    buffer.clear();
+    for (std::string_view body_line : body) {
+      TokenScanner tokens(body_line);
+      std::string_view command = tokens.NextToken();
+      buffer.append(command);
+
+      if (command == "v") {
+        for (double axis_shift : shift) {
+          std::snprintf(number, sizeof(number), " %.4f",
+                        tokens.NextDouble() + axis_shift);
+          buffer.append(number);
+        }
+      } else if (command == "f") {
+        for (auto token = tokens.NextToken(); !token.empty();
+             token = tokens.NextToken()) {
+          buffer.push_back(' ');
+          for (size_t part = 0; part < 3 && !token.empty(); ++part) {
+            size_t slash = token.find('/');
+            auto index = token.substr(0, slash);
+            if (!index.empty()) {
+              std::snprintf(number, sizeof(number), "%zu",
+                            TokenScanner::ParseInt(index) + offsets[part]);
+              buffer.append(number);
+            }
+            if (slash == std::string_view::npos) {
+              break;
+            }
+            buffer.push_back('/');
+            token.remove_prefix(slash + 1);
+          }
+        }
+      } else {
+        buffer.push_back(' ');
+        buffer.append(tokens.Rest());
+      }
+      buffer.push_back('\n');
+    }
+    out << buffer;
+  }
+
+  return face_count * copies;
+}
+
+int main(int argc, char **argv) {
+  std::vector<int> scales;
+  for (int i = 1; i < argc; ++i) {
+    scales.push_back(std::atoi(argv[i]));
+  }
+  if (scales.empty()) {
+    scales = {1, 10, 100, 1000, 2000};
+  }
+
+  auto deer_dir = GetRelativeDir(__FILE__, "../tests/test_cases/deer");
+  auto work_dir = std::filesystem::temp_directory_path() / "raytracer_load";
+  std::filesystem::create_directories(work_dir);
+  std::filesystem::copy_file(deer_dir / "CERF_Free.mtl",
+                             work_dir / "CERF_Free.mtl",
+                             std::filesystem::copy_options::overwrite_existing);
+
+  std::printf("%10s %12s %12s %12s %12s %12s %14s\n", "copies", "faces",
+              "MiB", "parse, ms", "bvh, ms", "cache, ms", "faces/s");
+  for (int copies : scales) {
+    auto path = work_dir / "scene.obj";
+    size_t faces = WriteScaledScene(deer_dir / "CERF_Free.obj", path, copies);
+    double mib = std::filesystem::file_size(path) / (1024.0 * 1024.0);
+
+    Timer timer;
+    Scene scene = ReadScene(path, {}, {.mode = SceneCacheMode::kDisabled});
+    std::chrono::duration<double, std::milli> total = timer.GetTimes().wall_time;
+
+    double build_ms = scene.GetBvh().GetStats().build_time_ms;
+    double parse_ms = total.count() - build_ms;
+
+    // Первое чтение записывает кэш, второе - только его и читает
+    ReadScene(path, {}, {.mode = SceneCacheMode::kReadWrite});
+    Timer cache_timer;
+    ReadScene(path);
+    std::chrono::duration<double, std::milli> cache_ms =
+        cache_timer.GetTimes().wall_time;
+
+    std::printf("%10d %12zu %12.1f %12.1f %12.1f %12.1f %14.0f\n", copies,
+                faces, mib, parse_ms, build_ms, cache_ms.count(),
+                faces / (parse_ms / 1000.0));
+  }
+
+  std::filesystem::remove_all(work_dir);
+}
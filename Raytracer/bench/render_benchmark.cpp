@@ -0,0 +1,238 @@
+// Рендерит все тестовые сцены несколько раз и печатает JSON с временем
+// загрузки, построения BVH и рендеринга, числом лучей в секунду, счётчиками
+// лучей и пересечений, памятью на узлы BVH и пиковым потреблением памяти.
+// Использование: bench_raytracer_render [--iterations N] [--threads N]
+//                                       [--precision double|float]
+//                                       [--nodes binary|compressed]
+//                                       [--output results.json]
+
+#include "../raytracer.h"
+#include "../utils/utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <numbers>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct BenchmarkScene {
+  std::string name;
+  std::string path;
+  CameraOptions camera;
+  int depth;
+};
+
+std::vector<BenchmarkScene> GetBenchmarkScenes() {
+  return {
+      {"shading_parts", "shading_parts/scene.obj", {640, 480}, 1},
+      {"triangle",
+       "triangle/scene.obj",
+       {.screen_width = 640,
+        .screen_height = 480,
+        .look_from = {0., 2., 0.},
+        .look_to = {0., 0., 0.}},
+       1},
+      {"box_with_spheres",
+       "box/cube.obj",
+       {.screen_width = 640,
+        .screen_height = 480,
+        .fov = std::numbers::pi / 3,
+        .look_from = {0., .7, 1.75},
+        .look_to = {0., .7, 0.}},
+       4},
+      {"classic_box",
+       "classic_box/CornellBox.obj",
+       {.screen_width = 500,
+        .screen_height = 500,
+        .look_from = {-.5, 1.5, .98},
+        .look_to = {0., 1., 0.}},
+       4},
+      {"mirrors",
+       "mirrors/scene.obj",
+       {.screen_width = 800,
+        .screen_height = 600,
+        .look_from = {2., 1.5, -.1},
+        .look_to = {1., 1.2, -2.8}},
+       9},
+      {"distorted_box",
+       "distorted_box/CornellBox.obj",
+       {.screen_width = 500,
+        .screen_height = 500,
+        .look_from = {-0.5, 1.5, 1.98},
+        .look_to = {0., 1., 0.}},
+       4},
+      {"deer",
+       "deer/CERF_Free.obj",
+       {.screen_width = 500,
+        .screen_height = 500,
+        .look_from = {100., 200., 150.},
+        .look_to = {0., 100., 0.}},
+       1},
+  };
+}
+
+struct BenchmarkOptions {
+  int iterations = 5;
+  size_t threads = 0;
+  Precision precision = Precision::kDouble;
+  bool compressed_nodes = false;
+  std::string output;
+};
+
+BenchmarkOptions ParseArguments(int argc, char **argv) {
+  BenchmarkOptions options;
+  for (int i = 1; i < argc; ++i) {
+    std::string_view arg = argv[i];
+    if (i + 1 == argc) {
+      throw std::invalid_argument{"Missing value for " + std::string{arg}};
+    }
+    if (arg == "--iterations") {
+      options.iterations = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--threads") {
+      options.threads = std::atoi(argv[++i]);
+    } else if (arg == "--precision") {
+      std::string_view value = argv[++i];
+      if (value != "double" && value != "float") {
+        throw std::invalid_argument{"Unknown precision " + std::string{value}};
+      }
+      options.precision =
+          value == "float" ? Precision::kFloat : Precision::kDouble;
+    } else if (arg == "--nodes") {
+      std::string_view value = argv[++i];
+      if (value != "binary" && value != "compressed") {
+        throw std::invalid_argument{"Unknown node layout " +
+                                    std::string{value}};
+      }
+      options.compressed_nodes = value == "compressed";
+    } else if (arg == "--output") {
+      options.output = argv[++i];
+    } else {
+      throw std::invalid_argument{"Unknown argument " + std::string{arg}};
+    }
+  }
+  return options;
+}
+
+double ToMilliseconds(auto duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+int64_t GetPeakMemoryKb() {
+#ifdef __linux__
+  return GetMemoryUsage();
+#else
+  return -1;
+#endif
+}
+
+// Одна сцена - один объект JSON
+std::string RunScene(const BenchmarkScene &bench_scene,
+                     const BenchmarkOptions &options) {
+  auto tests_dir = GetRelativeDir(__FILE__, "../tests/test_cases");
+  RenderOptions render_options{bench_scene.depth};
+  render_options.threads = options.threads;
+  render_options.precision = options.precision;
+  render_options.bvh.compressed_nodes = options.compressed_nodes;
+
+  // Кэш сцены выключен, чтобы мерить разбор .obj и построение BVH
+  Timer load_timer;
+  PreparedScene scene(tests_dir / bench_scene.path, render_options.bvh,
+                      {.mode = SceneCacheMode::kDisabled},
+                      render_options.precision);
+  double load_ms = ToMilliseconds(load_timer.GetTimes().wall_time);
+  const BvhStats &bvh_stats = scene.GetBvhStats();
+
+  std::vector<double> wall_ms, cpu_ms;
+  for (int i = 0; i < options.iterations; ++i) {
+    Timer timer;
+    Render(scene, bench_scene.camera, render_options);
+    auto times = timer.GetTimes();
+    wall_ms.push_back(ToMilliseconds(times.wall_time));
+    cpu_ms.push_back(ToMilliseconds(times.cpu_time));
+  }
+
+  std::vector<double> sorted = wall_ms;
+  std::sort(sorted.begin(), sorted.end());
+  double min_ms = sorted.front();
+  double median_ms = sorted[sorted.size() / 2];
+  double mean_ms =
+      std::accumulate(wall_ms.begin(), wall_ms.end(), 0.0) / wall_ms.size();
+  double mean_cpu_ms =
+      std::accumulate(cpu_ms.begin(), cpu_ms.end(), 0.0) / cpu_ms.size();
+
+  // Счётчики снимаются отдельным проходом, чтобы не влиять на замеры
+  RenderStats stats;
+  RenderOptions stats_options = render_options;
+  stats_options.stats = &stats;
+  Render(scene, bench_scene.camera, stats_options);
+  double rays_per_second = stats.TotalRays() / (median_ms / 1000.0);
+
+  char buffer[4096];
+  std::snprintf(
+      buffer, sizeof(buffer),
+      "    {\n"
+      "      \"name\": \"%s\",\n"
+      "      \"width\": %d,\n"
+      "      \"height\": %d,\n"
+      "      \"depth\": %d,\n"
+      "      \"primitives\": %zu,\n"
+      "      \"load_ms\": %.3f,\n"
+      "      \"build_ms\": %.3f,\n"
+      "      \"bvh_node_bytes\": %zu,\n"
+      "      \"render_ms\": {\"min\": %.3f, \"median\": %.3f, \"mean\": %.3f},\n"
+      "      \"render_cpu_ms\": %.3f,\n"
+      "      \"rays_per_second\": %.0f,\n"
+      "      \"peak_rss_kb\": %lld,\n"
+      "      \"stats\": %s\n"
+      "    }",
+      bench_scene.name.c_str(), bench_scene.camera.screen_width,
+      bench_scene.camera.screen_height, bench_scene.depth,
+      bvh_stats.primitive_count, load_ms, bvh_stats.build_time_ms,
+      scene.GetScene().GetBvh().GetNodeBytes(), min_ms,
+      median_ms, mean_ms, mean_cpu_ms, rays_per_second,
+      static_cast<long long>(GetPeakMemoryKb()), stats.ToJson().c_str());
+  return buffer;
+}
+
+int main(int argc, char **argv) {
+  auto options = ParseArguments(argc, argv);
+
+  std::string json = "{\n";
+  json += "  \"iterations\": " + std::to_string(options.iterations) + ",\n";
+  json += "  \"threads\": " +
+          std::to_string(ThreadPool::ResolveThreadCount(options.threads)) +
+          ",\n";
+  json += std::string{"  \"precision\": \""} +
+          (options.precision == Precision::kFloat ? "float" : "double") +
+          "\",\n";
+  json += std::string{"  \"nodes\": \""} +
+          (options.compressed_nodes ? "compressed" : "binary") + "\",\n";
+  json += "  \"scenes\": [\n";
+
+  auto scenes = GetBenchmarkScenes();
+  for (size_t i = 0; i < scenes.size(); ++i) {
+    std::fprintf(stderr, "%s...\n", scenes[i].name.c_str());
+    json += RunScene(scenes[i], options);
+    json += i + 1 < scenes.size() ? ",\n" : "\n";
+  }
+  json += "  ],\n";
+  json += "  \"peak_rss_kb\": " + std::to_string(GetPeakMemoryKb()) + "\n";
+  json += "}\n";
+
+  if (options.output.empty()) {
+    std::fputs(json.c_str(), stdout);
+  } else {
+    std::FILE *file = std::fopen(options.output.c_str(), "w");
+    if (!file) {
+      throw std::runtime_error{"Can't open file " + options.output};
+    }
+    std::fputs(json.c_str(), file);
+    std::fclose(file);
+  }
+}
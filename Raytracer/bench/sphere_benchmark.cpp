@@ -0,0 +1,155 @@
+// Сцены из одних сфер: сравнивает перебор всех сфер, BVH и равномерную
+// сетку (SphereGrid). Сферы одного размера случайно разбросаны в кубе и
+// занимают 5% его объёма; лучи идут из точки снаружи куба. Печатает время
+// построения, память и число лучей в секунду; перебор проверяет меньше
+// лучей, а попадания всех способов сверяются с ним.
+// Использование: bench_raytracer_spheres [N...]
+
+#include "../accel/bvh.h"
+#include "../accel/sphere_grid.h"
+#include "../geometry/geometry.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <numbers>
+#include <random>
+#include <vector>
+
+constexpr double kCubeSize = 100.0;
+constexpr double kVolumeShare = 0.05;
+constexpr size_t kRayCount = 1 << 16;
+constexpr size_t kBruteForceRayCount = 256;
+
+std::vector<SphereObject> MakeSpheres(size_t count) {
+  double radius = std::cbrt(kVolumeShare * kCubeSize * kCubeSize * kCubeSize *
+                            3.0 / (4.0 * std::numbers::pi * count));
+  std::mt19937 generator(1);
+  std::uniform_real_distribution<double> position(0.0, kCubeSize);
+  std::vector<SphereObject> spheres;
+  spheres.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    spheres.emplace_back(Sphere(
+        {position(generator), position(generator), position(generator)},
+        radius));
+  }
+  return spheres;
+}
+
+std::vector<Ray> MakeRays(size_t count) {
+  std::mt19937 generator(2);
+  std::uniform_real_distribution<double> target(0.0, kCubeSize);
+  Vector origin(-0.5 * kCubeSize, 1.5 * kCubeSize, -0.5 * kCubeSize);
+  std::vector<Ray> rays;
+  rays.reserve(count);
+  for (size_t i = 0; i < count; ++i) {
+    Vector point(target(generator), target(generator), target(generator));
+    rays.emplace_back(origin, (point - origin).Normalized());
+  }
+  return rays;
+}
+
+double ToMilliseconds(auto duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+// Расстояния до ближайших попаданий; kMiss - промах
+template <class ClosestFunc>
+std::vector<double> TraceRays(const std::vector<Ray> &rays, size_t count,
+                              ClosestFunc &&closest, double *rays_per_second) {
+  std::vector<double> distances(count);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < count; ++i) {
+    distances[i] = closest(rays[i]);
+  }
+  double ms = ToMilliseconds(std::chrono::steady_clock::now() - start);
+  *rays_per_second = count / (ms / 1000.0);
+  return distances;
+}
+
+int main(int argc, char **argv) {
+  std::vector<size_t> counts;
+  for (int i = 1; i < argc; ++i) {
+    counts.push_back(std::atoll(argv[i]));
+  }
+  if (counts.empty()) {
+    counts = {100000, 300000, 1000000};
+  }
+  std::vector<Ray> rays = MakeRays(kRayCount);
+  const double kMiss = std::numeric_limits<double>::max();
+
+  std::printf("%10s %12s %10s %10s %14s %12s\n", "spheres", "method",
+              "build, ms", "memory, MB", "rays/s", "mismatches");
+  for (size_t count : counts) {
+    auto spheres = MakeSpheres(count);
+    auto hit_distance = [&](const Ray &ray, uint32_t index, double t_max) {
+      auto distance = GetIntersectionDistance(ray, spheres[index].sphere);
+      return distance.has_value() && *distance < t_max ? *distance : t_max;
+    };
+
+    double brute_rate;
+    auto expected = TraceRays(
+        rays, kBruteForceRayCount,
+        [&](const Ray &ray) {
+          double t_max = kMiss;
+          for (uint32_t i = 0; i < spheres.size(); ++i) {
+            t_max = hit_distance(ray, i, t_max);
+          }
+          return t_max;
+        },
+        &brute_rate);
+    auto mismatches = [&](const std::vector<double> &distances) {
+      size_t result = 0;
+      for (size_t i = 0; i < kBruteForceRayCount; ++i) {
+        result += distances[i] != expected[i];
+      }
+      return result;
+    };
+    std::printf("%10zu %12s %10s %10s %14.0f %12s\n", count, "brute force",
+                "-", "-", brute_rate, "-");
+
+    Bvh bvh({}, spheres);
+    double bvh_rate;
+    auto bvh_distances = TraceRays(
+        rays, kRayCount,
+        [&](const Ray &ray) {
+          double t_max = kMiss;
+          bvh.Traverse(ray, t_max,
+                       [&](std::span<const BvhPrimitive> primitives,
+                           double &t) {
+                         for (const BvhPrimitive &primitive : primitives) {
+                           t = hit_distance(ray, primitive.index, t);
+                         }
+                       });
+          return t_max;
+        },
+        &bvh_rate);
+    double bvh_mb = (bvh.GetNodeBytes() +
+                     bvh.GetPrimitives().size() * sizeof(BvhPrimitive)) /
+                    1e6;
+    std::printf("%10zu %12s %10.1f %10.1f %14.0f %12zu\n", count, "bvh",
+                bvh.GetStats().build_time_ms, bvh_mb, bvh_rate,
+                mismatches(bvh_distances));
+
+    SphereGrid grid(spheres);
+    double grid_rate;
+    auto grid_distances = TraceRays(
+        rays, kRayCount,
+        [&](const Ray &ray) {
+          double t_max = kMiss;
+          grid.Traverse(ray, t_max,
+                        [&](std::span<const uint32_t> indices, double &t) {
+                          for (uint32_t index : indices) {
+                            t = hit_distance(ray, index, t);
+                          }
+                        });
+          return t_max;
+        },
+        &grid_rate);
+    std::printf("%10zu %12s %10.1f %10.1f %14.0f %12zu\n", count, "grid",
+                grid.GetBuildTimeMs(), grid.GetBytes() / 1e6, grid_rate,
+                mismatches(grid_distances));
+  }
+}
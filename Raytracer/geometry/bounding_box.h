@@ -0,0 +1,158 @@
+#pragma once
+
+#include "ray.h"
+#include "sphere.h"
+#include "triangle.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+
+// Точность коробки совпадает с точностью геометрии, для которой она
+// строится; при сужении до float границы округляются наружу
+template <class T>
+class BasicBoundingBox {
+public:
+  BasicBoundingBox()
+      : min_(std::numeric_limits<T>::max(), std::numeric_limits<T>::max(),
+             std::numeric_limits<T>::max()),
+        max_(std::numeric_limits<T>::lowest(), std::numeric_limits<T>::lowest(),
+             std::numeric_limits<T>::lowest()) {}
+
+  BasicBoundingBox(const BasicVector<T> &min, const BasicVector<T> &max)
+      : min_(min), max_(max) {}
+
+  // Коробка в другой точности, содержащая исходную
+  template <class U>
+  explicit BasicBoundingBox(const BasicBoundingBox<U> &other) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      U min = other.GetMin()[axis];
+      U max = other.GetMax()[axis];
+      min_[axis] = static_cast<T>(min);
+      max_[axis] = static_cast<T>(max);
+      if (min_[axis] > min) {
+        min_[axis] = std::nextafter(min_[axis], std::numeric_limits<T>::lowest());
+      }
+      if (max_[axis] < max) {
+        max_[axis] = std::nextafter(max_[axis], std::numeric_limits<T>::max());
+      }
+    }
+  }
+
+  const BasicVector<T> &GetMin() const { return min_; }
+
+  const BasicVector<T> &GetMax() const { return max_; }
+
+  bool IsEmpty() const { return min_[0] > max_[0]; }
+
+  void Extend(const BasicVector<T> &point) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      min_[axis] = std::min(min_[axis], point[axis]);
+      max_[axis] = std::max(max_[axis], point[axis]);
+    }
+  }
+
+  void Extend(const BasicBoundingBox &other) {
+    for (size_t axis = 0; axis < 3; ++axis) {
+      min_[axis] = std::min(min_[axis], other.min_[axis]);
+      max_[axis] = std::max(max_[axis], other.max_[axis]);
+    }
+  }
+
+  BasicVector<T> Centroid() const { return T(0.5) * (min_ + max_); }
+
+  BasicVector<T> Extent() const { return max_ - min_; }
+
+  size_t LargestAxis() const {
+    BasicVector<T> extent = Extent();
+    if (extent[0] >= extent[1] && extent[0] >= extent[2]) {
+      return 0;
+    }
+    return extent[1] >= extent[2] ? 1 : 2;
+  }
+
+  T SurfaceArea() const {
+    if (IsEmpty()) {
+      return T(0);
+    }
+    BasicVector<T> extent = Extent();
+    return T(2) * (extent[0] * extent[1] + extent[1] * extent[2] +
+                   extent[2] * extent[0]);
+  }
+
+private:
+  BasicVector<T> min_;
+  BasicVector<T> max_;
+};
+
+using BoundingBox = BasicBoundingBox<double>;
+using FloatBoundingBox = BasicBoundingBox<float>;
+
+// Луч с заранее посчитанными обратными направлениями для slab-теста
+template <class T>
+class BasicBoxRay {
+public:
+  explicit BasicBoxRay(const BasicRay<T> &ray) : origin_(ray.GetOrigin()) {
+    const BasicVector<T> &direction = ray.GetDirection();
+    for (size_t axis = 0; axis < 3; ++axis) {
+      inv_direction_[axis] = T(1) / direction[axis];
+    }
+  }
+
+  BasicBoxRay(const BasicVector<T> &origin, const BasicVector<T> &inv_direction)
+      : origin_(origin), inv_direction_(inv_direction) {}
+
+  // Расстояние до входа в коробку или бесконечность, если пересечения
+  // на отрезке [0, t_max] нет
+  T Intersect(const BasicBoundingBox<T> &box, T t_max) const {
+    // Запас на ошибки округления, чтобы не терять касательные попадания;
+    // во float ошибка на много порядков больше
+    const T robust_factor =
+        std::is_same_v<T, float> ? T(1.0f + 1e-6f) : T(1.0 + 1e-12);
+
+    T t_near = T(0);
+    T t_far = t_max;
+    for (size_t axis = 0; axis < 3; ++axis) {
+      T t0 = (box.GetMin()[axis] - origin_[axis]) * inv_direction_[axis];
+      T t1 = (box.GetMax()[axis] - origin_[axis]) * inv_direction_[axis];
+      if (t0 > t1) {
+        std::swap(t0, t1);
+      }
+      t_near = t0 > t_near ? t0 : t_near;
+      t_far = t1 * robust_factor < t_far ? t1 * robust_factor : t_far;
+    }
+
+    return t_near <= t_far ? t_near : std::numeric_limits<T>::infinity();
+  }
+
+  const BasicVector<T> &GetOrigin() const { return origin_; }
+
+  const BasicVector<T> &GetInvDirection() const { return inv_direction_; }
+
+private:
+  BasicVector<T> origin_;
+  BasicVector<T> inv_direction_;
+};
+
+using BoxRay = BasicBoxRay<double>;
+using FloatBoxRay = BasicBoxRay<float>;
+
+template <class T>
+BasicBoundingBox<T> GetBoundingBox(const BasicTriangle<T> &triangle) {
+  BasicBoundingBox<T> box;
+  box.Extend(triangle[0]);
+  box.Extend(triangle[1]);
+  box.Extend(triangle[2]);
+  return box;
+}
+
+template <class T>
+BasicBoundingBox<T> GetBoundingBox(const BasicSphere<T> &sphere) {
+  BasicVector<T> radius(sphere.GetRadius(), sphere.GetRadius(),
+                        sphere.GetRadius());
+  return BasicBoundingBox<T>(sphere.GetCenter() - radius,
+                             sphere.GetCenter() + radius);
+}
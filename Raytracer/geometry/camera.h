@@ -0,0 +1,111 @@
+#pragma once
+
+#include "../options/camera_options.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "vector.h"
+
+#include <cassert>
+#include <cmath>
+
+// Камера с базисом и шагами по пикселям, посчитанными один раз на кадр.
+// Направление через точку (x, y) экрана линейно по x и y:
+// base + x * step_x + y * step_y, так что на луч остаются два умножения,
+// сложения и нормировка.
+class Camera {
+public:
+  explicit Camera(const CameraOptions &options)
+      : origin_(options.look_from), width_(options.screen_width),
+        height_(options.screen_height) {
+    const double epsilon = 1e-6;
+
+    double aspect_ratio = width_ / static_cast<double>(height_);
+    double scale = std::tan(options.fov * 0.5);
+
+    Vector forward = options.look_from - options.look_to;
+    forward.Normalize();
+
+    Vector world_up(0.0, 1.0, 0.0);
+    if (DotProduct(world_up, forward) > 1.0 - epsilon) {
+      world_up = Vector{0.0, 0.0, -1.0};
+    } else if (DotProduct(world_up, forward) < -1.0 + epsilon) {
+      world_up = Vector{0.0, 0.0, +1.0};
+    }
+
+    Vector right = CrossProduct(world_up, forward);
+    right.Normalize();
+
+    Vector up = CrossProduct(forward, right);
+
+    // В системе камеры луч идёт в (camera_x, camera_y, -1), где
+    // camera_x = (2x / width - 1) * aspect_ratio * scale и
+    // camera_y = (1 - 2y / height) * scale
+    base_ = -aspect_ratio * scale * right + scale * up - forward;
+    step_x_ = (2.0 * aspect_ratio * scale / width_) * right;
+    step_y_ = (-2.0 * scale / height_) * up;
+  }
+
+  int Width() const { return width_; }
+
+  int Height() const { return height_; }
+
+  const Vector &GetOrigin() const { return origin_; }
+
+  // Ненормированное направление через точку (x, y) экрана
+  Vector GetDirection(double x, double y) const {
+    return base_ + x * step_x_ + y * step_y_;
+  }
+
+  // Луч через точку (x + dx, y + dy); по умолчанию через центр пикселя
+  Ray GetRay(int x, int y, double dx = 0.5, double dy = 0.5) const {
+    return Ray(origin_, GetDirection(x + dx, y + dy));
+  }
+
+  // Нормированные направления через центры пикселей [x_begin, x_end)
+  // строки y. Цикл без ветвлений и зависимостей между итерациями, поэтому
+  // компилятор его векторизует.
+  void GetRowDirections(int y, int x_begin, int x_end, double *direction_x,
+                        double *direction_y, double *direction_z) const {
+    Vector row = base_ + (y + 0.5) * step_y_;
+    for (int x = x_begin; x < x_end; ++x) {
+      double offset = x + 0.5;
+      double dx = row[0] + offset * step_x_[0];
+      double dy = row[1] + offset * step_x_[1];
+      double dz = row[2] + offset * step_x_[2];
+      double inv_length = 1.0 / std::sqrt(dx * dx + dy * dy + dz * dz);
+      size_t i = x - x_begin;
+      direction_x[i] = dx * inv_length;
+      direction_y[i] = dy * inv_length;
+      direction_z[i] = dz * inv_length;
+    }
+  }
+
+  // Пучок лучей через центры пикселей блока width x height с левым верхним
+  // углом (x_begin, y_begin)
+  void GetPacket(int x_begin, int y_begin, int width, int height,
+                 RayPacket *packet) const {
+    assert(width > 0 && width <= RayPacket::kSide);
+    assert(height > 0 && height <= RayPacket::kSide);
+
+    packet->origin = origin_;
+    packet->x_begin = x_begin;
+    packet->y_begin = y_begin;
+    packet->width = width;
+    packet->height = height;
+    for (int row = 0; row < height; ++row) {
+      size_t offset = row * width;
+      GetRowDirections(y_begin + row, x_begin, x_begin + width,
+                       packet->direction_x.data() + offset,
+                       packet->direction_y.data() + offset,
+                       packet->direction_z.data() + offset);
+    }
+  }
+
+private:
+  Vector origin_;
+  Vector base_;
+  Vector step_x_;
+  Vector step_y_;
+  int width_;
+  int height_;
+};
@@ -8,97 +8,128 @@
 
 #include <cmath>
 #include <optional>
+#include <type_traits>
 
-std::optional<Intersection> GetIntersection(const Ray &ray,
-                                            const Sphere &sphere) {
-  const double epsilon = 1e-6;
+// Только расстояние до пересечения, без точки и нормали
+template <class T>
+std::optional<T> GetIntersectionDistance(const BasicRay<T> &ray,
+                                         const BasicSphere<T> &sphere) {
+  const T epsilon = T(1e-6);
 
-  Vector oc = ray.GetOrigin() - sphere.GetCenter();
+  BasicVector<T> oc = ray.GetOrigin() - sphere.GetCenter();
 
-  double a = DotProduct(ray.GetDirection(), ray.GetDirection());
-  double b = 2.0 * DotProduct(oc, ray.GetDirection());
-  double c = DotProduct(oc, oc) - sphere.GetRadius() * sphere.GetRadius();
+  T a = DotProduct(ray.GetDirection(), ray.GetDirection());
+  T b = T(2) * DotProduct(oc, ray.GetDirection());
+  T c = DotProduct(oc, oc) - sphere.GetRadius() * sphere.GetRadius();
 
-  double discriminant = b * b - 4 * a * c;
+  T discriminant = b * b - 4 * a * c;
 
-  if (fabs(discriminant) < epsilon) {
-    discriminant = 0.0;
+  if (std::abs(discriminant) < epsilon) {
+    discriminant = T(0);
   }
 
   if (discriminant < epsilon) {
     return std::nullopt;
   }
 
-  double sqrt_d = std::sqrt(discriminant);
-  double t1 = (-b - sqrt_d) / (2 * a);
-  double t2 = (-b + sqrt_d) / (2 * a);
+  T sqrt_d = std::sqrt(discriminant);
+  T t1 = (-b - sqrt_d) / (2 * a);
+  T t2 = (-b + sqrt_d) / (2 * a);
 
-  double t = (t1 > epsilon) ? t1 : ((t2 > epsilon) ? t2 : -1.0);
+  T t = (t1 > epsilon) ? t1 : ((t2 > epsilon) ? t2 : T(-1));
 
   if (t <= epsilon) {
     return std::nullopt;
   }
 
-  Vector position = ray.GetOrigin() + t * ray.GetDirection();
-  Vector normal = position - sphere.GetCenter();
+  return t;
+}
+
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(
+    const BasicRay<T> &ray, const BasicSphere<T> &sphere) {
+  auto t = GetIntersectionDistance(ray, sphere);
+  if (!t.has_value()) {
+    return std::nullopt;
+  }
+
+  BasicVector<T> position = ray.GetOrigin() + *t * ray.GetDirection();
+  BasicVector<T> normal = position - sphere.GetCenter();
   normal.Normalize();
 
-  return Intersection(position, normal, t);
+  return BasicIntersection<T>(position, normal, *t);
 }
 
 // Алгоритм Мёллера-Трумбора
 // (https://registry.khronos.org/OpenGL-Refpages/gl4/html/reflect.xhtml)
-std::optional<Intersection> GetIntersection(const Ray &ray,
-                                            const Triangle &triangle) {
-  const double epsilon = 1e-6;
+template <class T>
+std::optional<T> GetIntersectionDistance(const BasicRay<T> &ray,
+                                         const BasicTriangle<T> &triangle) {
+  const T epsilon = T(1e-6);
 
-  Vector edge1 = triangle[1] - triangle[0];
-  Vector edge2 = triangle[2] - triangle[0];
-  Vector ray_cross_edge2 = CrossProduct(ray.GetDirection(), edge2);
-  double determinant = DotProduct(edge1, ray_cross_edge2);
+  BasicVector<T> edge1 = triangle[1] - triangle[0];
+  BasicVector<T> edge2 = triangle[2] - triangle[0];
+  BasicVector<T> ray_cross_edge2 = CrossProduct(ray.GetDirection(), edge2);
+  T determinant = DotProduct(edge1, ray_cross_edge2);
 
-  if (fabs(determinant) < epsilon) {
+  if (std::abs(determinant) < epsilon) {
     return std::nullopt;
   }
 
-  double inv_determinant = 1.0 / determinant;
-  Vector s = ray.GetOrigin() - triangle[0];
-  double u = inv_determinant * DotProduct(s, ray_cross_edge2);
+  T inv_determinant = T(1) / determinant;
+  BasicVector<T> s = ray.GetOrigin() - triangle[0];
+  T u = inv_determinant * DotProduct(s, ray_cross_edge2);
 
-  if (u < 0.0 || u > 1.0) {
+  if (u < T(0) || u > T(1)) {
     return std::nullopt;
   }
 
-  Vector s_cross_edge1 = CrossProduct(s, edge1);
-  double v = inv_determinant * DotProduct(ray.GetDirection(), s_cross_edge1);
+  BasicVector<T> s_cross_edge1 = CrossProduct(s, edge1);
+  T v = inv_determinant * DotProduct(ray.GetDirection(), s_cross_edge1);
 
-  if (v < 0.0 || (u + v) > 1.0) {
+  if (v < T(0) || (u + v) > T(1)) {
     return std::nullopt;
   }
 
-  double t = inv_determinant * DotProduct(edge2, s_cross_edge1);
+  T t = inv_determinant * DotProduct(edge2, s_cross_edge1);
 
   if (t <= epsilon) {
     return std::nullopt;
   }
 
-  Vector position = ray.GetOrigin() + t * ray.GetDirection();
-  Vector normal = CrossProduct(edge1, edge2);
+  return t;
+}
+
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(
+    const BasicRay<T> &ray, const BasicTriangle<T> &triangle) {
+  auto t = GetIntersectionDistance(ray, triangle);
+  if (!t.has_value()) {
+    return std::nullopt;
+  }
+
+  BasicVector<T> position = ray.GetOrigin() + *t * ray.GetDirection();
+  BasicVector<T> normal = CrossProduct(triangle[1] - triangle[0],
+                                       triangle[2] - triangle[0]);
   normal.Normalize();
 
-  return Intersection(position, normal, t);
+  return BasicIntersection<T>(position, normal, *t);
 }
 
-Vector Reflect(const Vector &ray, const Vector &normal) {
-  return ray - 2.0 * DotProduct(ray, normal) * normal;
+template <class T>
+BasicVector<T> Reflect(const BasicVector<T> &ray,
+                       const BasicVector<T> &normal) {
+  return ray - T(2) * DotProduct(ray, normal) * normal;
 }
 
-std::optional<Vector> Refract(const Vector &ray, const Vector &normal,
-                              double eta) {
-  const double epsilon = 1e-6;
+template <class T>
+std::optional<BasicVector<T>> Refract(const BasicVector<T> &ray,
+                                      const BasicVector<T> &normal,
+                                      std::type_identity_t<T> eta) {
+  const T epsilon = T(1e-6);
 
-  double dot_ray_normal = DotProduct(ray, normal);
-  double k = 1.0 - eta * eta * (1.0 - dot_ray_normal * dot_ray_normal);
+  T dot_ray_normal = DotProduct(ray, normal);
+  T k = T(1) - eta * eta * (T(1) - dot_ray_normal * dot_ray_normal);
 
   if (k < -epsilon) {
     return std::nullopt;
@@ -107,17 +138,19 @@ std::optional<Vector> Refract(const Vector &ray, const Vector &normal,
   return eta * ray - (eta * dot_ray_normal + std::sqrt(k)) * normal;
 }
 
-Vector GetBarycentricCoords(const Triangle &triangle, const Vector &point) {
+template <class T>
+BasicVector<T> GetBarycentricCoords(const BasicTriangle<T> &triangle,
+                                    const BasicVector<T> &point) {
 
-  Triangle subtriangle1(point, triangle[1], triangle[2]);
-  Triangle subtriangle2(triangle[0], point, triangle[2]);
-  Triangle subtriangle3(triangle[0], triangle[1], point);
+  BasicTriangle<T> subtriangle1(point, triangle[1], triangle[2]);
+  BasicTriangle<T> subtriangle2(triangle[0], point, triangle[2]);
+  BasicTriangle<T> subtriangle3(triangle[0], triangle[1], point);
 
-  double total_area = triangle.Area();
+  T total_area = triangle.Area();
 
-  double u = subtriangle1.Area() / total_area;
-  double v = subtriangle2.Area() / total_area;
-  double w = subtriangle3.Area() / total_area;
+  T u = subtriangle1.Area() / total_area;
+  T v = subtriangle2.Area() / total_area;
+  T w = subtriangle3.Area() / total_area;
 
-  return Vector(u, v, w);
+  return BasicVector<T>(u, v, w);
 }
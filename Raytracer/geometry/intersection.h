@@ -2,19 +2,24 @@
 
 #include "vector.h"
 
-class Intersection {
+template <class T>
+class BasicIntersection {
 public:
-  Intersection(const Vector &position, const Vector &normal, double distance)
+  BasicIntersection(const BasicVector<T> &position,
+                    const BasicVector<T> &normal, T distance)
       : position_(position), normal_(normal), distance_(distance) {}
 
-  const Vector &GetPosition() const { return position_; }
+  const BasicVector<T> &GetPosition() const { return position_; }
 
-  const Vector &GetNormal() const { return normal_; }
+  const BasicVector<T> &GetNormal() const { return normal_; }
 
-  double GetDistance() const { return distance_; }
+  T GetDistance() const { return distance_; }
 
 private:
-  Vector position_;
-  Vector normal_;
-  double distance_;
+  BasicVector<T> position_;
+  BasicVector<T> normal_;
+  T distance_;
 };
+
+using Intersection = BasicIntersection<double>;
+using FloatIntersection = BasicIntersection<float>;
@@ -2,20 +2,29 @@
 
 #include "vector.h"
 
-class Ray {
+template <class T>
+class BasicRay {
 public:
-  Ray() = default;
+  BasicRay() = default;
 
-  Ray(const Vector &origin, const Vector &direction)
+  BasicRay(const BasicVector<T> &origin, const BasicVector<T> &direction)
       : origin_(origin), direction_(direction) {
     direction_.Normalize();
   }
 
-  const Vector &GetOrigin() const { return origin_; }
+  // Направление уже нормировано в исходной точности и заново не нормируется
+  template <class U>
+  explicit BasicRay(const BasicRay<U> &other)
+      : origin_(other.GetOrigin()), direction_(other.GetDirection()) {}
 
-  const Vector &GetDirection() const { return direction_; }
+  const BasicVector<T> &GetOrigin() const { return origin_; }
+
+  const BasicVector<T> &GetDirection() const { return direction_; }
 
 private:
-  Vector origin_;
-  Vector direction_;
+  BasicVector<T> origin_;
+  BasicVector<T> direction_;
 };
+
+using Ray = BasicRay<double>;
+using FloatRay = BasicRay<float>;
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../utils/aligned_allocator.h"
+#include "ray.h"
+#include "vector.h"
+
+#include <array>
+#include <cstddef>
+
+// Пучок первичных лучей из одной точки через блок соседних пикселей.
+// Направления лежат по компонентам, чтобы их можно было обрабатывать
+// SIMD-регистрами. Лучи идут по строкам блока: луч i проходит через пиксель
+// (x_begin + i % width, y_begin + i / width).
+struct RayPacket {
+  static constexpr int kSide = 4;
+  static constexpr size_t kMaxSize = kSide * kSide;
+
+  Vector origin;
+  int x_begin = 0;
+  int y_begin = 0;
+  // У блоков на краю картинки ширина и высота могут быть меньше kSide
+  int width = 0;
+  int height = 0;
+  alignas(kCacheLineSize) std::array<double, kMaxSize> direction_x;
+  alignas(kCacheLineSize) std::array<double, kMaxSize> direction_y;
+  alignas(kCacheLineSize) std::array<double, kMaxSize> direction_z;
+
+  size_t Size() const { return width * height; }
+
+  Ray GetRay(size_t index) const {
+    return Ray(origin,
+               {direction_x[index], direction_y[index], direction_z[index]});
+  }
+};
@@ -2,18 +2,22 @@
 
 #include "vector.h"
 
-class Sphere {
+template <class T>
+class BasicSphere {
 public:
-  Sphere() = default;
+  BasicSphere() = default;
 
-  Sphere(const Vector &center, double radius)
+  BasicSphere(const BasicVector<T> &center, T radius)
       : center_(center), radius_(radius) {}
 
-  const Vector &GetCenter() const { return center_; }
+  const BasicVector<T> &GetCenter() const { return center_; }
 
-  double GetRadius() const { return radius_; }
+  T GetRadius() const { return radius_; }
 
 private:
-  Vector center_;
-  double radius_;
+  BasicVector<T> center_;
+  T radius_;
 };
+
+using Sphere = BasicSphere<double>;
+using FloatSphere = BasicSphere<float>;
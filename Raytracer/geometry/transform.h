@@ -0,0 +1,92 @@
+#pragma once
+
+#include "bounding_box.h"
+#include "vector.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+
+// Аффинное преобразование p -> A p + b. Матрица A хранится по строкам.
+class Transform {
+public:
+  // Матрица считается вырожденной, если |det| меньше этой доли
+  // произведения длин столбцов
+  static constexpr double kSingularRatio = 1e-12;
+
+  Transform()
+      : rows_{Vector(1., 0., 0.), Vector(0., 1., 0.), Vector(0., 0., 1.)} {}
+
+  Transform(const std::array<Vector, 3> &rows, const Vector &translation)
+      : rows_(rows), translation_(translation) {}
+
+  const std::array<Vector, 3> &GetRows() const { return rows_; }
+
+  const Vector &GetTranslation() const { return translation_; }
+
+  Vector ApplyToPoint(const Vector &point) const {
+    return ApplyToVector(point) + translation_;
+  }
+
+  Vector ApplyToVector(const Vector &vector) const {
+    return {DotProduct(rows_[0], vector), DotProduct(rows_[1], vector),
+            DotProduct(rows_[2], vector)};
+  }
+
+  // A^T v. Нормали переводятся транспонированной обратной матрицей, так что
+  // нормаль в мировые координаты переводит ApplyTransposed обратного
+  // преобразования.
+  Vector ApplyTransposed(const Vector &vector) const {
+    return vector[0] * rows_[0] + vector[1] * rows_[1] + vector[2] * rows_[2];
+  }
+
+  Transform Inverse() const {
+    // Строки обратной матрицы - векторные произведения столбцов исходной
+    std::array<Vector, 3> columns;
+    for (size_t i = 0; i < 3; ++i) {
+      columns[i] = {rows_[0][i], rows_[1][i], rows_[2][i]};
+    }
+    double determinant =
+        DotProduct(columns[0], CrossProduct(columns[1], columns[2]));
+    // |det| не больше произведения длин столбцов (неравенство Адамара), так
+    // что вырожденность проверяется относительно масштаба матрицы: мелкий,
+    // но равномерный масштаб обратим
+    double scale = columns[0].Length() * columns[1].Length() *
+                   columns[2].Length();
+    if (!(std::fabs(determinant) > kSingularRatio * scale)) {
+      throw std::invalid_argument{"Transform is not invertible"};
+    }
+
+    std::array<Vector, 3> inverse_rows = {
+        CrossProduct(columns[1], columns[2]) / determinant,
+        CrossProduct(columns[2], columns[0]) / determinant,
+        CrossProduct(columns[0], columns[1]) / determinant};
+    Transform inverse(inverse_rows, Vector());
+    inverse.translation_ = -inverse.ApplyToVector(translation_);
+    return inverse;
+  }
+
+  // Коробка, содержащая образ box (Arvo, Graphics Gems, 1990)
+  BoundingBox ApplyToBox(const BoundingBox &box) const {
+    if (box.IsEmpty()) {
+      return box;
+    }
+    Vector min = translation_;
+    Vector max = translation_;
+    for (size_t i = 0; i < 3; ++i) {
+      for (size_t j = 0; j < 3; ++j) {
+        double a = rows_[i][j] * box.GetMin()[j];
+        double b = rows_[i][j] * box.GetMax()[j];
+        min[i] += std::min(a, b);
+        max[i] += std::max(a, b);
+      }
+    }
+    return {min, max};
+  }
+
+private:
+  std::array<Vector, 3> rows_;
+  Vector translation_;
+};
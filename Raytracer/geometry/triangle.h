@@ -4,14 +4,16 @@
 
 #include <cstddef>
 
-class Triangle {
+template <class T>
+class BasicTriangle {
 public:
-  Triangle() = default;
+  BasicTriangle() = default;
 
-  Triangle(const Vector &a, const Vector &b, const Vector &c)
+  BasicTriangle(const BasicVector<T> &a, const BasicVector<T> &b,
+                const BasicVector<T> &c)
       : a_(a), b_(b), c_(c) {}
 
-  const Vector &operator[](size_t ind) const {
+  const BasicVector<T> &operator[](size_t ind) const {
     switch (ind) {
     case 0:
       return a_;
@@ -22,16 +24,19 @@ public:
     }
   }
 
-  double Area() const {
-    Vector ab = b_ - a_;
-    Vector ac = c_ - a_;
+  T Area() const {
+    BasicVector<T> ab = b_ - a_;
+    BasicVector<T> ac = c_ - a_;
 
-    Vector cross = CrossProduct(ab, ac);
-    return 0.5 * Length(cross);
+    BasicVector<T> cross = CrossProduct(ab, ac);
+    return T(0.5) * Length(cross);
   }
 
 private:
-  Vector a_;
-  Vector b_;
-  Vector c_;
+  BasicVector<T> a_;
+  BasicVector<T> b_;
+  BasicVector<T> c_;
 };
+
+using Triangle = BasicTriangle<double>;
+using FloatTriangle = BasicTriangle<float>;
@@ -3,28 +3,43 @@
 #include <array>
 #include <cmath>
 #include <cstddef>
-
-class Vector {
+#include <limits>
+#include <type_traits>
+
+// Геометрия параметризована типом скаляра: по умолчанию всё считается в
+// double, а для обхода сцены в одинарной точности есть варианты на float.
+// Скаляры в параметрах внешних функций берутся через std::type_identity_t,
+// чтобы тип выводился только из векторов и 2 * v работало как раньше.
+template <class T>
+class BasicVector {
 public:
-  Vector() : data_{0, 0, 0} {}
+  using Scalar = T;
+
+  BasicVector() : data_{0, 0, 0} {}
 
-  Vector(double x, double y, double z) : data_{x, y, z} {}
+  BasicVector(T x, T y, T z) : data_{x, y, z} {}
 
-  double &operator[](size_t ind) { return data_[ind]; }
+  // Перевод между точностями; при сужении до float значения округляются
+  template <class U>
+  explicit BasicVector(const BasicVector<U> &other)
+      : data_{static_cast<T>(other[0]), static_cast<T>(other[1]),
+              static_cast<T>(other[2])} {}
 
-  double operator[](size_t ind) const { return data_[ind]; }
+  T &operator[](size_t ind) { return data_[ind]; }
 
-  double Length() const {
+  T operator[](size_t ind) const { return data_[ind]; }
+
+  T Length() const {
     return std::sqrt(data_[0] * data_[0] + data_[1] * data_[1] +
                      data_[2] * data_[2]);
   }
 
-  double LengthSq() const {
+  T LengthSq() const {
     return data_[0] * data_[0] + data_[1] * data_[1] + data_[2] * data_[2];
   }
 
   void Normalize() {
-    double len = Length();
+    T len = Length();
     if (len != 0) {
       data_[0] /= len;
       data_[1] /= len;
@@ -32,36 +47,36 @@ public:
     }
   }
 
-  Vector Normalized() const {
-    double len = Length();
+  BasicVector Normalized() const {
+    T len = Length();
     if (len != 0) {
-      return Vector(data_[0] / len, data_[1] / len, data_[2] / len);
+      return BasicVector(data_[0] / len, data_[1] / len, data_[2] / len);
     }
     return *this;
   }
 
-  Vector &operator+=(const Vector &other) {
+  BasicVector &operator+=(const BasicVector &other) {
     data_[0] += other[0];
     data_[1] += other[1];
     data_[2] += other[2];
     return *this;
   }
 
-  Vector &operator-=(const Vector &other) {
+  BasicVector &operator-=(const BasicVector &other) {
     data_[0] -= other[0];
     data_[1] -= other[1];
     data_[2] -= other[2];
     return *this;
   }
 
-  Vector &operator*=(double d) {
+  BasicVector &operator*=(T d) {
     data_[0] *= d;
     data_[1] *= d;
     data_[2] *= d;
     return *this;
   }
 
-  Vector &operator/=(double d) {
+  BasicVector &operator/=(T d) {
     if (d != 0) {
       data_[0] /= d;
       data_[1] /= d;
@@ -70,68 +85,96 @@ public:
     return *this;
   }
 
-  Vector operator-() const { return Vector(-data_[0], -data_[1], -data_[2]); }
+  BasicVector operator-() const {
+    return BasicVector(-data_[0], -data_[1], -data_[2]);
+  }
 
 private:
-  std::array<double, 3> data_;
+  std::array<T, 3> data_;
 };
 
+using Vector = BasicVector<double>;
+using FloatVector = BasicVector<float>;
+
 // Внешние операторы и функции
-double DotProduct(const Vector &a, const Vector &b) {
+template <class T>
+T DotProduct(const BasicVector<T> &a, const BasicVector<T> &b) {
   return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
 }
 
-Vector CrossProduct(const Vector &a, const Vector &b) {
-  return Vector(a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2],
-                a[0] * b[1] - a[1] * b[0]);
+template <class T>
+BasicVector<T> CrossProduct(const BasicVector<T> &a, const BasicVector<T> &b) {
+  return BasicVector<T>(a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2],
+                        a[0] * b[1] - a[1] * b[0]);
 }
 
-double Length(const Vector &v) { return v.Length(); }
+template <class T>
+T Length(const BasicVector<T> &v) {
+  return v.Length();
+}
 
-Vector operator+(const Vector &lhs, const Vector &rhs) {
-  return Vector(lhs[0] + rhs[0], lhs[1] + rhs[1], lhs[2] + rhs[2]);
+template <class T>
+BasicVector<T> operator+(const BasicVector<T> &lhs, const BasicVector<T> &rhs) {
+  return BasicVector<T>(lhs[0] + rhs[0], lhs[1] + rhs[1], lhs[2] + rhs[2]);
 }
 
-Vector operator-(const Vector &lhs, const Vector &rhs) {
-  return Vector(lhs[0] - rhs[0], lhs[1] - rhs[1], lhs[2] - rhs[2]);
+template <class T>
+BasicVector<T> operator-(const BasicVector<T> &lhs, const BasicVector<T> &rhs) {
+  return BasicVector<T>(lhs[0] - rhs[0], lhs[1] - rhs[1], lhs[2] - rhs[2]);
 }
 
-Vector operator*(const Vector &lhs, double rhs) {
-  return Vector(lhs[0] * rhs, lhs[1] * rhs, lhs[2] * rhs);
+template <class T>
+BasicVector<T> operator*(const BasicVector<T> &lhs,
+                         std::type_identity_t<T> rhs) {
+  return BasicVector<T>(lhs[0] * rhs, lhs[1] * rhs, lhs[2] * rhs);
 }
 
-Vector operator*(double lhs, const Vector &rhs) {
-  return Vector(lhs * rhs[0], lhs * rhs[1], lhs * rhs[2]);
+template <class T>
+BasicVector<T> operator*(std::type_identity_t<T> lhs,
+                         const BasicVector<T> &rhs) {
+  return BasicVector<T>(lhs * rhs[0], lhs * rhs[1], lhs * rhs[2]);
 }
 
-Vector operator/(const Vector &lhs, double rhs) {
+template <class T>
+BasicVector<T> operator/(const BasicVector<T> &lhs,
+                         std::type_identity_t<T> rhs) {
   if (rhs != 0) {
-    return Vector(lhs[0] / rhs, lhs[1] / rhs, lhs[2] / rhs);
+    return BasicVector<T>(lhs[0] / rhs, lhs[1] / rhs, lhs[2] / rhs);
   }
   return lhs;
 }
 
-Vector operator+(const Vector &lhs, double rhs) {
-  return Vector(lhs[0] + rhs, lhs[1] + rhs, lhs[2] + rhs);
+template <class T>
+BasicVector<T> operator+(const BasicVector<T> &lhs,
+                         std::type_identity_t<T> rhs) {
+  return BasicVector<T>(lhs[0] + rhs, lhs[1] + rhs, lhs[2] + rhs);
 }
 
-Vector operator+(double lhs, const Vector &rhs) {
-  return Vector(lhs + rhs[0], lhs + rhs[1], lhs + rhs[2]);
+template <class T>
+BasicVector<T> operator+(std::type_identity_t<T> lhs,
+                         const BasicVector<T> &rhs) {
+  return BasicVector<T>(lhs + rhs[0], lhs + rhs[1], lhs + rhs[2]);
 }
 
-bool operator==(const Vector &lhs, const Vector &rhs) {
-  const double epsilon = std::numeric_limits<double>::epsilon();
+template <class T>
+bool operator==(const BasicVector<T> &lhs, const BasicVector<T> &rhs) {
+  const T epsilon = std::numeric_limits<T>::epsilon();
   return std::abs(lhs[0] - rhs[0]) < epsilon &&
          std::abs(lhs[1] - rhs[1]) < epsilon &&
          std::abs(lhs[2] - rhs[2]) < epsilon;
 }
 
-bool operator!=(const Vector &lhs, const Vector &rhs) { return !(lhs == rhs); }
+template <class T>
+bool operator!=(const BasicVector<T> &lhs, const BasicVector<T> &rhs) {
+  return !(lhs == rhs);
+}
 
-Vector operator*(const Vector &lhs, const Vector &rhs) {
-  return Vector(lhs[0] * rhs[0], lhs[1] * rhs[1], lhs[2] * rhs[2]);
+template <class T>
+BasicVector<T> operator*(const BasicVector<T> &lhs, const BasicVector<T> &rhs) {
+  return BasicVector<T>(lhs[0] * rhs[0], lhs[1] * rhs[1], lhs[2] * rhs[2]);
 }
 
-Vector operator/(const Vector &lhs, const Vector &rhs) {
-  return Vector(lhs[0] / rhs[0], lhs[1] / rhs[1], lhs[2] / rhs[2]);
+template <class T>
+BasicVector<T> operator/(const BasicVector<T> &lhs, const BasicVector<T> &rhs) {
+  return BasicVector<T>(lhs[0] / rhs[0], lhs[1] / rhs[1], lhs[2] / rhs[2]);
 }
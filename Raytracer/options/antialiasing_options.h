@@ -0,0 +1,22 @@
+#pragma once
+
+// kAdaptive: один отсчёт в центре пикселя, затем дополнительные отсчёты
+// только там, где пиксель заметно отличается от соседей или на границе
+// поверхностей. kSupersample: max_samples отсчётов в каждом пикселе.
+// Работает только в RenderMode::kFull.
+enum class AntialiasingMode { kNone, kAdaptive, kSupersample };
+
+struct AntialiasingOptions {
+    AntialiasingMode mode = AntialiasingMode::kNone;
+    // Отсчёты берутся в центрах ячеек сетки k x k внутри пикселя; число
+    // округляется вниз до квадрата степени двойки
+    int max_samples = 16;
+    // Отсчёты добавляются порциями, пока стандартная ошибка средней яркости
+    // не станет меньше error_threshold. Слишком маленькая порция может
+    // целиком промахнуться мимо тонкой детали и остановиться раньше времени.
+    int batch_samples = 8;
+    double error_threshold = 0.01;
+    // Разница цвета соседних пикселей после сжатия v / (1 + v), начиная
+    // с которой пиксель уточняется
+    double contrast_threshold = 0.02;
+};
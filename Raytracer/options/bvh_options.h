@@ -0,0 +1,32 @@
+#pragma once
+
+#include <cstddef>
+
+// kLbvh - линейное построение по кодам Мортона: быстрее и параллельно,
+// но дерево хуже, чем по SAH
+enum class BvhSplitMethod { kMedian, kSah, kLbvh };
+
+// Как искать пересечения со сферами: kAuto выбирает равномерную сетку
+// (SphereGrid) для сцен почти из одних сфер близкого размера, иначе сферы
+// входят в BVH вместе с остальными примитивами
+enum class SphereAccelerator { kAuto, kBvh, kGrid };
+
+struct BvhOptions {
+    BvhSplitMethod split_method = BvhSplitMethod::kSah;
+    size_t max_leaf_size = 4;
+    size_t bin_count = 16;
+    double traversal_cost = 1.0;
+    double intersection_cost = 1.0;
+    // Потоки для kLbvh, 0 - по числу ядер; на само дерево не влияет
+    size_t threads = 0;
+    // После подгонки коробок под сдвинутые вершины (Bvh::Refit) дерево
+    // строится заново, если его SAH-стоимость выросла больше чем во
+    // столько раз по сравнению с только что построенным
+    double max_refit_cost_ratio = 1.5;
+    // PreparedScene переводит общее BVH в сжатые узлы (Bvh::Compress):
+    // в несколько раз меньше памяти на узлы, но пучки лучей не используются
+    bool compressed_nodes = false;
+    SphereAccelerator sphere_accelerator = SphereAccelerator::kAuto;
+
+    bool operator==(const BvhOptions&) const = default;
+};
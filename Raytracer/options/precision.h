@@ -0,0 +1,5 @@
+#pragma once
+
+// Точность, в которой хранится геометрия для обхода сцены и считаются
+// пересечения лучей. Затенение всегда считается в double.
+enum class Precision { kDouble, kFloat };
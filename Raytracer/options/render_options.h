@@ -1,8 +1,34 @@
 #pragma once
 
+#include "antialiasing_options.h"
+#include "bvh_options.h"
+#include "precision.h"
+#include "scene_cache_options.h"
+#include "../utils/render_stats.h"
+
+#include <cstddef>
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    AntialiasingOptions antialiasing = {};
+    // Первичные лучи блоков 4x4 и теневые лучи из их точек попадания
+    // трассируются пучками; картинка от этого не меняется
+    bool ray_packets = true;
+    // Обход сцены и пересечения во float: геометрия для обхода занимает
+    // вдвое меньше памяти, а в SIMD-регистр помещается вдвое больше
+    // треугольников. Картинка может немного отличаться от рендеринга в
+    // double; пучки лучей в этом режиме не используются.
+    Precision precision = Precision::kDouble;
+    BvhOptions bvh = {};
+    SceneCacheOptions cache = {};
+    // 0 - по числу аппаратных потоков
+    size_t threads = 0;
+    // Если задано, сюда записываются счётчики лучей и пересечений
+    RenderStats* stats = nullptr;
+    // Отражённые и преломлённые лучи, вклад которых в пиксель меньше этой
+    // доли, не трассируются; 0 - трассировать все лучи до depth
+    double min_ray_weight = 1e-3;
 };
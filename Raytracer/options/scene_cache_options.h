@@ -0,0 +1,13 @@
+#pragma once
+
+enum class SceneCacheMode { kDisabled, kReadOnly, kReadWrite };
+
+// Двоичный кэш разобранной сцены лежит рядом с .obj (scene.obj.rtcache)
+// и используется, пока не изменились .obj и подключённые .mtl. По
+// умолчанию кэш только читается: файлы рядом со сценой пишутся лишь при
+// kReadWrite
+struct SceneCacheOptions {
+    SceneCacheMode mode = SceneCacheMode::kReadOnly;
+    // Сохранять ли построенное BVH; при других BvhOptions оно строится заново
+    bool store_bvh = true;
+};
@@ -1,57 +1,38 @@
 #pragma once
 
+#include "accel/triangle_kernels.h"
+#include "geometry/camera.h"
 #include "geometry/geometry.h"
 #include "geometry/intersection.h"
 #include "geometry/ray.h"
 #include "geometry/vector.h"
+#include "utils/cancellation_token.h"
+#include "utils/framebuffer.h"
+#include "utils/gamma_table.h"
 #include "utils/image.h"
+#include "utils/render_stats.h"
 #include "options/camera_options.h"
 #include "options/render_options.h"
 #include "reader/object.h"
+#include "reader/prepared_scene.h"
 #include "reader/scene.h"
+#include "reader/scene_cache.h"
+#include "utils/thread_pool.h"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
 #include <filesystem>
-
-Ray CameraRay(const CameraOptions &camera_options, int x, int y) {
-  const double epsilon = 1e-6;
-
-  double aspect_ratio = camera_options.screen_width /
-                        static_cast<double>(camera_options.screen_height);
-  double scale = std::tan(camera_options.fov * 0.5);
-
-  double camera_x = (2.0 * (x + 0.5) / camera_options.screen_width - 1) *
-                    aspect_ratio * scale;
-  double camera_y =
-      (1 - 2.0 * (y + 0.5) / camera_options.screen_height) * scale;
-
-  Vector ray_dir_camera(camera_x, camera_y, -1.0);
-  ray_dir_camera.Normalize();
-
-  Vector forward = camera_options.look_from - camera_options.look_to;
-  forward.Normalize();
-
-  Vector world_up(0.0, 1.0, 0.0);
-  if (DotProduct(world_up, forward) > 1.0 - epsilon) {
-    world_up = Vector{0.0, 0.0, -1.0};
-  } else if (DotProduct(world_up, forward) < -1.0 + epsilon) {
-    world_up = Vector{0.0, 0.0, +1.0};
-  }
-
-  Vector right = CrossProduct(world_up, forward);
-  right.Normalize();
-
-  Vector up = CrossProduct(forward, right);
-
-  Vector ray_dir_world(
-      ray_dir_camera[0] * right[0] + ray_dir_camera[1] * up[0] +
-          ray_dir_camera[2] * forward[0],
-      ray_dir_camera[0] * right[1] + ray_dir_camera[1] * up[1] +
-          ray_dir_camera[2] * forward[1],
-      ray_dir_camera[0] * right[2] + ray_dir_camera[1] * up[2] +
-          ray_dir_camera[2] * forward[2]);
-  ray_dir_world.Normalize();
-
-  return Ray(camera_options.look_from, ray_dir_world);
+#include <functional>
+#include <stdexcept>
+#include <vector>
+
+// Луч через точку (x + dx, y + dy) экрана. Базис камеры считается заново
+// на каждый вызов; при рендеринге кадра используется Camera.
+Ray CameraRay(const CameraOptions &camera_options, int x, int y,
+              double dx = 0.5, double dy = 0.5) {
+  return Camera(camera_options).GetRay(x, y, dx, dy);
 }
 
 struct FullIntersection {
@@ -70,66 +51,363 @@ struct FullIntersection {
   Vector GetNormal() const { return normal; }
 };
 
-std::optional<FullIntersection> ClosestIntersection(const Scene &scene,
-                                                    const Ray &ray) {
-  std::optional<FullIntersection> closest_intersection = std::nullopt;
-  double min_distance = std::numeric_limits<double>::max();
-
-  for (const Object &obj : scene.GetObjects()) {
-    auto intersection = GetIntersection(ray, obj.polygon);
-    if (intersection.has_value()) {
-      Vector position = intersection->GetPosition();
-      double distance = intersection->GetDistance();
-      Vector geom_normal = intersection->GetNormal();
-
-      bool is_inside = false;
-      Vector normal = geom_normal;
-      if (DotProduct(ray.GetDirection(), normal) > 0.0) {
-        normal = -normal;
-      }
+size_t CountLeafTriangles(std::span<const BvhPrimitive> primitives) {
+  size_t count = 0;
+  while (count < primitives.size() &&
+         primitives[count].kind == PrimitiveKind::kTriangle) {
+    ++count;
+  }
+  return count;
+}
 
-      if (obj.normals.size() == 3) {
-        Vector bary = GetBarycentricCoords(obj.polygon, position);
-        Vector ni = bary[0] * obj.normals[0] + bary[1] * obj.normals[1] +
-                    bary[2] * obj.normals[2];
-        ni.Normalize();
+// Ближайшее попадание до подсчёта нормали: при обходе кандидаты только
+// сравниваются по расстоянию, а нормаль и материал нужны лишь победителю
+struct ClosestHit {
+  PrimitiveKind kind;
+  uint32_t index;
+  TriangleHit hit;
+  // Треугольник меша, если kind - экземпляр
+  uint32_t triangle = 0;
+};
 
-        if (DotProduct(ray.GetDirection(), ni) > 0.0) {
-          ni = -ni;
-        }
-        normal = ni;
-      }
+// normal_to_world переводит нормали треугольников хранилища в мировые
+// координаты и нормирует их
+template <class T, class NormalToWorld>
+FullIntersection
+ResolveStoredTriangleHit(const Scene &scene,
+                         const BasicTriangleStore<T> &triangles, const Ray &ray,
+                         uint32_t index, const TriangleHit &hit,
+                         NormalToWorld &&normal_to_world) {
+  double distance = hit.distance;
+  Vector position = ray.GetOrigin() + distance * ray.GetDirection();
+
+  bool is_inside = false;
+  Vector normal = normal_to_world(triangles.GetGeometricNormal(index));
+  if (DotProduct(ray.GetDirection(), normal) > 0.0) {
+    normal = -normal;
+  }
 
-      if (distance < min_distance) {
-        min_distance = distance;
-        closest_intersection = FullIntersection(position, normal, distance,
-                                                is_inside, obj.material);
-      }
+  if (triangles.HasNormals(index)) {
+    // Барицентрические координаты берём из Мёллера-Трумбора
+    const auto &normals = scene.GetNormals();
+    auto normal_indices = triangles.GetNormalIndices(index);
+    Vector ni = (1.0 - hit.u - hit.v) * normals[normal_indices[0]] +
+                hit.u * normals[normal_indices[1]] +
+                hit.v * normals[normal_indices[2]];
+    ni.Normalize();
+    ni = normal_to_world(ni);
+
+    if (DotProduct(ray.GetDirection(), ni) > 0.0) {
+      ni = -ni;
     }
+    normal = ni;
   }
 
-  for (const SphereObject &sphere_obj : scene.GetSphereObjects()) {
-    auto intersection = GetIntersection(ray, sphere_obj.sphere);
-    if (intersection.has_value()) {
-      Vector position = intersection->GetPosition();
-      Vector normal = intersection->GetNormal();
-      double distance = intersection->GetDistance();
+  return FullIntersection(position, normal, distance, is_inside,
+                          triangles.GetMaterial(index));
+}
 
-      bool is_inside = false;
-      if (DotProduct(ray.GetDirection(), normal) > 0) {
-        is_inside = true;
-        normal = -normal;
-      }
+template <class T = double>
+FullIntersection ResolveTriangleHit(const Scene &scene, const Ray &ray,
+                                    uint32_t index, const TriangleHit &hit) {
+  return ResolveStoredTriangleHit(scene, scene.GetTriangleStore<T>(), ray,
+                                  index, hit,
+                                  [](const Vector &normal) { return normal; });
+}
 
-      if (distance < min_distance) {
-        min_distance = distance;
-        closest_intersection = FullIntersection(position, normal, distance,
-                                                is_inside, sphere_obj.material);
-      }
+// hit.distance - расстояние в мировых координатах
+FullIntersection ResolveInstanceHit(const Scene &scene, const Ray &ray,
+                                    uint32_t index, uint32_t triangle,
+                                    const TriangleHit &hit) {
+  const Instance &instance = scene.GetInstances()[index];
+  const Mesh &mesh = scene.GetMeshes()[instance.mesh];
+  return ResolveStoredTriangleHit(
+      scene, mesh.triangles, ray, triangle, hit, [&](const Vector &normal) {
+        return instance.NormalToWorld(normal).Normalized();
+      });
+}
+
+FullIntersection ResolveSphereHit(const Scene &scene, const Ray &ray,
+                                  uint32_t index, double distance) {
+  const SphereObject &sphere_obj = scene.GetSphereObjects()[index];
+
+  Vector position = ray.GetOrigin() + distance * ray.GetDirection();
+  Vector normal = position - sphere_obj.sphere.GetCenter();
+  normal.Normalize();
+
+  bool is_inside = false;
+  if (DotProduct(ray.GetDirection(), normal) > 0) {
+    is_inside = true;
+    normal = -normal;
+  }
+
+  return FullIntersection(position, normal, distance, is_inside,
+                          sphere_obj.material);
+}
+
+// Ближайшее попадание в меш экземпляра ближе max_distance. Луч
+// переводится в координаты меша, и его BVH обходится в double.
+template <class Counters>
+std::optional<ClosestHit> IntersectInstance(const Scene &scene, const Ray &ray,
+                                            uint32_t index, double max_distance,
+                                            Counters &counters) {
+  const Instance &instance = scene.GetInstances()[index];
+  const Mesh &mesh = scene.GetMeshes()[instance.mesh];
+  InstanceRay local = ToInstanceSpace(instance, ray);
+
+  std::optional<ClosestHit> closest_hit = std::nullopt;
+  double t_max = max_distance * local.scale;
+  mesh.bvh.Traverse(
+      local.ray, t_max,
+      [&](std::span<const BvhPrimitive> primitives, double &) {
+        counters.CountTriangleTests(primitives.size());
+        TriangleBatchHit batch_hit;
+        if (IntersectTriangles(mesh.triangles, primitives[0].index,
+                               primitives.size(), local.ray, t_max,
+                               &batch_hit)) {
+          t_max = batch_hit.hit.distance;
+          closest_hit = {PrimitiveKind::kInstance, index, batch_hit.hit,
+                         batch_hit.index};
+        }
+      },
+      [&] { counters.CountNodeVisit(); });
+
+  if (closest_hit.has_value()) {
+    closest_hit->hit.distance /= local.scale;
+  }
+  return closest_hit;
+}
+
+template <class Counters>
+bool IsInstanceOccluding(const Scene &scene, const Ray &ray, uint32_t index,
+                         double max_distance, Counters &counters) {
+  const Instance &instance = scene.GetInstances()[index];
+  const Mesh &mesh = scene.GetMeshes()[instance.mesh];
+  InstanceRay local = ToInstanceSpace(instance, ray);
+
+  return mesh.bvh.TraverseAny(
+      local.ray, max_distance * local.scale,
+      [&](std::span<const BvhPrimitive> primitives, double t_max) {
+        counters.CountTriangleTests(primitives.size());
+        TriangleBatchHit batch_hit;
+        return IntersectTriangles(mesh.triangles, primitives[0].index,
+                                  primitives.size(), local.ray, t_max,
+                                  &batch_hit);
+      },
+      [&] { counters.CountNodeVisit(); });
+}
+
+// Попадание в сферу или экземпляр меша ближе max_distance
+template <class Counters>
+std::optional<ClosestHit>
+IntersectNonTriangle(const Scene &scene, const Ray &ray,
+                     const BvhPrimitive &primitive, double max_distance,
+                     Counters &counters) {
+  if (primitive.kind == PrimitiveKind::kInstance) {
+    return IntersectInstance(scene, ray, primitive.index, max_distance,
+                             counters);
+  }
+  const Sphere &sphere = scene.GetSphereObjects()[primitive.index].sphere;
+  counters.CountSphereTest();
+  auto distance = GetIntersectionDistance(ray, sphere);
+  if (distance.has_value() && *distance < max_distance) {
+    return ClosestHit{PrimitiveKind::kSphere, primitive.index,
+                      {*distance, 0.0, 0.0}};
+  }
+  return std::nullopt;
+}
+
+template <class Counters>
+bool IsNonTriangleOccluding(const Scene &scene, const Ray &ray,
+                            const BvhPrimitive &primitive, double max_distance,
+                            Counters &counters) {
+  if (primitive.kind == PrimitiveKind::kInstance) {
+    return IsInstanceOccluding(scene, ray, primitive.index, max_distance,
+                               counters);
+  }
+  const Sphere &sphere = scene.GetSphereObjects()[primitive.index].sphere;
+  counters.CountSphereTest();
+  auto distance = GetIntersectionDistance(ray, sphere);
+  return distance.has_value() && *distance < max_distance;
+}
+
+// Ближайшее попадание в сферы сетки ближе max_distance
+template <class Counters>
+std::optional<ClosestHit> IntersectSphereGrid(const Scene &scene,
+                                              const Ray &ray,
+                                              double max_distance,
+                                              Counters &counters) {
+  std::optional<ClosestHit> closest_hit = std::nullopt;
+  scene.GetSphereGrid().Traverse(
+      ray, max_distance,
+      [&](std::span<const uint32_t> spheres, double &t_max) {
+        for (uint32_t index : spheres) {
+          counters.CountSphereTest();
+          auto distance = GetIntersectionDistance(
+              ray, scene.GetSphereObjects()[index].sphere);
+          if (distance.has_value() && *distance < t_max) {
+            t_max = *distance;
+            closest_hit = ClosestHit{PrimitiveKind::kSphere, index,
+                                     {*distance, 0.0, 0.0}};
+          }
+        }
+      });
+  return closest_hit;
+}
+
+template <class Counters>
+bool IsSphereGridOccluding(const Scene &scene, const Ray &ray,
+                           double max_distance, Counters &counters) {
+  return scene.GetSphereGrid().TraverseAny(
+      ray, max_distance,
+      [&](std::span<const uint32_t> spheres, double t_max) {
+        for (uint32_t index : spheres) {
+          counters.CountSphereTest();
+          auto distance = GetIntersectionDistance(
+              ray, scene.GetSphereObjects()[index].sphere);
+          if (distance.has_value() && *distance < t_max) {
+            return true;
+          }
+        }
+        return false;
+      });
+}
+
+template <class T = double>
+FullIntersection ResolveClosestHit(const Scene &scene, const Ray &ray,
+                                   const ClosestHit &closest_hit) {
+  switch (closest_hit.kind) {
+  case PrimitiveKind::kTriangle:
+    return ResolveTriangleHit<T>(scene, ray, closest_hit.index,
+                                 closest_hit.hit);
+  case PrimitiveKind::kSphere:
+    return ResolveSphereHit(scene, ray, closest_hit.index,
+                            closest_hit.hit.distance);
+  default:
+    return ResolveInstanceHit(scene, ray, closest_hit.index,
+                              closest_hit.triangle, closest_hit.hit);
+  }
+}
+
+// Обход и пересечения с треугольниками считаются в T; сферы, которых в
+// сценах немного, и меши экземпляров всегда проверяются в double
+template <class T, class Counters>
+std::optional<FullIntersection> ClosestIntersectionIn(const Scene &scene,
+                                                      const Ray &ray,
+                                                      Counters &counters) {
+  std::optional<ClosestHit> closest_hit = std::nullopt;
+  T min_distance = std::numeric_limits<T>::max();
+
+  const BasicTriangleStore<T> &triangles = scene.GetTriangleStore<T>();
+  BasicRay<T> traversal_ray(ray);
+
+  scene.GetBvh().Traverse(
+      traversal_ray, min_distance,
+      [&](std::span<const BvhPrimitive> primitives, T &) {
+        size_t triangle_count = CountLeafTriangles(primitives);
+        counters.CountTriangleTests(triangle_count);
+        TriangleBatchHit batch_hit;
+        if (triangle_count > 0 &&
+            IntersectTriangles(triangles, primitives[0].index, triangle_count,
+                               traversal_ray, min_distance, &batch_hit)) {
+          min_distance = batch_hit.hit.distance;
+          closest_hit = {PrimitiveKind::kTriangle, batch_hit.index,
+                         batch_hit.hit};
+        }
+        for (const BvhPrimitive &primitive :
+             primitives.subspan(triangle_count)) {
+          auto hit = IntersectNonTriangle(scene, ray, primitive, min_distance,
+                                          counters);
+          if (hit.has_value()) {
+            min_distance = static_cast<T>(hit->hit.distance);
+            closest_hit = hit;
+          }
+        }
+      },
+      [&] { counters.CountNodeVisit(); });
+
+  if (!scene.GetSphereGrid().IsEmpty()) {
+    auto sphere_hit = IntersectSphereGrid(
+        scene, ray,
+        closest_hit.has_value() ? closest_hit->hit.distance
+                                : std::numeric_limits<double>::max(),
+        counters);
+    if (sphere_hit.has_value()) {
+      closest_hit = sphere_hit;
     }
   }
 
-  return closest_intersection;
+  if (!closest_hit.has_value()) {
+    return std::nullopt;
+  }
+  counters.CountHit();
+  return ResolveClosestHit<T>(scene, ray, *closest_hit);
+}
+
+template <class Counters>
+std::optional<FullIntersection>
+ClosestIntersection(const Scene &scene, const Ray &ray, Counters &counters) {
+  if (scene.GetPrecision() == Precision::kFloat) {
+    return ClosestIntersectionIn<float>(scene, ray, counters);
+  }
+  return ClosestIntersectionIn<double>(scene, ray, counters);
+}
+
+std::optional<FullIntersection> ClosestIntersection(const Scene &scene,
+                                                    const Ray &ray) {
+  NoRayCounters counters;
+  return ClosestIntersection(scene, ray, counters);
+}
+
+template <class T, class Counters>
+bool IsOccludedIn(const Scene &scene, const Ray &ray, double max_distance,
+                  Counters &counters) {
+  const BasicTriangleStore<T> &triangles = scene.GetTriangleStore<T>();
+  BasicRay<T> traversal_ray(ray);
+
+  bool occluded = scene.GetBvh().TraverseAny(
+      traversal_ray, static_cast<T>(max_distance),
+      [&](std::span<const BvhPrimitive> primitives, T t_max) {
+        size_t triangle_count = CountLeafTriangles(primitives);
+        counters.CountTriangleTests(triangle_count);
+        TriangleBatchHit batch_hit;
+        if (triangle_count > 0 &&
+            IntersectTriangles(triangles, primitives[0].index, triangle_count,
+                               traversal_ray, t_max, &batch_hit)) {
+          return true;
+        }
+        for (const BvhPrimitive &primitive :
+             primitives.subspan(triangle_count)) {
+          if (IsNonTriangleOccluding(scene, ray, primitive, t_max, counters)) {
+            return true;
+          }
+        }
+        return false;
+      },
+      [&] { counters.CountNodeVisit(); });
+  return occluded || IsSphereGridOccluding(scene, ray, max_distance, counters);
+}
+
+// Есть ли на луче препятствие ближе max_distance. Ищет любое попадание,
+// а не ближайшее, и не считает нормали и материалы.
+template <class Counters>
+bool IsOccluded(const Scene &scene, const Ray &ray, double max_distance,
+                Counters &counters) {
+  counters.CountRay(RayKind::kShadow, 0);
+  bool occluded =
+      scene.GetPrecision() == Precision::kFloat
+          ? IsOccludedIn<float>(scene, ray, max_distance, counters)
+          : IsOccludedIn<double>(scene, ray, max_distance, counters);
+
+  if (occluded) {
+    counters.CountOccluded();
+  }
+  return occluded;
+}
+
+bool IsOccluded(const Scene &scene, const Ray &ray, double max_distance) {
+  NoRayCounters counters;
+  return IsOccluded(scene, ray, max_distance, counters);
 }
 
 Vector OffsetPoint(const Vector &p, const Vector &n, const Vector &dir) {
@@ -137,80 +415,418 @@ Vector OffsetPoint(const Vector &p, const Vector &n, const Vector &dir) {
   return p + n * (DotProduct(dir, n) > 0.0 ? epsilon : -epsilon);
 }
 
-Vector TraceRay(const Scene &scene, const Ray &ray, int depth) {
+// Луч, который ещё предстоит проследить, и его вес - доля, с которой его
+// цвет входит в цвет пикселя
+struct PendingRay {
+  Ray ray;
+  double weight;
+  int depth;
+  RayKind kind;
+};
+
+// Теневой луч из точки попадания к источнику и расстояние, ближе которого
+// препятствие закрывает источник
+struct ShadowRay {
+  Ray ray;
+  double max_distance;
+  // Направление на источник до нормировки в конструкторе Ray; по нему
+  // считается освещённость
+  Vector light_dir;
+};
+
+ShadowRay MakeShadowRay(const FullIntersection &intersection,
+                        const Light &light) {
   const double epsilon = 1e-4;
 
-  if (depth <= 0) {
-    return Vector(0.0, 0.0, 0.0);
-  }
+  Vector light_dir = light.position - intersection.position;
+  double light_distance = light_dir.Length();
+  light_dir.Normalize();
 
-  auto intersection = ClosestIntersection(scene, ray);
-  if (!intersection.has_value()) {
-    return Vector(0.0, 0.0, 0.0);
-  }
+  return {Ray(OffsetPoint(intersection.position, intersection.normal,
+                          light_dir),
+              light_dir),
+          light_distance - epsilon, light_dir};
+}
 
-  Vector point = intersection->position;
-  Vector normal = intersection->normal;
-  bool is_inside = intersection->is_inside;
-  const Material *material = intersection->material;
+// Прямое освещение в точке попадания без учёта отражённых и преломлённых
+// лучей. is_lit(light_index, shadow_ray) решает, виден ли источник.
+template <class LightVisibility>
+Vector ShadePoint(const Scene &scene, const Ray &ray,
+                  const FullIntersection &intersection,
+                  LightVisibility &&is_lit) {
+  const Material &material = *intersection.material;
+  Vector normal = intersection.normal;
 
-  Vector color = material->ambient_color + material->intensity;
+  Vector color = material.ambient_color + material.intensity;
   Vector total_diffuse(0.0, 0.0, 0.0);
   Vector total_specular(0.0, 0.0, 0.0);
 
-  for (const Light &light : scene.GetLights()) {
-    Vector light_dir = light.position - point;
-    double light_distance = light_dir.Length();
-    light_dir.Normalize();
-
-    Ray shadow_ray(OffsetPoint(point, normal, light_dir), light_dir);
-    auto shadow_hit = ClosestIntersection(scene, shadow_ray);
-    if (shadow_hit.has_value() &&
-        shadow_hit->distance < light_distance - epsilon) {
+  const auto &lights = scene.GetLights();
+  for (size_t light_index = 0; light_index < lights.size(); ++light_index) {
+    const Light &light = lights[light_index];
+    ShadowRay shadow_ray = MakeShadowRay(intersection, light);
+    if (!is_lit(light_index, shadow_ray)) {
       continue;
     }
+    const Vector &light_dir = shadow_ray.light_dir;
 
     double diff = std::max(0.0, DotProduct(light_dir, normal));
-    total_diffuse += material->diffuse_color * diff * light.intensity;
+    total_diffuse += material.diffuse_color * diff * light.intensity;
 
     Vector view_dir = (-ray.GetDirection()).Normalized();
     Vector reflect_dir = Reflect(-light_dir, normal).Normalized();
     double spec_base = std::max(0.0, DotProduct(view_dir, reflect_dir));
-    double spec = (material->specular_exponent > 0.0)
-                      ? std::pow(spec_base, material->specular_exponent)
+    double spec = (material.specular_exponent > 0.0)
+                      ? std::pow(spec_base, material.specular_exponent)
                       : 0.0;
-    total_specular += material->specular_color * spec * light.intensity;
+    total_specular += material.specular_color * spec * light.intensity;
   }
 
-  color += material->albedo[0] * (total_diffuse + total_specular);
+  color += material.albedo[0] * (total_diffuse + total_specular);
+  return color;
+}
+
+// Каждый теневой луч проверяется отдельным обходом BVH
+template <class Counters>
+Vector ShadePoint(const Scene &scene, const Ray &ray,
+                  const FullIntersection &intersection, Counters &counters) {
+  return ShadePoint(scene, ray, intersection,
+                    [&](size_t, const ShadowRay &shadow_ray) {
+                      return !IsOccluded(scene, shadow_ray.ray,
+                                         shadow_ray.max_distance, counters);
+                    });
+}
+
+// Поверхность, в которую попал первичный луч. По ней ищутся границы
+// объектов при сглаживании.
+struct PrimaryHit {
+  const Material *material = nullptr;
+  Vector normal;
+  double distance = std::numeric_limits<double>::infinity();
+};
+
+// Отражённый и преломлённый лучи из точки попадания луча current. Лучи с
+// весом меньше min_weight не создаются.
+struct SecondaryRays {
+  std::optional<PendingRay> reflected;
+  std::optional<PendingRay> refracted;
+};
 
-  if (material->albedo[1] > 0.0 && !is_inside) {
-    Vector reflect_dir = Reflect(ray.GetDirection(), normal).Normalized();
-    Ray reflect_ray(OffsetPoint(point, normal, reflect_dir), reflect_dir);
-    Vector reflect_color = TraceRay(scene, reflect_ray, depth - 1);
-    color += material->albedo[1] * reflect_color;
+SecondaryRays GetSecondaryRays(const PendingRay &current,
+                               const FullIntersection &intersection,
+                               double min_weight) {
+  const Material &material = *intersection.material;
+  const Vector &point = intersection.position;
+  const Vector &normal = intersection.normal;
+  bool is_inside = intersection.is_inside;
+
+  std::optional<PendingRay> reflected;
+  if (material.albedo[1] > 0.0 && !is_inside) {
+    Vector reflect_dir =
+        Reflect(current.ray.GetDirection(), normal).Normalized();
+    reflected = {Ray(OffsetPoint(point, normal, reflect_dir), reflect_dir),
+                 current.weight * material.albedo[1], current.depth - 1,
+                 RayKind::kReflection};
   }
 
-  if (material->albedo[2] > 0.0) {
-    double eta = is_inside ? material->refraction_index
-                           : (1.0 / material->refraction_index);
+  std::optional<PendingRay> refracted;
+  if (material.albedo[2] > 0.0) {
+    double eta = is_inside ? material.refraction_index
+                           : (1.0 / material.refraction_index);
 
-    auto refract_dir_opt = Refract(ray.GetDirection(), normal, eta);
+    auto refract_dir_opt = Refract(current.ray.GetDirection(), normal, eta);
     if (refract_dir_opt.has_value()) {
       Vector refract_dir = refract_dir_opt->Normalized();
-      Ray refract_ray(OffsetPoint(point, normal, refract_dir), refract_dir);
-      Vector refract_color = TraceRay(scene, refract_ray, depth - 1);
+      double tr = is_inside ? 1.0 : material.albedo[2];
+      refracted = {Ray(OffsetPoint(point, normal, refract_dir), refract_dir),
+                   current.weight * tr, current.depth - 1,
+                   RayKind::kRefraction};
+    }
+  }
+
+  if (refracted && refracted->weight < min_weight) {
+    refracted.reset();
+  }
+  if (reflected && reflected->weight < min_weight) {
+    reflected.reset();
+  }
+  return {reflected, refracted};
+}
 
-      double tr = is_inside ? 1.0 : material->albedo[2];
-      color += tr * refract_color;
+// Обходит дерево отражённых и преломлённых лучей без рекурсии: один потомок
+// трассируется сразу, второй откладывается в stack. Начинает с лучей,
+// которые уже лежат в stack, и прибавляет их вклад к color. depth - глубина
+// первичного луча, по ней считается номер отскока. Если primary_hit задан,
+// туда записывается попадание первичного луча.
+template <class Counters>
+Vector TraceStack(const Scene &scene, int depth, double min_weight,
+                  std::vector<PendingRay> &stack, Counters &counters,
+                  Vector color = {}, PrimaryHit *primary_hit = nullptr) {
+  while (!stack.empty()) {
+    PendingRay current = stack.back();
+    stack.pop_back();
+
+    while (current.depth > 0) {
+      counters.CountRay(current.kind, depth - current.depth);
+      auto intersection = ClosestIntersection(scene, current.ray, counters);
+      if (!intersection.has_value()) {
+        break;
+      }
+      if (primary_hit && current.kind == RayKind::kPrimary) {
+        *primary_hit = {intersection->material, intersection->normal,
+                        intersection->distance};
+      }
+
+      color += current.weight *
+               ShadePoint(scene, current.ray, *intersection, counters);
+
+      auto [reflected, refracted] =
+          GetSecondaryRays(current, *intersection, min_weight);
+      if (reflected && refracted) {
+        stack.push_back(*refracted);
+        current = *reflected;
+      } else if (reflected || refracted) {
+        current = reflected ? *reflected : *refracted;
+      } else {
+        break;
+      }
     }
   }
 
   return color;
 }
 
-Vector PixelColorDepth(const Scene &scene, const Ray &ray, double &max_depth) {
-  auto closest_intersection = ClosestIntersection(scene, ray);
+// Цвет луча вместе с отражениями и преломлениями. Лучи с весом меньше
+// min_weight отбрасываются. stack передаётся снаружи, чтобы не выделять
+// память на каждый пиксель.
+template <class Counters>
+Vector TraceRay(const Scene &scene, const Ray &ray, int depth,
+                double min_weight, std::vector<PendingRay> &stack,
+                Counters &counters, PrimaryHit *primary_hit = nullptr) {
+  stack.clear();
+  stack.push_back({ray, 1.0, depth, RayKind::kPrimary});
+  return TraceStack(scene, depth, min_weight, stack, counters, Vector(),
+                    primary_hit);
+}
+
+Vector TraceRay(const Scene &scene, const Ray &ray, int depth,
+                double min_weight = 0.0) {
+  std::vector<PendingRay> stack;
+  NoRayCounters counters;
+  return TraceRay(scene, ray, depth, min_weight, stack, counters);
+}
+
+// Ближайшие попадания лучей пучка; для каждого луча то же, что даёт
+// ClosestIntersection
+template <class Counters>
+std::array<std::optional<FullIntersection>, PacketRays::kMaxSize>
+ClosestPacketIntersections(const Scene &scene, PacketRays &rays,
+                           Counters &counters) {
+  const TriangleStore &triangles = scene.GetTriangles();
+
+  PacketTriangleHits triangle_hits;
+  // Попадания лучей не в треугольники общего дерева
+  std::array<std::optional<ClosestHit>, PacketRays::kMaxSize> other_hits;
+  uint32_t found = 0;
+
+  scene.GetBvh().TraversePacket(
+      rays, rays.AllLanes(),
+      [&](std::span<const BvhPrimitive> primitives, uint32_t lanes) {
+        size_t triangle_count = CountLeafTriangles(primitives);
+        counters.CountTriangleTests(triangle_count * std::popcount(lanes));
+        if (triangle_count > 0) {
+          uint32_t closer =
+              IntersectTrianglesPacket(triangles, primitives[0].index,
+                                       triangle_count, rays, lanes,
+                                       &triangle_hits);
+          for (uint32_t bits = closer; bits != 0; bits &= bits - 1) {
+            other_hits[std::countr_zero(bits)] = std::nullopt;
+          }
+          found |= closer;
+        }
+        for (const BvhPrimitive &primitive :
+             primitives.subspan(triangle_count)) {
+          for (uint32_t bits = lanes; bits != 0; bits &= bits - 1) {
+            size_t lane = std::countr_zero(bits);
+            auto hit = IntersectNonTriangle(scene, rays.rays[lane], primitive,
+                                            rays.t_max[lane], counters);
+            if (hit.has_value()) {
+              rays.t_max[lane] = hit->hit.distance;
+              other_hits[lane] = hit;
+              found |= uint32_t{1} << lane;
+            }
+          }
+        }
+      },
+      [&] { counters.CountNodeVisit(); });
+
+  for (size_t lane = 0; lane < rays.size && !scene.GetSphereGrid().IsEmpty();
+       ++lane) {
+    auto hit = IntersectSphereGrid(scene, rays.rays[lane], rays.t_max[lane],
+                                   counters);
+    if (hit.has_value()) {
+      rays.t_max[lane] = hit->hit.distance;
+      other_hits[lane] = hit;
+      found |= uint32_t{1} << lane;
+    }
+  }
+
+  std::array<std::optional<FullIntersection>, PacketRays::kMaxSize> result;
+  for (uint32_t bits = found; bits != 0; bits &= bits - 1) {
+    size_t lane = std::countr_zero(bits);
+    counters.CountHit();
+    if (other_hits[lane].has_value()) {
+      result[lane] =
+          ResolveClosestHit(scene, rays.rays[lane], *other_hits[lane]);
+    } else {
+      result[lane] = ResolveTriangleHit(
+          scene, rays.rays[lane], triangle_hits.index[lane],
+          {rays.t_max[lane], triangle_hits.u[lane], triangle_hits.v[lane]});
+    }
+  }
+  return result;
+}
+
+// Маска лучей пучка, у которых есть препятствие ближе их t_max
+template <class Counters>
+uint32_t OccludedPacket(const Scene &scene, PacketRays &rays,
+                        Counters &counters) {
+  const TriangleStore &triangles = scene.GetTriangles();
+
+  for (size_t lane = 0; lane < rays.size; ++lane) {
+    counters.CountRay(RayKind::kShadow, 0);
+  }
+
+  PacketTriangleHits triangle_hits;
+  uint32_t occluded = scene.GetBvh().TraversePacketAny(
+      rays, rays.AllLanes(),
+      [&](std::span<const BvhPrimitive> primitives, uint32_t lanes) {
+        size_t triangle_count = CountLeafTriangles(primitives);
+        counters.CountTriangleTests(triangle_count * std::popcount(lanes));
+        uint32_t hit = 0;
+        if (triangle_count > 0) {
+          hit = IntersectTrianglesPacket(triangles, primitives[0].index,
+                                         triangle_count, rays, lanes,
+                                         &triangle_hits);
+        }
+        for (const BvhPrimitive &primitive :
+             primitives.subspan(triangle_count)) {
+          for (uint32_t bits = lanes & ~hit; bits != 0; bits &= bits - 1) {
+            size_t lane = std::countr_zero(bits);
+            if (IsNonTriangleOccluding(scene, rays.rays[lane], primitive,
+                                       rays.t_max[lane], counters)) {
+              hit |= uint32_t{1} << lane;
+            }
+          }
+        }
+        return hit;
+      },
+      [&] { counters.CountNodeVisit(); });
+
+  for (size_t lane = 0; lane < rays.size && !scene.GetSphereGrid().IsEmpty();
+       ++lane) {
+    uint32_t bit = uint32_t{1} << lane;
+    if ((occluded & bit) == 0 &&
+        IsSphereGridOccluding(scene, rays.rays[lane], rays.t_max[lane],
+                              counters)) {
+      occluded |= bit;
+    }
+  }
+
+  for (int i = std::popcount(occluded); i > 0; --i) {
+    counters.CountOccluded();
+  }
+  return occluded;
+}
+
+// Трассирует пучок первичных лучей. Ближайшие попадания и тени от каждого
+// источника ищутся пучками, а отражённые и преломлённые лучи, которые уже
+// разошлись, - по одному через TraceStack. Цвет луча i пучка пишется в
+// colors[i], попадание - в primary_hits[i], если он не пуст. Результат тот
+// же, что у TraceRay для каждого луча.
+template <class Counters>
+void TracePacket(const Scene &scene, const RayPacket &packet,
+                 const RenderOptions &render_options,
+                 std::vector<PendingRay> &stack, Counters &counters,
+                 std::span<Vector> colors,
+                 std::span<PrimaryHit> primary_hits) {
+  int depth = render_options.depth;
+  double min_weight = render_options.min_ray_weight;
+  size_t size = packet.Size();
+
+  PacketRays rays;
+  for (size_t lane = 0; lane < size; ++lane) {
+    counters.CountRay(RayKind::kPrimary, 0);
+    rays.Add(packet.GetRay(lane), std::numeric_limits<double>::max());
+  }
+  auto intersections = ClosestPacketIntersections(scene, rays, counters);
+
+  // lit[light] - маска лучей, точки попадания которых видят источник
+  const auto &lights = scene.GetLights();
+  std::vector<uint32_t> lit(lights.size());
+  PacketRays shadow_rays;
+  std::array<size_t, PacketRays::kMaxSize> shadow_lanes;
+  for (size_t light_index = 0; light_index < lights.size(); ++light_index) {
+    shadow_rays.Clear();
+    for (size_t lane = 0; lane < size; ++lane) {
+      if (intersections[lane].has_value()) {
+        ShadowRay shadow_ray =
+            MakeShadowRay(*intersections[lane], lights[light_index]);
+        shadow_lanes[shadow_rays.size] = lane;
+        shadow_rays.Add(shadow_ray.ray, shadow_ray.max_distance);
+      }
+    }
+    if (shadow_rays.size == 0) {
+      break;
+    }
+    uint32_t occluded = OccludedPacket(scene, shadow_rays, counters);
+    for (size_t i = 0; i < shadow_rays.size; ++i) {
+      if (!(occluded >> i & 1)) {
+        lit[light_index] |= uint32_t{1} << shadow_lanes[i];
+      }
+    }
+  }
+
+  for (size_t lane = 0; lane < size; ++lane) {
+    if (!primary_hits.empty()) {
+      primary_hits[lane] = {};
+    }
+    if (!intersections[lane].has_value()) {
+      colors[lane] = Vector();
+      continue;
+    }
+    const FullIntersection &intersection = *intersections[lane];
+    if (!primary_hits.empty()) {
+      primary_hits[lane] = {intersection.material, intersection.normal,
+                            intersection.distance};
+    }
+
+    PendingRay primary{rays.rays[lane], 1.0, depth, RayKind::kPrimary};
+    Vector color = ShadePoint(scene, primary.ray, intersection,
+                              [&](size_t light_index, const ShadowRay &) {
+                                return (lit[light_index] >> lane & 1) != 0;
+                              });
+
+    // Порядок в стеке тот же, что у TraceStack: отражённый луч идёт первым
+    auto [reflected, refracted] =
+        GetSecondaryRays(primary, intersection, min_weight);
+    stack.clear();
+    if (refracted) {
+      stack.push_back(*refracted);
+    }
+    if (reflected) {
+      stack.push_back(*reflected);
+    }
+    colors[lane] =
+        TraceStack(scene, depth, min_weight, stack, counters, color);
+  }
+}
+
+template <class Counters>
+Vector PixelColorDepth(const Scene &scene, const Ray &ray, double &max_depth,
+                       Counters &counters) {
+  counters.CountRay(RayKind::kPrimary, 0);
+  auto closest_intersection = ClosestIntersection(scene, ray, counters);
 
   if (closest_intersection.has_value()) {
     max_depth = std::max(max_depth, closest_intersection->GetDistance());
@@ -222,8 +838,11 @@ Vector PixelColorDepth(const Scene &scene, const Ray &ray, double &max_depth) {
   return Vector(1.0, 1.0, 1.0);
 }
 
-Vector PixelColorNormal(const Scene &scene, const Ray &ray) {
-  auto closest_intersection = ClosestIntersection(scene, ray);
+template <class Counters>
+Vector PixelColorNormal(const Scene &scene, const Ray &ray,
+                        Counters &counters) {
+  counters.CountRay(RayKind::kPrimary, 0);
+  auto closest_intersection = ClosestIntersection(scene, ray, counters);
 
   if (closest_intersection.has_value()) {
     return 0.5 * closest_intersection->GetNormal() + 0.5;
@@ -232,100 +851,621 @@ Vector PixelColorNormal(const Scene &scene, const Ray &ray) {
   return Vector(0.0, 0.0, 0.0);
 }
 
-void GammaCorrection(Vector &color) {
-  double gamma = 1.0 / 2.2;
-  color[0] = std::pow(color[0], gamma);
-  color[1] = std::pow(color[1], gamma);
-  color[2] = std::pow(color[2], gamma);
+const GammaTable &GetGammaTable() {
+  static const GammaTable table(1.0 / 2.2);
+  return table;
 }
 
-void ToneMapping(std::vector<std::vector<Vector>> &colors, double max_color) {
-  double c = max_color;
-  double c_sq = c * c;
+// Тонмаппинг строки одного канала. Цикл без ветвлений, чтобы компилятор
+// мог его векторизовать.
+void ToneMapRow(const double *values, size_t count, double max_color,
+                double *result) {
+  double inv_c_sq = 1.0 / (max_color * max_color);
+  for (size_t i = 0; i < count; ++i) {
+    double value = values[i];
+    result[i] = (value * (1.0 + inv_c_sq * value)) / (1.0 + value);
+  }
+}
 
-  for (auto &row : colors) {
-    for (Vector &color : row) {
-      Vector v_in = color;
-      Vector v_out = (v_in * (1.0 + 1.0 / c_sq * v_in)) / (1.0 + v_in);
-      color = v_out;
+// Переводит строку кадра в байты RGBA картинки. Берутся только пиксели с x,
+// кратным step, и каждый размножается на step пикселей вправо. Кадр не
+// меняется, scratch - буфер на ширину строки.
+void PostProcessRow(const FramebufferView &colors, int y, RenderMode mode,
+                    double max_color, double max_depth, png_bytep pixels,
+                    double *scratch, int step = 1) {
+  const double epsilon = 1e-6;
+  int width = colors.Width();
+
+  if (mode == RenderMode::kFull) {
+    const GammaTable &gamma = GetGammaTable();
+    for (size_t channel = 0; channel < FramebufferView::kChannels;
+         ++channel) {
+      const double *row = colors.Row(channel, y);
+      size_t count = width;
+      if (step > 1) {
+        count = 0;
+        for (int x = 0; x < width; x += step) {
+          scratch[count++] = row[x];
+        }
+        row = scratch;
+      }
+      if (max_color > 0.0) {
+        ToneMapRow(row, count, max_color, scratch);
+        row = scratch;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        pixels[4 * i * step + channel] = gamma.Quantize(row[i]);
+      }
+    }
+  } else {
+    for (int x = 0; x < width; x += step) {
+      Vector color = colors.Get(y, x);
+      if (mode == RenderMode::kDepth &&
+          !(fabs(color[0] - 1.0) < epsilon &&
+            fabs(color[1] - 1.0) < epsilon &&
+            fabs(color[2] - 1.0) < epsilon)) {
+        color *= 1.0 / max_depth;
+      }
+      color *= 255.0;
+      for (size_t channel = 0; channel < FramebufferView::kChannels;
+           ++channel) {
+        pixels[4 * x + channel] = static_cast<int>(color[channel]);
+      }
+    }
+  }
+
+  for (int x = 0; x < width; ++x) {
+    if (x % step != 0) {
+      std::copy_n(pixels + 4 * (x - x % step), 3, pixels + 4 * x);
     }
   }
 }
 
-Image Render(const std::filesystem::path &path,
-             const CameraOptions &camera_options,
-             const RenderOptions &render_options) {
-  const double epsilon = 1e-6;
+struct Tile {
+  int x_begin, x_end;
+  int y_begin, y_end;
+};
 
-  Scene scene = ReadScene(path);
-  Image image(camera_options.screen_width, camera_options.screen_height);
+constexpr int kTileSize = 16;
+
+// Картинка режется на квадраты kTileSize x kTileSize, которые рендерятся
+// независимо, поэтому результат не зависит от числа потоков
+std::vector<Tile> SplitIntoTiles(int width, int height) {
+  std::vector<Tile> tiles;
+  for (int y = 0; y < height; y += kTileSize) {
+    for (int x = 0; x < width; x += kTileSize) {
+      tiles.push_back({x, std::min(x + kTileSize, width), y,
+                       std::min(y + kTileSize, height)});
+    }
+  }
+  return tiles;
+}
 
+struct TileResult {
   double max_depth = 0.0;
   double max_color = 0.0;
-  std::vector<std::vector<Vector>> colors(
-      camera_options.screen_height,
-      std::vector<Vector>(camera_options.screen_width));
 
-  for (int y = 0; y < camera_options.screen_height; ++y) {
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-      Ray ray = CameraRay(camera_options, x, y);
+  void Merge(const TileResult &other) {
+    max_depth = std::max(max_depth, other.max_depth);
+    max_color = std::max(max_color, other.max_color);
+  }
+};
+
+// Пиксели, у которых обе координаты кратны step, кроме тех, что уже
+// отрендерены на более грубой сетке с шагом skip_step (0 - таких нет)
+struct PixelGrid {
+  int step = 1;
+  int skip_step = 0;
+
+  bool Contains(int x, int y) const {
+    if (x % step != 0 || y % step != 0) {
+      return false;
+    }
+    return skip_step == 0 || x % skip_step != 0 || y % skip_step != 0;
+  }
+};
+
+// Точка внутри пикселя, через которую идёт отсчёт
+struct SampleOffset {
+  double dx, dy;
+};
+
+// Центры ячеек сетки k x k внутри пикселя, где k - наибольшая степень
+// двойки с k * k <= max_samples. Порядок задаёт матрица Байера: первые
+// четыре отсчёта лежат в разных четвертях пикселя, первые шестнадцать - в
+// разных ячейках сетки 4 x 4, и так далее, так что любая порция из 4^m
+// первых отсчётов покрывает пиксель равномерно.
+std::vector<SampleOffset> GetSampleOffsets(int max_samples) {
+  int side = 1;
+  while (4 * side * side <= max_samples) {
+    side *= 2;
+  }
+
+  std::vector<SampleOffset> offsets(side * side);
+  for (int y = 0; y < side; ++y) {
+    for (int x = 0; x < side; ++x) {
+      // Младшие разряды номера - четверть верхнего уровня
+      int index = 0;
+      for (int bit = side / 2, weight = 1; bit > 0; bit /= 2, weight *= 4) {
+        bool right = x & bit;
+        bool bottom = y & bit;
+        index += weight * (bottom ? (right ? 1 : 3) : (right ? 2 : 0));
+      }
+      offsets[index] = {(x + 0.5) / side, (y + 0.5) / side};
+    }
+  }
+  return offsets;
+}
+
+// Сжимает HDR-значение в [0, 1), чтобы сравнивать яркие и тёмные области
+// в одном масштабе
+double CompressColor(double value) { return value / (1.0 + value); }
+
+double CompressedLuminance(const Vector &color) {
+  return CompressColor(0.2126 * color[0] + 0.7152 * color[1] +
+                       0.0722 * color[2]);
+}
+
+// Средний цвет по отсчётам offsets. В режиме kAdaptive отсчёты добавляются
+// порциями по batch_samples, пока стандартная ошибка средней яркости не
+// станет меньше error_threshold.
+template <class Counters>
+Vector SamplePixel(const Scene &scene, const Camera &camera,
+                   const RenderOptions &render_options, int x, int y,
+                   std::span<const SampleOffset> offsets,
+                   std::vector<PendingRay> &ray_stack, Counters &counters) {
+  const AntialiasingOptions &options = render_options.antialiasing;
+  bool adaptive = options.mode == AntialiasingMode::kAdaptive;
+  size_t batch_size = std::max(2, options.batch_samples);
+  double max_variance = options.error_threshold * options.error_threshold;
+
+  Vector sum;
+  double luminance_sum = 0.0;
+  double luminance_sq_sum = 0.0;
+  size_t count = 0;
+  for (const SampleOffset &offset : offsets) {
+    Ray ray = camera.GetRay(x, y, offset.dx, offset.dy);
+    Vector color = TraceRay(scene, ray, render_options.depth,
+                            render_options.min_ray_weight, ray_stack, counters);
+    sum += color;
+    double luminance = CompressedLuminance(color);
+    luminance_sum += luminance;
+    luminance_sq_sum += luminance * luminance;
+    ++count;
+
+    if (adaptive && count % batch_size == 0 && count < offsets.size()) {
+      double mean = luminance_sum / count;
+      double variance = std::max(0.0, luminance_sq_sum / count - mean * mean) *
+                        count / (count - 1);
+      // Дисперсия среднего - дисперсия отсчёта, делённая на их число
+      if (variance / count < max_variance) {
+        break;
+      }
+    }
+  }
+  return sum / count;
+}
+
+// Рендерит пиксели сетки grid в тайле. Если primary_hits не пуст, туда
+// (построчно по всей картинке) записываются попадания первичных лучей.
+template <class Counters>
+TileResult RenderTile(const Scene &scene, const Camera &camera,
+                      const RenderOptions &render_options, const Tile &tile,
+                      const PixelGrid &grid, const FramebufferView &colors,
+                      std::span<PrimaryHit> primary_hits, Counters &counters) {
+  TileResult result;
+  std::vector<PendingRay> ray_stack;
+
+  bool supersample =
+      render_options.antialiasing.mode == AntialiasingMode::kSupersample;
+  std::vector<SampleOffset> offsets;
+  if (supersample) {
+    offsets = GetSampleOffsets(render_options.antialiasing.max_samples);
+  }
+
+  // Пучки обходят BVH только в double и только по двоичным узлам; режимы
+  // отладки (глубина, нормали) трассируются по одному лучу
+  bool use_packets = render_options.ray_packets &&
+                     scene.GetPrecision() == Precision::kDouble &&
+                     !scene.GetBvh().IsCompressed() &&
+                     render_options.mode == RenderMode::kFull &&
+                     !supersample && render_options.depth > 0 &&
+                     grid.step == 1 && grid.skip_step == 0;
+  if (use_packets) {
+    RayPacket packet;
+    std::array<Vector, RayPacket::kMaxSize> packet_colors;
+    std::array<PrimaryHit, RayPacket::kMaxSize> packet_hits;
+    std::span<PrimaryHit> packet_hits_view;
+    if (!primary_hits.empty()) {
+      packet_hits_view = packet_hits;
+    }
+
+    for (int y = tile.y_begin; y < tile.y_end; y += RayPacket::kSide) {
+      for (int x = tile.x_begin; x < tile.x_end; x += RayPacket::kSide) {
+        camera.GetPacket(x, y, std::min(RayPacket::kSide, tile.x_end - x),
+                         std::min(RayPacket::kSide, tile.y_end - y), &packet);
+        TracePacket(scene, packet, render_options, ray_stack, counters,
+                    packet_colors, packet_hits_view);
+
+        for (size_t i = 0; i < packet.Size(); ++i) {
+          int pixel_x = x + i % packet.width;
+          int pixel_y = y + i / packet.width;
+          const Vector &color = packet_colors[i];
+          result.max_color =
+              std::max({result.max_color, color[0], color[1], color[2]});
+          colors.Set(pixel_y - tile.y_begin, pixel_x - tile.x_begin, color);
+          if (!primary_hits.empty()) {
+            primary_hits[pixel_y * camera.Width() + pixel_x] = packet_hits[i];
+          }
+        }
+      }
+    }
+    return result;
+  }
+
+  // Направления первичных лучей считаются сразу для строки тайла
+  assert(tile.x_end - tile.x_begin <= kTileSize);
+  std::array<double, kTileSize> direction_x, direction_y, direction_z;
+
+  for (int y = tile.y_begin; y < tile.y_end; ++y) {
+    camera.GetRowDirections(y, tile.x_begin, tile.x_end, direction_x.data(),
+                            direction_y.data(), direction_z.data());
+    for (int x = tile.x_begin; x < tile.x_end; ++x) {
+      if (!grid.Contains(x, y)) {
+        continue;
+      }
+      size_t i = x - tile.x_begin;
+      Ray ray(camera.GetOrigin(),
+              {direction_x[i], direction_y[i], direction_z[i]});
       Vector color;
 
       switch (render_options.mode) {
       case RenderMode::kFull:
-        color = TraceRay(scene, ray, render_options.depth);
+        if (supersample) {
+          color = SamplePixel(scene, camera, render_options, x, y,
+                              offsets, ray_stack, counters);
+        } else {
+          PrimaryHit *primary_hit =
+              primary_hits.empty()
+                  ? nullptr
+                  : &primary_hits[y * camera.Width() + x];
+          color = TraceRay(scene, ray, render_options.depth,
+                           render_options.min_ray_weight, ray_stack, counters,
+                           primary_hit);
+        }
 
-        max_color = std::max(max_color, color[0]);
-        max_color = std::max(max_color, color[1]);
-        max_color = std::max(max_color, color[2]);
+        result.max_color = std::max(result.max_color, color[0]);
+        result.max_color = std::max(result.max_color, color[1]);
+        result.max_color = std::max(result.max_color, color[2]);
         break;
 
       case RenderMode::kDepth:
-        color = PixelColorDepth(scene, ray, max_depth);
+        color = PixelColorDepth(scene, ray, result.max_depth, counters);
         break;
 
       case RenderMode::kNormal:
-        color = PixelColorNormal(scene, ray);
+        color = PixelColorNormal(scene, ray, counters);
         break;
       }
 
-      colors[y][x] = color;
+      colors.Set(y - tile.y_begin, x - tile.x_begin, color);
     }
   }
 
-  if (render_options.mode == RenderMode::kFull && max_color > 0.0) {
-    ToneMapping(colors, max_color);
+  return result;
+}
+
+// Вызывает render_tile(tile, view, counters) для всех тайлов на пуле и
+// объединяет результаты. Счётчики, если они нужны, добавляются к
+// *render_options.stats. Тайлы, до которых дошла очередь после отмены,
+// пропускаются.
+template <class TileFunc>
+TileResult ForEachTile(const RenderOptions &render_options,
+                       const std::vector<Tile> &tiles, Framebuffer &colors,
+                       ThreadPool &pool, const CancellationToken *cancellation,
+                       TileFunc &&render_tile) {
+  std::vector<TileResult> tile_results(tiles.size());
+
+  auto render_tiles = [&](auto &counters) {
+    pool.ParallelFor(tiles.size(), [&](size_t tile, size_t worker) {
+      if (cancellation && cancellation->IsCancelled()) {
+        return;
+      }
+      const Tile &bounds = tiles[tile];
+      auto view = colors.View(bounds.x_begin, bounds.y_begin,
+                              bounds.x_end - bounds.x_begin,
+                              bounds.y_end - bounds.y_begin);
+      tile_results[tile] = render_tile(bounds, view, counters[worker]);
+    });
+  };
+
+  // Без статистики трассировка собирается с пустыми счётчиками
+  if (render_options.stats) {
+    std::vector<RayCounters> counters(pool.ThreadCount());
+    render_tiles(counters);
+    for (const RayCounters &worker_counters : counters) {
+      *render_options.stats += worker_counters.GetStats();
+    }
+  } else {
+    std::vector<NoRayCounters> counters(pool.ThreadCount());
+    render_tiles(counters);
   }
 
-  for (int y = 0; y < camera_options.screen_height; ++y) {
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-      Vector &color = colors[y][x];
+  TileResult result;
+  for (const TileResult &tile_result : tile_results) {
+    result.Merge(tile_result);
+  }
+  return result;
+}
 
-      switch (render_options.mode) {
-      case RenderMode::kFull:
-        GammaCorrection(color);
-        color *= 255.0;
-        break;
+// Рендерит пиксели сетки grid во всех тайлах
+TileResult RenderTiles(const Scene &scene, const Camera &camera,
+                       const RenderOptions &render_options,
+                       const std::vector<Tile> &tiles, const PixelGrid &grid,
+                       Framebuffer &colors, std::span<PrimaryHit> primary_hits,
+                       ThreadPool &pool,
+                       const CancellationToken *cancellation = nullptr) {
+  return ForEachTile(
+      render_options, tiles, colors, pool, cancellation,
+      [&](const Tile &tile, const FramebufferView &view, auto &counters) {
+        return RenderTile(scene, camera, render_options, tile, grid,
+                          view, primary_hits, counters);
+      });
+}
 
-      case RenderMode::kDepth:
-        if (!(fabs(color[0] - 1.0) < epsilon &&
-              fabs(color[1] - 1.0) < epsilon &&
-              fabs(color[2] - 1.0) < epsilon)) {
-          color *= 1.0 / max_depth;
+// Граница между соседними пикселями: разные материалы, излом поверхности,
+// скачок глубины или заметная разница цвета
+bool IsEdge(const Vector &color, const PrimaryHit &hit,
+            const Vector &other_color, const PrimaryHit &other_hit,
+            double contrast_threshold) {
+  const double kMinNormalCos = 0.9;
+  const double kMaxDepthRatio = 0.1;
+
+  if (hit.material != other_hit.material) {
+    return true;
+  }
+  if (hit.material) {
+    if (DotProduct(hit.normal, other_hit.normal) < kMinNormalCos) {
+      return true;
+    }
+    double depth_jump = std::fabs(hit.distance - other_hit.distance);
+    if (depth_jump >
+        kMaxDepthRatio * std::min(hit.distance, other_hit.distance)) {
+      return true;
+    }
+  }
+  for (size_t channel = 0; channel < Framebuffer::kChannels; ++channel) {
+    if (std::fabs(CompressColor(color[channel]) -
+                  CompressColor(other_color[channel])) > contrast_threshold) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Отмечает пиксели, которые образуют границу хотя бы с одним из четырёх
+// соседей. Каждый поток пишет только свои строки маски.
+std::vector<uint8_t> FindEdgePixels(const Framebuffer &colors,
+                                    std::span<const PrimaryHit> primary_hits,
+                                    double contrast_threshold,
+                                    ThreadPool &pool) {
+  int width = colors.Width();
+  int height = colors.Height();
+  std::vector<uint8_t> edges(static_cast<size_t>(width) * height);
+
+  pool.ParallelFor(height, [&](size_t row, size_t) {
+    int y = row;
+    for (int x = 0; x < width; ++x) {
+      size_t index = static_cast<size_t>(y) * width + x;
+      Vector color = colors.Get(y, x);
+      auto differs = [&](int other_y, int other_x) {
+        size_t other = static_cast<size_t>(other_y) * width + other_x;
+        return IsEdge(color, primary_hits[index], colors.Get(other_y, other_x),
+                      primary_hits[other], contrast_threshold);
+      };
+      edges[index] = (x > 0 && differs(y, x - 1)) ||
+                     (x + 1 < width && differs(y, x + 1)) ||
+                     (y > 0 && differs(y - 1, x)) ||
+                     (y + 1 < height && differs(y + 1, x));
+    }
+  });
+  return edges;
+}
+
+// Второй проход адаптивного сглаживания: пиксели на границах, найденных
+// по первому проходу с одним отсчётом на пиксель, пересчитываются по
+// нескольким отсчётам
+TileResult RefineEdges(const Scene &scene, const Camera &camera,
+                       const RenderOptions &render_options,
+                       const std::vector<Tile> &tiles, Framebuffer &colors,
+                       std::span<const PrimaryHit> primary_hits,
+                       ThreadPool &pool,
+                       const CancellationToken *cancellation = nullptr) {
+  const AntialiasingOptions &options = render_options.antialiasing;
+  auto edges = FindEdgePixels(colors, primary_hits,
+                              options.contrast_threshold, pool);
+  auto offsets = GetSampleOffsets(options.max_samples);
+  int width = colors.Width();
+
+  return ForEachTile(
+      render_options, tiles, colors, pool, cancellation,
+      [&](const Tile &tile, const FramebufferView &view, auto &counters) {
+        TileResult result;
+        std::vector<PendingRay> ray_stack;
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+          for (int x = tile.x_begin; x < tile.x_end; ++x) {
+            if (!edges[static_cast<size_t>(y) * width + x]) {
+              continue;
+            }
+            Vector color = SamplePixel(scene, camera, render_options,
+                                       x, y, offsets, ray_stack, counters);
+            result.max_color = std::max(
+                {result.max_color, color[0], color[1], color[2]});
+            view.Set(y - tile.y_begin, x - tile.x_begin, color);
+          }
         }
-        color *= 255.0;
-        break;
+        return result;
+      });
+}
 
-      case RenderMode::kNormal:
-        color *= 255.0;
-        break;
+// Строки независимы, и каждая целиком лежит в своих кэш-линиях. При
+// step > 1 обрабатываются только пиксели с координатами, кратными step, а
+// остальные получают цвет узла сетки, в клетку которого попали.
+void PostProcess(Framebuffer &colors, RenderMode mode, const TileResult &range,
+                 Image &image, ThreadPool &pool, int step = 1) {
+  int width = colors.Width();
+  int height = colors.Height();
+  auto view = colors.View();
+  std::vector<AlignedVector<double>> scratch(pool.ThreadCount(),
+                                             AlignedVector<double>(width));
+
+  size_t grid_rows = (height + step - 1) / step;
+  pool.ParallelFor(grid_rows, [&](size_t row, size_t worker) {
+    size_t y = row * step;
+    PostProcessRow(view, y, mode, range.max_color, range.max_depth,
+                   image.Data() + 4 * y * width, scratch[worker].data(),
+                   step);
+  });
+
+  if (step > 1) {
+    pool.ParallelFor(height, [&](size_t y, size_t) {
+      if (y % step != 0) {
+        png_bytep source = image.Data() + 4 * (y - y % step) * width;
+        std::copy_n(source, 4 * width, image.Data() + 4 * y * width);
       }
+    });
+  }
+}
+
+bool UsesEdgeRefinement(const RenderOptions &render_options) {
+  return render_options.mode == RenderMode::kFull &&
+         render_options.antialiasing.mode == AntialiasingMode::kAdaptive;
+}
+
+// Точность сцены задаётся при подготовке и должна совпадать с
+// render_options.precision
+void CheckPrecision(const PreparedScene &prepared_scene,
+                    const RenderOptions &render_options) {
+  if (prepared_scene.GetScene().GetPrecision() != render_options.precision) {
+    throw std::invalid_argument{
+        "Scene was prepared with a different precision"};
+  }
+}
+
+// render_options.bvh здесь не используется: BVH уже построено при
+// подготовке сцены
+Image Render(const PreparedScene &prepared_scene,
+             const CameraOptions &camera_options,
+             const RenderOptions &render_options) {
+  CheckPrecision(prepared_scene, render_options);
+  Image image(camera_options.screen_width, camera_options.screen_height);
+  Framebuffer colors(camera_options.screen_width,
+                     camera_options.screen_height);
+  auto tiles =
+      SplitIntoTiles(camera_options.screen_width, camera_options.screen_height);
+  ThreadPool pool(render_options.threads);
+
+  if (render_options.stats) {
+    *render_options.stats = {};
+  }
+  std::vector<PrimaryHit> primary_hits(
+      UsesEdgeRefinement(render_options)
+          ? camera_options.screen_width * camera_options.screen_height
+          : 0);
+  Camera camera(camera_options);
+  TileResult range = RenderTiles(prepared_scene.GetScene(), camera,
+                                 render_options, tiles, PixelGrid{}, colors,
+                                 primary_hits, pool);
+  if (UsesEdgeRefinement(render_options)) {
+    range.Merge(RefineEdges(prepared_scene.GetScene(), camera,
+                            render_options, tiles, colors, primary_hits,
+                            pool));
+  }
+  PostProcess(colors, render_options.mode, range, image, pool);
+
+  return image;
+}
+
+// Промежуточный результат прогрессивного рендеринга
+struct ProgressiveSnapshot {
+  // Номер прохода с нуля; последний проход даёт окончательную картинку
+  int pass;
+  int pass_count;
+  // Отрендерены пиксели, у которых обе координаты кратны step
+  int step;
+  // HDR-кадр до тонмаппинга: значения есть только в узлах сетки step
+  const Framebuffer &colors;
+  // Картинка, в которой каждая клетка сетки залита цветом своего узла
+  const Image &image;
+};
+
+using ProgressCallback = std::function<void(const ProgressiveSnapshot &)>;
+
+// Рендерит сначала каждый initial_step-й пиксель по обеим осям, затем
+// заполняет пропуски сетками вдвое мельче, пока шаг не станет 1. После
+// каждого прохода вызывает progress. Каждый пиксель трассируется один раз,
+// а адаптивное сглаживание идёт последним проходом, так что окончательная
+// картинка совпадает с Render. При отмене возвращает последний законченный
+// промежуточный результат.
+Image RenderProgressive(const PreparedScene &prepared_scene,
+                        const CameraOptions &camera_options,
+                        const RenderOptions &render_options,
+                        const ProgressCallback &progress = {},
+                        const CancellationToken *cancellation = nullptr,
+                        int initial_step = 8) {
+  CheckPrecision(prepared_scene, render_options);
+  int width = camera_options.screen_width;
+  int height = camera_options.screen_height;
+  Image image(width, height);
+  Framebuffer colors(width, height);
+  auto tiles = SplitIntoTiles(width, height);
+  ThreadPool pool(render_options.threads);
+  Camera camera(camera_options);
+
+  initial_step = std::bit_floor(static_cast<unsigned>(std::max(1, initial_step)));
+  int grid_pass_count =
+      std::countr_zero(static_cast<unsigned>(initial_step)) + 1;
+  // Адаптивное сглаживание - отдельный последний проход по готовому кадру
+  bool refine = UsesEdgeRefinement(render_options);
+  int pass_count = grid_pass_count + (refine ? 1 : 0);
+
+  if (render_options.stats) {
+    *render_options.stats = {};
+  }
 
-      image.SetPixel(RGB{static_cast<int>(color[0]), static_cast<int>(color[1]),
-                         static_cast<int>(color[2])},
-                     y, x);
+  std::vector<PrimaryHit> primary_hits(refine ? width * height : 0);
+  TileResult range;
+  for (int pass = 0, step = initial_step; pass < pass_count;
+       ++pass, step = std::max(1, step / 2)) {
+    TileResult pass_range;
+    if (pass < grid_pass_count) {
+      PixelGrid grid{step, pass == 0 ? 0 : 2 * step};
+      pass_range = RenderTiles(prepared_scene.GetScene(), camera,
+                               render_options, tiles, grid, colors,
+                               primary_hits, pool, cancellation);
+    } else {
+      pass_range = RefineEdges(prepared_scene.GetScene(), camera,
+                               render_options, tiles, colors, primary_hits,
+                               pool, cancellation);
+    }
+    if (cancellation && cancellation->IsCancelled()) {
+      break;
+    }
+    range.Merge(pass_range);
+
+    PostProcess(colors, render_options.mode, range, image, pool, step);
+    if (progress) {
+      progress({pass, pass_count, step, colors, image});
     }
   }
 
   return image;
 }
+
+Image Render(const std::filesystem::path &path,
+             const CameraOptions &camera_options,
+             const RenderOptions &render_options) {
+  return Render(PreparedScene(path, render_options.bvh, render_options.cache,
+                              render_options.precision),
+                camera_options, render_options);
+}
@@ -5,17 +5,29 @@
 #include "../geometry/vector.h"
 #include "material.h"
 
-#include <vector>
+#include <array>
+#include <cstddef>
+#include <span>
 
 struct Object {
+  // Индексы нормалей вершин в Scene::GetNormals(), -1 если нормали не заданы
+  static constexpr int kNoNormal = -1;
+  // Индексы вершин в Scene::GetVertices(), -1 у треугольников, добавленных
+  // не из .obj: такие не двигаются при Scene::UpdateVertices()
+  static constexpr int kNoVertex = -1;
+
   const Material *material = nullptr;
   Triangle polygon;
-  std::vector<Vector> normals;
+  std::array<int, 3> normal_indices = {kNoNormal, kNoNormal, kNoNormal};
+  std::array<int, 3> vertex_indices = {kNoVertex, kNoVertex, kNoVertex};
 
   Object() = default;
   Object(const Triangle &polygon) : polygon(polygon) {}
-  const Vector *GetNormal(size_t index) const {
-    return normals.empty() ? nullptr : &normals[index];
+  bool HasNormals() const { return normal_indices[0] != kNoNormal; }
+  // Нормаль вершины index из таблицы normals (Scene::GetNormals()), nullptr
+  // если нормали не заданы
+  const Vector *GetNormal(size_t index, std::span<const Vector> normals) const {
+    return HasNormals() ? &normals[normal_indices[index]] : nullptr;
   }
 };
 
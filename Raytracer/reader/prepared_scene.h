@@ -0,0 +1,68 @@
+#pragma once
+
+#include "../options/bvh_options.h"
+#include "../options/precision.h"
+#include "../options/scene_cache_options.h"
+#include "scene.h"
+#include "scene_cache.h"
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <span>
+#include <utility>
+
+// Прочитанная сцена вместе с ускоряющими структурами. Её можно рендерить
+// сколько угодно раз с разными камерами и настройками, в том числе из
+// нескольких потоков одновременно. Копирование дешёвое: копии разделяют
+// одну неизменяемую сцену.
+class PreparedScene {
+public:
+  // При Precision::kFloat треугольники и BVH хранятся во float, и сцену
+  // можно рендерить только с RenderOptions::precision = kFloat
+  explicit PreparedScene(const std::filesystem::path &path,
+                         const BvhOptions &bvh_options = {},
+                         const SceneCacheOptions &cache_options = {},
+                         Precision precision = Precision::kDouble)
+      : scene_(std::make_shared<Scene>(
+            Prepare(path, bvh_options, cache_options, precision))) {}
+
+  const Scene &GetScene() const { return *scene_; }
+
+  const BvhStats &GetBvhStats() const { return scene_->GetBvh().GetStats(); }
+
+  // Следующий кадр анимации, см. Scene::UpdateVertices. Меняется только
+  // эта PreparedScene: если сцену разделяют другие копии (например, те,
+  // что сейчас рендерятся), кадр обновляет её копию (Scene::Clone), а
+  // они по-прежнему видят старую. Сцена, которой владеет только эта
+  // PreparedScene, обновляется на месте без копирования; саму эту
+  // PreparedScene во время обновления рендерить нельзя.
+  SceneUpdateStats UpdateVertices(std::span<const Vector> vertices,
+                                  size_t threads = 0) {
+    // Сцена всегда создаётся неконстантной (в конструкторе или здесь),
+    // поэтому единственный владелец может менять её на месте
+    std::shared_ptr<Scene> scene =
+        scene_.use_count() == 1 ? std::const_pointer_cast<Scene>(scene_)
+                                : std::make_shared<Scene>(scene_->Clone());
+    SceneUpdateStats stats = scene->UpdateVertices(vertices, threads);
+    scene_ = std::move(scene);
+    return stats;
+  }
+
+private:
+  static Scene Prepare(const std::filesystem::path &path,
+                       const BvhOptions &bvh_options,
+                       const SceneCacheOptions &cache_options,
+                       Precision precision) {
+    Scene scene = ReadScene(path, bvh_options, cache_options);
+    if (precision == Precision::kFloat) {
+      scene.ConvertToFloat();
+    }
+    if (bvh_options.compressed_nodes) {
+      scene.CompressBvh();
+    }
+    return scene;
+  }
+
+  std::shared_ptr<const Scene> scene_;
+};
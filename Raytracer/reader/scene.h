@@ -1,68 +1,363 @@
 #pragma once
 
+#include "../accel/bvh.h"
+#include "../accel/mesh_instance.h"
+#include "../accel/sphere_grid.h"
+#include "../accel/triangle_store.h"
+#include "../geometry/transform.h"
 #include "../geometry/vector.h"
+#include "../options/precision.h"
+#include "../utils/mapped_file.h"
+#include "../utils/thread_pool.h"
 #include "light.h"
 #include "object.h"
+#include "text_scanner.h"
 
+#include <array>
+#include <chrono>
+#include <cstdint>
 #include <filesystem>
-#include <fstream>
-#include <iostream>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+struct SceneUpdateStats {
+  double update_time_ms = 0.0;
+  // Сколько BVH (общее и мешей) подогнано под новые вершины и сколько
+  // построено заново
+  size_t refit_count = 0;
+  size_t rebuild_count = 0;
+};
+
 class Scene {
 public:
+  Scene() = default;
+
+  // Объекты ссылаются на материалы сцены по указателю: при перемещении
+  // узлы unordered_map остаются на месте, а простая копия указывала бы на
+  // чужие. Копировать сцену можно только через Clone.
+  Scene &operator=(const Scene &) = delete;
+  Scene(Scene &&) = default;
+  Scene &operator=(Scene &&) = default;
+
+  // Независимая копия: объекты, меши и хранилища треугольников копии
+  // ссылаются на её собственные материалы
+  Scene Clone() const {
+    Scene copy(*this);
+    std::unordered_map<const Material *, const Material *> remap;
+    for (const auto &[name, material] : materials_) {
+      remap.emplace(&material, &copy.materials_.at(name));
+    }
+    auto remap_objects = [&remap](auto &objects) {
+      for (auto &obj : objects) {
+        if (auto it = remap.find(obj.material); it != remap.end()) {
+          obj.material = it->second;
+        }
+      }
+    };
+    remap_objects(copy.objects_);
+    remap_objects(copy.sphere_objects_);
+    for (Mesh &mesh : copy.meshes_) {
+      remap_objects(mesh.objects);
+      mesh.triangles.RemapMaterials(remap);
+    }
+    copy.triangles_.RemapMaterials(remap);
+    copy.float_triangles_.RemapMaterials(remap);
+    return copy;
+  }
+
   const std::vector<Object> &GetObjects() const { return objects_; }
   const std::vector<SphereObject> &GetSphereObjects() const {
     return sphere_objects_;
   }
+  const std::vector<Vector> &GetVertices() const { return verticies_; }
+  const std::vector<Vector> &GetNormals() const { return normals_; }
   const std::vector<Light> &GetLights() const { return lights_; }
   const std::unordered_map<std::string, Material> &GetMaterials() const {
     return materials_;
   }
+  const Bvh &GetBvh() const { return bvh_; }
+  // Сферы, если они не вошли в BVH (BvhOptions::sphere_accelerator);
+  // иначе сетка пуста
+  const SphereGrid &GetSphereGrid() const { return sphere_grid_; }
+  // Треугольники в порядке листьев BVH: индексы треугольников в BVH
+  // указывают сюда, а не в GetObjects()
+  const TriangleStore &GetTriangles() const { return triangles_; }
+  // Те же треугольники во float; заполнены после ConvertToFloat()
+  const FloatTriangleStore &GetFloatTriangles() const {
+    return float_triangles_;
+  }
+  template <class T>
+  const BasicTriangleStore<T> &GetTriangleStore() const {
+    if constexpr (std::is_same_v<T, float>) {
+      return float_triangles_;
+    } else {
+      return triangles_;
+    }
+  }
+  // Меши, которые встречаются в сцене через экземпляры; их треугольники
+  // не входят в GetObjects() и хранятся по одному разу
+  const std::vector<Mesh> &GetMeshes() const { return meshes_; }
+  const std::vector<Instance> &GetInstances() const { return instances_; }
+  Precision GetPrecision() const { return precision_; }
+  // Номера объектов из GetObjects() в порядке GetTriangles()
+  const std::vector<uint32_t> &GetTriangleOrder() const {
+    return triangle_order_;
+  }
 
   void AddObject(const Object &obj) { objects_.push_back(obj); }
   void AddSphereObject(const SphereObject &sphere_obj) {
     sphere_objects_.push_back(sphere_obj);
   }
+  void AddObjects(std::vector<Object> objects) {
+    objects_ = std::move(objects);
+  }
+  void AddSphereObjects(std::vector<SphereObject> sphere_objects) {
+    sphere_objects_ = std::move(sphere_objects);
+  }
+  // Возвращает номер меша для AddInstance
+  uint32_t AddMesh(std::string name, std::vector<Object> objects) {
+    meshes_.emplace_back(std::move(name), std::move(objects));
+    return meshes_.size() - 1;
+  }
+  void AddInstance(uint32_t mesh, const Transform &to_world) {
+    instances_.emplace_back(mesh, to_world);
+  }
   void AddLight(const Light &light) { lights_.push_back(light); }
   void AddMaterial(const std::string &name, const Material &material) {
     materials_[name] = material;
   }
-  void AddVertices(const std::vector<Vector> &verticies) {
-    verticies_ = verticies;
+  void AddVertices(std::vector<Vector> verticies) {
+    verticies_ = std::move(verticies);
+  }
+  void AddNormals(std::vector<Vector> normals) { normals_ = std::move(normals); }
+
+  // Строится один раз, когда все объекты сцены уже добавлены
+  // Сначала строятся BVH мешей, затем общее дерево, листья которого -
+  // треугольники, сферы и экземпляры мешей
+  void BuildAccelerator(const BvhOptions &options = {}) {
+    for (Mesh &mesh : meshes_) {
+      mesh.BuildAccelerator(options);
+    }
+    // Экземпляры пустых мешей ни с чем не пересекаются
+    std::erase_if(instances_, [&](const Instance &instance) {
+      return meshes_[instance.mesh].objects.empty();
+    });
+    BuildTopLevel(GetInstanceBounds(), options);
+  }
+
+  // Новые положения вершин, например следующий кадр анимации; число вершин
+  // и грани остаются прежними. Треугольники сдвигаются за вершинами, а BVH
+  // (общее и мешей) не строятся заново: коробки узлов пересчитываются
+  // снизу вверх параллельно на threads потоках (0 - все ядра). Дерево,
+  // обход которого от этого подорожал больше, чем допускает
+  // BvhOptions::max_refit_cost_ratio, строится заново.
+  SceneUpdateStats UpdateVertices(std::span<const Vector> vertices,
+                                  size_t threads = 0) {
+    if (vertices.size() != verticies_.size()) {
+      throw std::invalid_argument{"Vertex count does not match the scene"};
+    }
+    auto start = std::chrono::steady_clock::now();
+    ThreadPool pool{threads};
+    verticies_.assign(vertices.begin(), vertices.end());
+
+    SceneUpdateStats stats;
+    for (Mesh &mesh : meshes_) {
+      UpdatePolygons(mesh.objects, pool);
+      mesh.bvh.Refit(
+          [&](const BvhPrimitive &primitive) {
+            return GetBoundingBox(
+                mesh.objects[mesh.triangle_order[primitive.index]].polygon);
+          },
+          pool);
+      if (mesh.bvh.NeedsRebuild()) {
+        mesh.BuildAccelerator(mesh.bvh.GetOptions());
+        ++stats.rebuild_count;
+      } else {
+        UpdateTriangleStore(mesh.triangles, mesh.objects, mesh.triangle_order,
+                            pool);
+        ++stats.refit_count;
+      }
+    }
+
+    std::vector<BoundingBox> instance_bounds = GetInstanceBounds();
+    UpdatePolygons(objects_, pool);
+    // Сжатые узлы не подгоняются: такое дерево строится заново
+    bool compressed = bvh_.IsCompressed();
+    if (!compressed) {
+      bvh_.Refit(
+          [&](const BvhPrimitive &primitive) {
+            switch (primitive.kind) {
+            case PrimitiveKind::kTriangle:
+              return GetBoundingBox(
+                  objects_[triangle_order_[primitive.index]].polygon);
+            case PrimitiveKind::kSphere:
+              return GetBoundingBox(sphere_objects_[primitive.index].sphere);
+            default:
+              return instance_bounds[primitive.index];
+            }
+          },
+          pool);
+    }
+    if (compressed || bvh_.NeedsRebuild()) {
+      BuildTopLevel(instance_bounds, bvh_.GetOptions());
+      if (compressed) {
+        bvh_.Compress();
+      }
+      ++stats.rebuild_count;
+    } else {
+      if (precision_ == Precision::kFloat) {
+        UpdateTriangleStore(float_triangles_, objects_, triangle_order_, pool);
+      } else {
+        UpdateTriangleStore(triangles_, objects_, triangle_order_, pool);
+      }
+      ++stats.refit_count;
+    }
+
+    std::chrono::duration<double, std::milli> update_time =
+        std::chrono::steady_clock::now() - start;
+    stats.update_time_ms = update_time.count();
+    return stats;
+  }
+
+  // Готовое дерево, треугольники в котором уже перенумерованы в порядке
+  // triangle_order
+  void SetAccelerator(Bvh bvh, std::vector<uint32_t> triangle_order) {
+    bvh_ = std::move(bvh);
+    triangle_order_ = std::move(triangle_order);
+    triangles_ = TriangleStore(objects_, triangle_order_);
+    sphere_grid_ = UseSphereGrid(bvh_.GetOptions())
+                       ? SphereGrid(sphere_objects_)
+                       : SphereGrid();
+  }
+
+  // Переводит общее BVH в сжатые узлы, см. Bvh::Compress
+  void CompressBvh() { bvh_.Compress(); }
+
+  // Переводит треугольники и BVH во float: обход и пересечения считаются
+  // в одинарной точности, а копии в double освобождаются. Затенение
+  // по-прежнему идёт в double, как и пересечения с мешами экземпляров.
+  void ConvertToFloat() {
+    if (precision_ == Precision::kFloat) {
+      return;
+    }
+    float_triangles_ = FloatTriangleStore(objects_, triangle_order_);
+    triangles_ = {};
+    bvh_.ConvertToFloat();
+    precision_ = Precision::kFloat;
   }
-  void AddNormals(const std::vector<Vector> &normals) { normals_ = normals; }
 
 private:
+  Scene(const Scene &) = default;
+
+  std::vector<BoundingBox> GetInstanceBounds() const {
+    std::vector<BoundingBox> instance_bounds;
+    instance_bounds.reserve(instances_.size());
+    for (const Instance &instance : instances_) {
+      instance_bounds.push_back(
+          instance.to_world.ApplyToBox(meshes_[instance.mesh].GetBounds()));
+    }
+    return instance_bounds;
+  }
+
+  bool UseSphereGrid(const BvhOptions &options) const {
+    switch (options.sphere_accelerator) {
+    case SphereAccelerator::kBvh:
+      return false;
+    case SphereAccelerator::kGrid:
+      return !sphere_objects_.empty();
+    default:
+      return IsSphereGridSuitable(sphere_objects_,
+                                  objects_.size() + instances_.size());
+    }
+  }
+
+  // Общее дерево над треугольниками, сферами и экземплярами мешей; сферы
+  // могут вместо него попасть в сетку
+  void BuildTopLevel(std::span<const BoundingBox> instance_bounds,
+                     const BvhOptions &options) {
+    if (UseSphereGrid(options)) {
+      sphere_grid_ = SphereGrid(sphere_objects_);
+      bvh_ = Bvh(objects_, {}, instance_bounds, options);
+    } else {
+      sphere_grid_ = SphereGrid();
+      bvh_ = Bvh(objects_, sphere_objects_, instance_bounds, options);
+    }
+    triangle_order_ = bvh_.ReorderTriangles();
+    if (precision_ == Precision::kFloat) {
+      float_triangles_ = FloatTriangleStore(objects_, triangle_order_);
+      bvh_.ConvertToFloat();
+    } else {
+      triangles_ = TriangleStore(objects_, triangle_order_);
+    }
+  }
+
+  // Треугольники из .obj заново собираются из своих вершин
+  void UpdatePolygons(std::vector<Object> &objects, ThreadPool &pool) const {
+    pool.ParallelForBlocks(objects.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        const auto &indices = objects[i].vertex_indices;
+        if (indices[0] != Object::kNoVertex) {
+          objects[i].polygon = Triangle(verticies_[indices[0]],
+                                        verticies_[indices[1]],
+                                        verticies_[indices[2]]);
+        }
+      }
+    });
+  }
+
+  template <class T>
+  static void UpdateTriangleStore(BasicTriangleStore<T> &triangles,
+                                  const std::vector<Object> &objects,
+                                  const std::vector<uint32_t> &order,
+                                  ThreadPool &pool) {
+    pool.ParallelForBlocks(order.size(), [&](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; ++i) {
+        triangles.SetTriangle(i, objects[order[i]].polygon);
+      }
+    });
+  }
+
   std::vector<Vector> verticies_;
   std::vector<Vector> normals_;
   std::vector<Object> objects_;
   std::vector<SphereObject> sphere_objects_;
+  std::vector<Mesh> meshes_;
+  std::vector<Instance> instances_;
   std::vector<Light> lights_;
   std::unordered_map<std::string, Material> materials_;
+  Bvh bvh_;
+  SphereGrid sphere_grid_;
+  std::vector<uint32_t> triangle_order_;
+  TriangleStore triangles_;
+  FloatTriangleStore float_triangles_;
+  Precision precision_ = Precision::kDouble;
 };
 
 std::unordered_map<std::string, Material>
 ReadMaterials(const std::filesystem::path &path) {
-  std::ifstream file_stream(path);
+  MappedFile file(path);
 
   std::unordered_map<std::string, Material> materials;
   Material current_material;
-  std::string line;
 
-  while (std::getline(file_stream, line)) {
-    std::istringstream line_stream(line);
-    std::string command;
-    line_stream >> command;
+  LineScanner lines(file.View());
+  std::string_view line;
+  while (lines.NextLine(line)) {
+    TokenScanner tokens(line);
+    std::string_view command = tokens.NextToken();
 
     if (command == "newmtl") {
       if (!current_material.name.empty()) {
         materials[current_material.name] = current_material;
       }
 
-      line_stream >> current_material.name;
+      current_material.name = tokens.NextToken();
       current_material.specular_exponent = 1.0;
       current_material.refraction_index = 1.0;
       current_material.ambient_color = Vector(0, 0, 0);
@@ -73,33 +368,33 @@ ReadMaterials(const std::filesystem::path &path) {
 
     } else if (command == "Ka") {
       double r, g, b;
-      line_stream >> r >> g >> b;
+      tokens.ReadDoubles(r, g, b);
       current_material.ambient_color = Vector(r, g, b);
 
     } else if (command == "Kd") {
       double r, g, b;
-      line_stream >> r >> g >> b;
+      tokens.ReadDoubles(r, g, b);
       current_material.diffuse_color = Vector(r, g, b);
 
     } else if (command == "Ks") {
       double r, g, b;
-      line_stream >> r >> g >> b;
+      tokens.ReadDoubles(r, g, b);
       current_material.specular_color = Vector(r, g, b);
 
     } else if (command == "Ke") {
       double r, g, b;
-      line_stream >> r >> g >> b;
+      tokens.ReadDoubles(r, g, b);
       current_material.intensity = Vector(r, g, b);
 
     } else if (command == "Ns") {
-      line_stream >> current_material.specular_exponent;
+      current_material.specular_exponent = tokens.NextDouble();
 
     } else if (command == "Ni") {
-      line_stream >> current_material.refraction_index;
+      current_material.refraction_index = tokens.NextDouble();
 
     } else if (command == "al") {
       double x, y, z;
-      line_stream >> x >> y >> z;
+      tokens.ReadDoubles(x, y, z);
       current_material.albedo = Vector(x, y, z);
     }
   }
@@ -111,114 +406,157 @@ ReadMaterials(const std::filesystem::path &path) {
   return materials;
 }
 
-Scene ReadScene(const std::filesystem::path &path) {
-  std::ifstream file_stream(path);
+// Индекс из .obj: положительные считаются с 1, отрицательные - с конца
+int ResolveObjIndex(int index, size_t count) {
+  return index > 0 ? index - 1 : static_cast<int>(count) + index;
+}
+
+// Разбирает .obj без построения ускоряющих структур. В material_libraries
+// дописываются пути подключённых .mtl.
+Scene ParseScene(const std::filesystem::path &path,
+                 std::vector<std::filesystem::path> &material_libraries) {
+  MappedFile file(path);
 
   Scene scene;
 
   std::vector<Vector> vertices;
   std::vector<Vector> normals;
   std::string current_material;
-
-  std::string line;
-  while (std::getline(file_stream, line)) {
-    std::istringstream line_stream(line);
-    std::string command;
-    line_stream >> command;
+  const Material *current_material_ptr = nullptr;
+
+  auto resolve_material = [&] {
+    const auto &materials = scene.GetMaterials();
+    auto it = materials.find(current_material);
+    current_material_ptr = it != materials.end() ? &it->second : nullptr;
+  };
+
+  // Переиспользуются между строками, чтобы не выделять память на каждую грань
+  std::vector<int> vertex_indices;
+  std::vector<int> normal_indices;
+
+  // Грани между "mesh <имя>" и "endmesh" попадают в меш, который затем
+  // размещается в сцене строками "inst <имя> <матрица 3x4 по строкам>"
+  bool in_mesh = false;
+  std::string mesh_name;
+  std::vector<Object> mesh_objects;
+  std::unordered_map<std::string, uint32_t> mesh_ids;
+
+  LineScanner lines(file.View());
+  std::string_view line;
+  while (lines.NextLine(line)) {
+    TokenScanner tokens(line);
+    std::string_view command = tokens.NextToken();
 
     if (command == "v") {
       double x, y, z;
-      line_stream >> x >> y >> z;
+      tokens.ReadDoubles(x, y, z);
       vertices.push_back(Vector(x, y, z));
 
     } else if (command == "vn") {
       double x, y, z;
-      line_stream >> x >> y >> z;
+      tokens.ReadDoubles(x, y, z);
       normals.push_back(Vector(x, y, z));
 
     } else if (command == "f") {
-      std::vector<int> vertex_indices;
-      std::vector<int> normal_indices;
-      std::string token;
-
-      while (line_stream >> token) {
-        std::istringstream token_stream(token);
-        std::string token_part;
-        std::vector<std::string> indices;
-
-        // v или v/vt или v/vt/vn или v//vn
-        while (std::getline(token_stream, token_part, '/')) {
-          indices.push_back(token_part);
+      vertex_indices.clear();
+      normal_indices.clear();
+
+      // v или v/vt или v/vt/vn или v//vn
+      for (auto token = tokens.NextToken(); !token.empty();
+           token = tokens.NextToken()) {
+        size_t first_slash = token.find('/');
+        vertex_indices.push_back(ResolveObjIndex(
+            TokenScanner::ParseInt(token.substr(0, first_slash)),
+            vertices.size()));
+
+        if (first_slash == std::string_view::npos) {
+          continue;
         }
-
-        int first_index = std::stoi(indices[0]);
-        vertex_indices.push_back(
-            first_index > 0 ? first_index - 1 : vertices.size() + first_index);
-
-        if (indices.size() >= 3) {
-          int last_index = std::stoi(indices[2]);
-          normal_indices.push_back(
-              last_index > 0 ? last_index - 1 : normals.size() + last_index);
+        size_t second_slash = token.find('/', first_slash + 1);
+        if (second_slash != std::string_view::npos &&
+            second_slash + 1 < token.size()) {
+          normal_indices.push_back(ResolveObjIndex(
+              TokenScanner::ParseInt(token.substr(second_slash + 1)),
+              normals.size()));
         }
       }
 
       // Триангулируем многоугольник
-      for (size_t i = 1; i < vertex_indices.size() - 1; ++i) {
+      for (size_t i = 1; i + 1 < vertex_indices.size(); ++i) {
         Triangle triangle(vertices[vertex_indices[0]],
                           vertices[vertex_indices[i]],
                           vertices[vertex_indices[i + 1]]);
 
         Object obj(triangle);
+        obj.vertex_indices = {vertex_indices[0], vertex_indices[i],
+                              vertex_indices[i + 1]};
 
         if (!normal_indices.empty()) {
-          obj.normals.push_back(normals[normal_indices[0]]);
-          obj.normals.push_back(normals[normal_indices[i]]);
-          obj.normals.push_back(normals[normal_indices[i + 1]]);
+          obj.normal_indices = {normal_indices[0], normal_indices[i],
+                                normal_indices[i + 1]};
         }
 
-        if (!current_material.empty()) {
-          const auto &materials = scene.GetMaterials();
-          auto it = materials.find(current_material);
-          if (it != materials.end()) {
-            obj.material = &(it->second);
-          }
+        obj.material = current_material_ptr;
+        if (in_mesh) {
+          mesh_objects.push_back(obj);
+        } else {
+          scene.AddObject(obj);
         }
-
-        scene.AddObject(obj);
       }
 
     } else if (command == "mtllib") {
-      std::string mtl_filename;
-      line_stream >> mtl_filename;
-      auto mtl_path = path.parent_path() / mtl_filename;
+      auto mtl_path = path.parent_path() / tokens.NextToken();
       auto materials = ReadMaterials(mtl_path);
+      material_libraries.push_back(mtl_path);
 
       for (auto &key_value : materials) {
         scene.AddMaterial(key_value.first, key_value.second);
       }
+      resolve_material();
 
     } else if (command == "usemtl") {
-      line_stream >> current_material;
+      current_material = tokens.NextToken();
+      resolve_material();
 
     } else if (command == "S") {
       double x, y, z, r;
-      line_stream >> x >> y >> z >> r;
+      tokens.ReadDoubles(x, y, z, r);
 
       SphereObject sphere_obj(Sphere(Vector(x, y, z), r));
-
-      if (!current_material.empty()) {
-        const auto &materials = scene.GetMaterials();
-        auto it = materials.find(current_material);
-        if (it != materials.end()) {
-          sphere_obj.material = &(it->second);
-        }
-      }
+      sphere_obj.material = current_material_ptr;
 
       scene.AddSphereObject(sphere_obj);
 
+    } else if (command == "mesh") {
+      in_mesh = true;
+      mesh_name = tokens.NextToken();
+      mesh_objects.clear();
+
+    } else if (command == "endmesh" && in_mesh) {
+      in_mesh = false;
+      mesh_ids[mesh_name] = scene.AddMesh(mesh_name, std::move(mesh_objects));
+      mesh_objects = {};
+
+    } else if (command == "inst") {
+      // Экземпляры неизвестных мешей пропускаются, как и неизвестные
+      // материалы
+      auto it = mesh_ids.find(std::string{tokens.NextToken()});
+      if (it == mesh_ids.end()) {
+        continue;
+      }
+      std::array<Vector, 3> rows;
+      Vector translation;
+      for (size_t row = 0; row < 3; ++row) {
+        double x, y, z, shift;
+        tokens.ReadDoubles(x, y, z, shift);
+        rows[row] = Vector(x, y, z);
+        translation[row] = shift;
+      }
+      scene.AddInstance(it->second, Transform(rows, translation));
+
     } else if (command == "P") {
       double x, y, z, r, g, b;
-      line_stream >> x >> y >> z >> r >> g >> b;
+      tokens.ReadDoubles(x, y, z, r, g, b);
 
       Light light;
       light.position = Vector(x, y, z);
@@ -228,8 +566,11 @@ Scene ReadScene(const std::filesystem::path &path) {
     }
   }
 
-  scene.AddVertices(vertices);
-  scene.AddNormals(normals);
+  if (in_mesh) {
+    scene.AddMesh(mesh_name, std::move(mesh_objects));
+  }
+  scene.AddVertices(std::move(vertices));
+  scene.AddNormals(std::move(normals));
 
   return scene;
 }
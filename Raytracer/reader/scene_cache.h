@@ -0,0 +1,597 @@
+#pragma once
+
+#include "../accel/bvh.h"
+#include "../geometry/sphere.h"
+#include "../geometry/triangle.h"
+#include "../geometry/vector.h"
+#include "../options/bvh_options.h"
+#include "../options/scene_cache_options.h"
+#include "../utils/mapped_file.h"
+#include "light.h"
+#include "material.h"
+#include "object.h"
+#include "scene.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Двоичный кэш сцены. Файл - заголовок и набор секций, каждая из которых -
+// массив записей в том же представлении, что и в памяти, начиная с границы
+// кэш-линии. Файл отображается в память, записи читаются на месте, а
+// массивы, которыми владеет сцена, копируются целиком, без разбора. Кэш
+// рассчитан на ту же платформу, где был записан: при другом порядке байт
+// или другой версии формата он просто игнорируется.
+
+enum class SceneCacheSection : uint32_t {
+  kVertices,
+  kNormals,
+  kMaterials,
+  kTriangles,
+  kSpheres,
+  kLights,
+  kStrings,
+  kDependencies,
+  kBvhNodes,
+  kBvhPrimitives,
+  kTriangleOrder,
+  kCount
+};
+
+struct SceneCacheSectionInfo {
+  uint64_t offset = 0;
+  uint64_t count = 0;
+};
+
+struct SceneCacheHeader {
+  static constexpr std::array<char, 8> kMagic = {'R', 'T', 'S', 'C',
+                                                 'E', 'N', 'E', '\0'};
+  static constexpr uint32_t kVersion = 3;
+  static constexpr uint32_t kByteOrderMark = 0x01020304;
+
+  std::array<char, 8> magic = kMagic;
+  uint32_t version = kVersion;
+  uint32_t byte_order_mark = kByteOrderMark;
+  uint32_t has_bvh = 0;
+  uint32_t bvh_split_method = 0;
+  uint32_t bvh_sphere_accelerator = 0;
+  uint32_t reserved = 0;
+  uint64_t bvh_max_leaf_size = 0;
+  uint64_t bvh_bin_count = 0;
+  double bvh_traversal_cost = 0.0;
+  double bvh_intersection_cost = 0.0;
+  std::array<SceneCacheSectionInfo,
+             static_cast<size_t>(SceneCacheSection::kCount)>
+      sections = {};
+};
+
+// Строки (имена материалов и файлов) лежат в секции kStrings
+struct SceneCacheString {
+  uint32_t offset = 0;
+  uint32_t length = 0;
+};
+
+struct SceneCacheMaterial {
+  SceneCacheString name;
+  Vector ambient_color;
+  Vector diffuse_color;
+  Vector specular_color;
+  Vector intensity;
+  double specular_exponent;
+  double refraction_index;
+  Vector albedo;
+};
+
+// Материал объекта - номер в секции kMaterials
+constexpr uint32_t kSceneCacheNoMaterial = std::numeric_limits<uint32_t>::max();
+
+struct SceneCacheTriangle {
+  Triangle polygon;
+  std::array<int, 3> normal_indices;
+  std::array<int, 3> vertex_indices;
+  uint32_t material;
+};
+
+struct SceneCacheSphere {
+  Sphere sphere;
+  uint32_t material;
+};
+
+// Файл, из которого собрана сцена: сам .obj и подключённые .mtl
+struct SceneCacheDependency {
+  SceneCacheString path;
+  uint64_t size;
+  int64_t write_time;
+};
+
+static_assert(std::is_trivially_copyable_v<Vector>);
+static_assert(std::is_trivially_copyable_v<Light>);
+static_assert(std::is_trivially_copyable_v<SceneCacheTriangle>);
+static_assert(std::is_trivially_copyable_v<SceneCacheSphere>);
+static_assert(std::is_trivially_copyable_v<SceneCacheMaterial>);
+static_assert(std::is_trivially_copyable_v<BvhNode>);
+static_assert(std::is_trivially_copyable_v<BvhPrimitive>);
+
+std::filesystem::path GetSceneCachePath(const std::filesystem::path &path) {
+  auto cache_path = path;
+  cache_path += ".rtcache";
+  return cache_path;
+}
+
+std::optional<SceneCacheDependency>
+GetSceneCacheDependency(const std::filesystem::path &path) {
+  std::error_code error;
+  auto size = std::filesystem::file_size(path, error);
+  if (error) {
+    return std::nullopt;
+  }
+  auto write_time = std::filesystem::last_write_time(path, error);
+  if (error) {
+    return std::nullopt;
+  }
+  return SceneCacheDependency{
+      {}, size, static_cast<int64_t>(write_time.time_since_epoch().count())};
+}
+
+class SceneCacheWriter {
+public:
+  template <class T>
+  void AddSection(SceneCacheSection section, const std::vector<T> &records) {
+    static_assert(std::is_trivially_copyable_v<T>);
+    size_t begin = (data_.size() + kCacheLineSize - 1) / kCacheLineSize *
+                   kCacheLineSize;
+    data_.resize(begin + records.size() * sizeof(T));
+    if (!records.empty()) {
+      std::memcpy(data_.data() + begin, records.data(),
+                  records.size() * sizeof(T));
+    }
+    header_.sections[static_cast<size_t>(section)] = {begin, records.size()};
+  }
+
+  SceneCacheString AddString(const std::string &value) {
+    SceneCacheString result{static_cast<uint32_t>(strings_.size()),
+                            static_cast<uint32_t>(value.size())};
+    strings_.insert(strings_.end(), value.begin(), value.end());
+    return result;
+  }
+
+  SceneCacheHeader &GetHeader() { return header_; }
+
+  // Пишет во временный файл и переименовывает его, так что параллельно
+  // читающие процессы видят либо старый кэш, либо новый целиком
+  bool Write(const std::filesystem::path &path) {
+    AddSection(SceneCacheSection::kStrings, strings_);
+    std::memcpy(data_.data(), &header_, sizeof(header_));
+
+    auto unique = std::hash<std::thread::id>{}(std::this_thread::get_id()) ^
+                  std::chrono::steady_clock::now().time_since_epoch().count();
+    auto temp_path = path;
+    temp_path += ".tmp" + std::to_string(unique);
+
+    std::ofstream out(temp_path, std::ios::binary);
+    out.write(data_.data(), data_.size());
+    out.close();
+
+    std::error_code error;
+    if (out) {
+      std::filesystem::rename(temp_path, path, error);
+      if (!error) {
+        return true;
+      }
+    }
+    std::filesystem::remove(temp_path, error);
+    return false;
+  }
+
+private:
+  static constexpr size_t kCacheLineSize = 64;
+
+  SceneCacheHeader header_;
+  std::vector<char> data_ = std::vector<char>(sizeof(SceneCacheHeader));
+  std::vector<char> strings_;
+};
+
+// dependencies - файлы, из которых прочитана сцена, первым идёт сам .obj
+bool SaveSceneCache(const Scene &scene,
+                    const std::vector<std::filesystem::path> &dependencies,
+                    bool store_bvh) {
+  SceneCacheWriter writer;
+
+  std::vector<SceneCacheDependency> dependency_records;
+  auto directory = dependencies.front().parent_path();
+  for (const auto &path : dependencies) {
+    auto dependency = GetSceneCacheDependency(path);
+    if (!dependency) {
+      return false;
+    }
+    // Пути хранятся относительно каталога .obj, как в mtllib
+    dependency->path =
+        writer.AddString(path.lexically_relative(directory).string());
+    dependency_records.push_back(*dependency);
+  }
+
+  std::vector<SceneCacheMaterial> materials;
+  std::unordered_map<const Material *, uint32_t> material_ids;
+  for (const auto &[name, material] : scene.GetMaterials()) {
+    material_ids[&material] = materials.size();
+    materials.push_back({writer.AddString(name), material.ambient_color,
+                         material.diffuse_color, material.specular_color,
+                         material.intensity, material.specular_exponent,
+                         material.refraction_index, material.albedo});
+  }
+  auto get_material_id = [&](const Material *material) {
+    return material ? material_ids.at(material) : kSceneCacheNoMaterial;
+  };
+
+  std::vector<SceneCacheTriangle> triangles;
+  triangles.reserve(scene.GetObjects().size());
+  for (const Object &obj : scene.GetObjects()) {
+    triangles.push_back({obj.polygon, obj.normal_indices, obj.vertex_indices,
+                         get_material_id(obj.material)});
+  }
+
+  std::vector<SceneCacheSphere> spheres;
+  spheres.reserve(scene.GetSphereObjects().size());
+  for (const SphereObject &obj : scene.GetSphereObjects()) {
+    spheres.push_back({obj.sphere, get_material_id(obj.material)});
+  }
+
+  writer.AddSection(SceneCacheSection::kVertices, scene.GetVertices());
+  writer.AddSection(SceneCacheSection::kNormals, scene.GetNormals());
+  writer.AddSection(SceneCacheSection::kMaterials, materials);
+  writer.AddSection(SceneCacheSection::kTriangles, triangles);
+  writer.AddSection(SceneCacheSection::kSpheres, spheres);
+  writer.AddSection(SceneCacheSection::kLights, scene.GetLights());
+  writer.AddSection(SceneCacheSection::kDependencies, dependency_records);
+
+  if (store_bvh) {
+    const Bvh &bvh = scene.GetBvh();
+    const BvhOptions &options = bvh.GetOptions();
+    SceneCacheHeader &header = writer.GetHeader();
+    header.has_bvh = 1;
+    header.bvh_split_method = static_cast<uint32_t>(options.split_method);
+    header.bvh_sphere_accelerator =
+        static_cast<uint32_t>(options.sphere_accelerator);
+    header.bvh_max_leaf_size = options.max_leaf_size;
+    header.bvh_bin_count = options.bin_count;
+    header.bvh_traversal_cost = options.traversal_cost;
+    header.bvh_intersection_cost = options.intersection_cost;
+
+    writer.AddSection(SceneCacheSection::kBvhNodes, bvh.GetNodes());
+    writer.AddSection(SceneCacheSection::kBvhPrimitives, bvh.GetPrimitives());
+    writer.AddSection(SceneCacheSection::kTriangleOrder,
+                      scene.GetTriangleOrder());
+  }
+
+  return writer.Write(GetSceneCachePath(dependencies.front()));
+}
+
+class SceneCacheReader {
+public:
+  explicit SceneCacheReader(const std::filesystem::path &path) : file_(path) {}
+
+  bool ReadHeader() {
+    if (file_.Size() < sizeof(header_)) {
+      return false;
+    }
+    std::memcpy(&header_, file_.Data(), sizeof(header_));
+    return header_.magic == SceneCacheHeader::kMagic &&
+           header_.version == SceneCacheHeader::kVersion &&
+           header_.byte_order_mark == SceneCacheHeader::kByteOrderMark;
+  }
+
+  const SceneCacheHeader &GetHeader() const { return header_; }
+
+  // Записи секции прямо в отображённом файле: секции выровнены по
+  // кэш-линии, а отображение - по странице. Пустой optional, если секция
+  // выходит за пределы файла.
+  template <class T>
+  std::optional<std::span<const T>>
+  ViewSection(SceneCacheSection section) const {
+    static_assert(std::is_trivially_copyable_v<T>);
+    const auto &info = header_.sections[static_cast<size_t>(section)];
+    if (info.offset > file_.Size() ||
+        info.count > (file_.Size() - info.offset) / sizeof(T) ||
+        info.offset % alignof(T) != 0) {
+      return std::nullopt;
+    }
+    return std::span<const T>(
+        reinterpret_cast<const T *>(file_.Data() + info.offset), info.count);
+  }
+
+  // Копия секции для данных, которыми сцена владеет сама
+  template <class T>
+  std::optional<std::vector<T>> ReadSection(SceneCacheSection section) const {
+    auto records = ViewSection<T>(section);
+    if (!records) {
+      return std::nullopt;
+    }
+    return std::vector<T>(records->begin(), records->end());
+  }
+
+private:
+  MappedFile file_;
+  SceneCacheHeader header_;
+};
+
+bool IsValidBvh(const std::vector<BvhNode> &nodes,
+                const std::vector<BvhPrimitive> &primitives,
+                const std::vector<uint32_t> &triangle_order,
+                size_t triangle_count, size_t sphere_count) {
+  if (triangle_order.size() != triangle_count) {
+    return false;
+  }
+  for (uint32_t index : triangle_order) {
+    if (index >= triangle_count) {
+      return false;
+    }
+  }
+  for (const BvhPrimitive &primitive : primitives) {
+    size_t count = primitive.kind == PrimitiveKind::kTriangle ? triangle_count
+                   : primitive.kind == PrimitiveKind::kSphere ? sphere_count
+                                                              : 0;
+    if (primitive.index >= count) {
+      return false;
+    }
+  }
+  if (nodes.empty()) {
+    return primitives.empty();
+  }
+
+  // Обход от корня: глубина не больше, чем вмещает стек обхода Bvh, а
+  // каждый узел и каждый примитив достижимы ровно один раз
+  std::vector<bool> node_seen(nodes.size());
+  std::vector<bool> primitive_seen(primitives.size());
+  size_t seen_nodes = 0;
+  size_t seen_primitives = 0;
+  std::vector<std::pair<size_t, size_t>> stack = {{0, 0}};
+  while (!stack.empty()) {
+    auto [index, depth] = stack.back();
+    stack.pop_back();
+    if (depth >= Bvh::kMaxDepth || node_seen[index]) {
+      return false;
+    }
+    node_seen[index] = true;
+    ++seen_nodes;
+
+    const BvhNode &node = nodes[index];
+    if (node.IsLeaf()) {
+      if (node.offset > primitives.size() ||
+          node.count > primitives.size() - node.offset) {
+        return false;
+      }
+      for (size_t i = node.offset; i < node.offset + node.count; ++i) {
+        if (primitive_seen[i]) {
+          return false;
+        }
+        primitive_seen[i] = true;
+        ++seen_primitives;
+      }
+    } else {
+      if (index + 1 >= nodes.size() || node.offset <= index + 1 ||
+          node.offset >= nodes.size()) {
+        return false;
+      }
+      stack.push_back({index + 1, depth + 1});
+      stack.push_back({node.offset, depth + 1});
+    }
+  }
+  return seen_nodes == nodes.size() && seen_primitives == primitives.size();
+}
+
+// Пустой optional, если кэша нет, он устарел или повреждён
+std::optional<Scene> LoadSceneCache(const std::filesystem::path &path,
+                                    const BvhOptions &bvh_options) {
+  auto cache_path = GetSceneCachePath(path);
+  std::error_code error;
+  if (!std::filesystem::is_regular_file(cache_path, error)) {
+    return std::nullopt;
+  }
+
+  try {
+    SceneCacheReader reader(cache_path);
+    if (!reader.ReadHeader()) {
+      return std::nullopt;
+    }
+
+    auto strings = reader.ViewSection<char>(SceneCacheSection::kStrings);
+    auto dependencies = reader.ViewSection<SceneCacheDependency>(
+        SceneCacheSection::kDependencies);
+    if (!strings || !dependencies || dependencies->empty()) {
+      return std::nullopt;
+    }
+    auto get_string = [&](const SceneCacheString &value)
+        -> std::optional<std::string> {
+      if (value.offset > strings->size() ||
+          value.length > strings->size() - value.offset) {
+        return std::nullopt;
+      }
+      return std::string(strings->data() + value.offset, value.length);
+    };
+
+    // Кэш годен, только пока ни один исходный файл не изменился
+    for (size_t i = 0; i < dependencies->size(); ++i) {
+      const auto &record = (*dependencies)[i];
+      auto name = get_string(record.path);
+      if (!name) {
+        return std::nullopt;
+      }
+      auto dependency_path =
+          i == 0 ? path : path.parent_path() / std::filesystem::path(*name);
+      auto current = GetSceneCacheDependency(dependency_path);
+      if (!current || current->size != record.size ||
+          current->write_time != record.write_time) {
+        return std::nullopt;
+      }
+    }
+
+    auto vertices = reader.ReadSection<Vector>(SceneCacheSection::kVertices);
+    auto normals = reader.ReadSection<Vector>(SceneCacheSection::kNormals);
+    auto materials =
+        reader.ViewSection<SceneCacheMaterial>(SceneCacheSection::kMaterials);
+    auto triangles =
+        reader.ViewSection<SceneCacheTriangle>(SceneCacheSection::kTriangles);
+    auto spheres =
+        reader.ViewSection<SceneCacheSphere>(SceneCacheSection::kSpheres);
+    auto lights = reader.ReadSection<Light>(SceneCacheSection::kLights);
+    if (!vertices || !normals || !materials || !triangles || !spheres ||
+        !lights) {
+      return std::nullopt;
+    }
+
+    Scene scene;
+    std::vector<std::string> material_names;
+    for (const SceneCacheMaterial &record : *materials) {
+      auto name = get_string(record.name);
+      if (!name) {
+        return std::nullopt;
+      }
+      Material material{*name,
+                        record.ambient_color,
+                        record.diffuse_color,
+                        record.specular_color,
+                        record.intensity,
+                        record.specular_exponent,
+                        record.refraction_index,
+                        record.albedo};
+      scene.AddMaterial(*name, material);
+      material_names.push_back(std::move(*name));
+    }
+
+    // Указатели берутся после того, как все материалы добавлены
+    std::vector<const Material *> material_ptrs;
+    for (const auto &name : material_names) {
+      material_ptrs.push_back(&scene.GetMaterials().at(name));
+    }
+    auto get_material = [&](uint32_t id, const Material *&material) {
+      if (id == kSceneCacheNoMaterial) {
+        material = nullptr;
+        return true;
+      }
+      if (id >= material_ptrs.size()) {
+        return false;
+      }
+      material = material_ptrs[id];
+      return true;
+    };
+
+    std::vector<Object> objects(triangles->size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+      const SceneCacheTriangle &record = (*triangles)[i];
+      Object &obj = objects[i];
+      obj.polygon = record.polygon;
+      obj.normal_indices = record.normal_indices;
+      obj.vertex_indices = record.vertex_indices;
+      for (int index : obj.normal_indices) {
+        if (index != Object::kNoNormal &&
+            (index < 0 || static_cast<size_t>(index) >= normals->size())) {
+          return std::nullopt;
+        }
+      }
+      for (int index : obj.vertex_indices) {
+        if (index != Object::kNoVertex &&
+            (index < 0 || static_cast<size_t>(index) >= vertices->size())) {
+          return std::nullopt;
+        }
+      }
+      if (!get_material(record.material, obj.material)) {
+        return std::nullopt;
+      }
+    }
+
+    std::vector<SphereObject> sphere_objects(spheres->size());
+    for (size_t i = 0; i < sphere_objects.size(); ++i) {
+      sphere_objects[i].sphere = (*spheres)[i].sphere;
+      if (!get_material((*spheres)[i].material, sphere_objects[i].material)) {
+        return std::nullopt;
+      }
+    }
+
+    scene.AddObjects(std::move(objects));
+    scene.AddSphereObjects(std::move(sphere_objects));
+
+    for (const Light &light : *lights) {
+      scene.AddLight(light);
+    }
+    scene.AddVertices(std::move(*vertices));
+    scene.AddNormals(std::move(*normals));
+
+    const SceneCacheHeader &header = reader.GetHeader();
+    BvhOptions stored_options{
+        .split_method = static_cast<BvhSplitMethod>(header.bvh_split_method),
+        .max_leaf_size = header.bvh_max_leaf_size,
+        .bin_count = header.bvh_bin_count,
+        .traversal_cost = header.bvh_traversal_cost,
+        .intersection_cost = header.bvh_intersection_cost,
+        .threads = bvh_options.threads,
+        .max_refit_cost_ratio = bvh_options.max_refit_cost_ratio,
+        .compressed_nodes = bvh_options.compressed_nodes,
+        .sphere_accelerator =
+            static_cast<SphereAccelerator>(header.bvh_sphere_accelerator)};
+
+    std::optional<std::vector<BvhNode>> nodes;
+    std::optional<std::vector<BvhPrimitive>> primitives;
+    std::optional<std::vector<uint32_t>> triangle_order;
+    if (header.has_bvh && stored_options == bvh_options) {
+      nodes = reader.ReadSection<BvhNode>(SceneCacheSection::kBvhNodes);
+      primitives =
+          reader.ReadSection<BvhPrimitive>(SceneCacheSection::kBvhPrimitives);
+      triangle_order =
+          reader.ReadSection<uint32_t>(SceneCacheSection::kTriangleOrder);
+    }
+
+    if (nodes && primitives && triangle_order &&
+        IsValidBvh(*nodes, *primitives, *triangle_order,
+                   scene.GetObjects().size(),
+                   scene.GetSphereObjects().size())) {
+      scene.SetAccelerator(
+          Bvh(std::move(*nodes), std::move(*primitives), stored_options),
+          std::move(*triangle_order));
+    } else {
+      scene.BuildAccelerator(bvh_options);
+    }
+
+    return scene;
+  } catch (const std::exception &) {
+    return std::nullopt;
+  }
+}
+
+// Читает сцену из .obj или из кэша рядом с ним, если тот не устарел.
+// Ошибки записи кэша не считаются ошибками чтения сцены.
+Scene ReadScene(const std::filesystem::path &path,
+                const BvhOptions &bvh_options = {},
+                const SceneCacheOptions &cache_options = {}) {
+  if (cache_options.mode != SceneCacheMode::kDisabled) {
+    if (auto scene = LoadSceneCache(path, bvh_options)) {
+      return std::move(*scene);
+    }
+  }
+
+  std::vector<std::filesystem::path> dependencies = {path};
+  Scene scene = ParseScene(path, dependencies);
+  scene.BuildAccelerator(bvh_options);
+
+  // Меши экземпляров кэш не хранит
+  if (cache_options.mode == SceneCacheMode::kReadWrite &&
+      scene.GetMeshes().empty()) {
+    SaveSceneCache(scene, dependencies, cache_options.store_bvh);
+  }
+
+  return scene;
+}
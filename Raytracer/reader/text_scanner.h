@@ -0,0 +1,92 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <string_view>
+#include <system_error>
+
+// Разбор текста без выделения памяти: строки и токены - это string_view
+// внутри исходного буфера, числа читаются через std::from_chars.
+
+class LineScanner {
+public:
+  explicit LineScanner(std::string_view text) : text_(text) {}
+
+  bool NextLine(std::string_view &line) {
+    if (position_ >= text_.size()) {
+      return false;
+    }
+
+    size_t end = text_.find('\n', position_);
+    if (end == std::string_view::npos) {
+      end = text_.size();
+    }
+    line = text_.substr(position_, end - position_);
+    position_ = end + 1;
+    return true;
+  }
+
+private:
+  std::string_view text_;
+  size_t position_ = 0;
+};
+
+class TokenScanner {
+public:
+  explicit TokenScanner(std::string_view line) : line_(line) {}
+
+  // Пустой string_view, если токены закончились
+  std::string_view NextToken() {
+    while (position_ < line_.size() && IsSpace(line_[position_])) {
+      ++position_;
+    }
+    size_t begin = position_;
+    while (position_ < line_.size() && !IsSpace(line_[position_])) {
+      ++position_;
+    }
+    return line_.substr(begin, position_ - begin);
+  }
+
+  // Остаток строки без ведущих пробелов
+  std::string_view Rest() {
+    while (position_ < line_.size() && IsSpace(line_[position_])) {
+      ++position_;
+    }
+    return line_.substr(position_);
+  }
+
+  double NextDouble() { return ParseDouble(NextToken()); }
+
+  template <class... Values> void ReadDoubles(Values &...values) {
+    ((values = NextDouble()), ...);
+  }
+
+  static bool IsSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+  }
+
+  // Некорректное число читается как 0, как и при разборе через поток
+  static double ParseDouble(std::string_view token) {
+    if (!token.empty() && token.front() == '+') {
+      token.remove_prefix(1);
+    }
+    double value = 0.0;
+    auto result = std::from_chars(token.data(), token.data() + token.size(),
+                                  value);
+    return result.ec == std::errc{} ? value : 0.0;
+  }
+
+  static int ParseInt(std::string_view token) {
+    if (!token.empty() && token.front() == '+') {
+      token.remove_prefix(1);
+    }
+    int value = 0;
+    auto result = std::from_chars(token.data(), token.data() + token.size(),
+                                  value);
+    return result.ec == std::errc{} ? value : 0;
+  }
+
+private:
+  std::string_view line_;
+  size_t position_ = 0;
+};
@@ -4,24 +4,80 @@
 #include "../utils/image.h"
 #include "test_cases/commons.h"
 
+#include <algorithm>
+#include <bit>
 #include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
 #include <numbers>
+#include <numeric>
 #include <optional>
+#include <random>
+#include <set>
+#include <span>
+#include <stdexcept>
+#include <string>
 #include <string_view>
+#include <system_error>
+#include <thread>
 
-void CheckImage(std::string_view obj_filename, std::string_view result_filename,
+const auto kTestsDir = std::filesystem::current_path() / "test_case";
+
+void CheckImage(const PreparedScene &scene, std::string_view result_filename,
                 const CameraOptions &camera_options,
                 const RenderOptions &render_options,
                 const std::optional<std::filesystem::path> &output_path =
                     std::filesystem::current_path() / "output.png") {
-  static const auto kTestsDir = std::filesystem::current_path() / "test_case";
-  auto image = Render(kTestsDir / obj_filename, camera_options, render_options);
+  auto image = Render(scene, camera_options, render_options);
   if (output_path) {
     image.Write(*output_path);
   }
   Compare(image, Image{kTestsDir / result_filename});
 }
 
+void CheckImage(std::string_view obj_filename, std::string_view result_filename,
+                const CameraOptions &camera_options,
+                const RenderOptions &render_options,
+                const std::optional<std::filesystem::path> &output_path =
+                    std::filesystem::current_path() / "output.png") {
+  CheckImage(PreparedScene{kTestsDir / obj_filename}, result_filename,
+             camera_options, render_options, output_path);
+}
+
+// Временная папка для файлов теста, например собранных в нём сцен, с
+// общим scene.mtl (материалы white и mirror). Имя уникально, поэтому
+// тесты, запущенные одновременно, не мешают друг другу; папка удаляется
+// вместе с объектом.
+class TempSceneDir {
+public:
+  explicit TempSceneDir(std::string_view name) {
+    std::random_device random;
+    do {
+      path_ = std::filesystem::temp_directory_path() /
+              ("raytracer_" + std::string(name) + "_" +
+               std::to_string(random()));
+    } while (!std::filesystem::create_directory(path_));
+    std::ofstream{path_ / "scene.mtl"} << "newmtl white\nKd 0.7 0.7 0.7\n"
+                                          "newmtl mirror\nKd 0.5 0.4 0.3\n"
+                                          "Ks 0.5 0.5 0.5\nNs 20\n"
+                                          "al 0.6 0.4 0\n";
+  }
+
+  TempSceneDir(const TempSceneDir &) = delete;
+  TempSceneDir &operator=(const TempSceneDir &) = delete;
+
+  ~TempSceneDir() {
+    std::error_code error;
+    std::filesystem::remove_all(path_, error);
+  }
+
+  const std::filesystem::path &GetPath() const { return path_; }
+
+private:
+  std::filesystem::path path_;
+};
+
 void run_shading_parts_test() {
   CameraOptions camera_opts{640, 480};
   return CheckImage("shading_parts/scene.obj", "shading_parts/scene.png",
@@ -56,16 +112,23 @@ void run_box_with_spheres_test() {
 }
 
 void run_classic_box_test() {
-  CameraOptions camera_opts{.screen_width = 500,
-                            .screen_height = 500,
-                            .look_from = {-.5, 1.5, .98},
-                            .look_to = {0., 1., 0.}};
-  CheckImage("classic_box/CornellBox.obj", "classic_box/first.png", camera_opts,
-             {4});
-  camera_opts.look_from = {-.9, 1.9, -1};
-  camera_opts.look_to = {0., 0., 0.};
-  CheckImage("classic_box/CornellBox.obj", "classic_box/second.png",
-             camera_opts, {4});
+  PreparedScene scene{kTestsDir / "classic_box/CornellBox.obj"};
+
+  CameraOptions first_opts{.screen_width = 500,
+                           .screen_height = 500,
+                           .look_from = {-.5, 1.5, .98},
+                           .look_to = {0., 1., 0.}};
+  CameraOptions second_opts = first_opts;
+  second_opts.look_from = {-.9, 1.9, -1};
+  second_opts.look_to = {0., 0., 0.};
+
+  // Одна подготовленная сцена, два ракурса одновременно
+  std::thread second{[&] {
+    CheckImage(scene, "classic_box/second.png", second_opts, {4},
+               std::nullopt);
+  }};
+  CheckImage(scene, "classic_box/first.png", first_opts, {4});
+  second.join();
 }
 
 void run_mirrors_test() {
@@ -93,6 +156,1179 @@ void run_deer_test() {
   CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, {1});
 }
 
+void run_bvh_builders_test() {
+  for (auto path : {"classic_box/CornellBox.obj", "deer/CERF_Free.obj"}) {
+    BvhOptions median{.split_method = BvhSplitMethod::kMedian};
+    BvhOptions sah{.split_method = BvhSplitMethod::kSah, .max_leaf_size = 2};
+
+    auto median_stats = ReadScene(kTestsDir / path, median).GetBvh().GetStats();
+    auto sah_stats = ReadScene(kTestsDir / path, sah).GetBvh().GetStats();
+
+    assert(median_stats.max_leaf_size <= median.max_leaf_size);
+    assert(sah_stats.max_leaf_size <= sah.max_leaf_size);
+    assert(median_stats.primitive_count == sah_stats.primitive_count);
+    assert(sah_stats.sah_cost <= median_stats.sah_cost);
+  }
+
+  CameraOptions camera_opts{.screen_width = 500,
+                            .screen_height = 500,
+                            .look_from = {-.5, 1.5, .98},
+                            .look_to = {0., 1., 0.}};
+  CheckImage("classic_box/CornellBox.obj", "classic_box/first.png", camera_opts,
+             {.depth = 4, .bvh = {.split_method = BvhSplitMethod::kMedian}});
+  CheckImage("classic_box/CornellBox.obj", "classic_box/first.png", camera_opts,
+             {.depth = 4, .bvh = {.split_method = BvhSplitMethod::kLbvh}});
+}
+
+// Обходит дерево и проверяет, что каждый узел и каждый примитив
+// достижимы ровно один раз
+void CheckBvhLayout(const Bvh &bvh) {
+  const auto &nodes = bvh.GetNodes();
+  std::vector<int> node_visits(nodes.size());
+  std::vector<int> primitive_visits(bvh.GetPrimitives().size());
+  std::vector<uint32_t> stack = {0};
+  while (!nodes.empty() && !stack.empty()) {
+    uint32_t index = stack.back();
+    stack.pop_back();
+    ++node_visits[index];
+    const BvhNode &node = nodes[index];
+    if (node.IsLeaf()) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+        ++primitive_visits[i];
+      }
+    } else {
+      stack.push_back(index + 1);
+      stack.push_back(node.offset);
+    }
+  }
+  assert(std::ranges::all_of(node_visits, [](int v) { return v == 1; }));
+  assert(std::ranges::all_of(primitive_visits, [](int v) { return v == 1; }));
+}
+
+void run_lbvh_test() {
+  auto same_nodes = [](const Bvh &lhs, const Bvh &rhs) {
+    const auto &a = lhs.GetNodes();
+    const auto &b = rhs.GetNodes();
+    for (size_t i = 0; i < a.size() && a.size() == b.size(); ++i) {
+      if (a[i].offset != b[i].offset || a[i].count != b[i].count ||
+          !(a[i].bounds.GetMin() == b[i].bounds.GetMin()) ||
+          !(a[i].bounds.GetMax() == b[i].bounds.GetMax())) {
+        return false;
+      }
+    }
+    return a.size() == b.size();
+  };
+
+  {
+    std::mt19937_64 generator(7);
+    std::vector<uint64_t> keys(100000);
+    for (uint64_t &key : keys) {
+      // Мало различных ключей, чтобы проверить устойчивость
+      key = generator() % 1000 << 40;
+    }
+    std::vector<uint32_t> values(keys.size());
+    std::iota(values.begin(), values.end(), 0);
+    auto expected = values;
+    std::ranges::stable_sort(expected, {}, [&](uint32_t i) { return keys[i]; });
+
+    ThreadPool pool(3);
+    ParallelRadixSort(keys, values, 64, pool);
+    assert(std::ranges::is_sorted(keys));
+    assert(values == expected);
+  }
+
+  for (auto path : {"classic_box/CornellBox.obj", "deer/CERF_Free.obj",
+                    "mirrors/scene.obj"}) {
+    BvhOptions sequential{.split_method = BvhSplitMethod::kLbvh, .threads = 1};
+    BvhOptions parallel{.split_method = BvhSplitMethod::kLbvh, .threads = 3};
+    Scene scene = ReadScene(kTestsDir / path, sequential);
+    Scene parallel_scene = ReadScene(kTestsDir / path, parallel);
+    const Bvh &bvh = scene.GetBvh();
+
+    auto stats = bvh.GetStats();
+    auto sah_stats = ReadScene(kTestsDir / path).GetBvh().GetStats();
+    assert(stats.primitive_count == sah_stats.primitive_count);
+    assert(stats.max_leaf_size <= sequential.max_leaf_size);
+    CheckBvhLayout(bvh);
+    assert(same_nodes(bvh, parallel_scene.GetBvh()));
+
+    const auto &primitives = bvh.GetPrimitives();
+    for (const BvhNode &node : bvh.GetNodes()) {
+      if (node.IsLeaf()) {
+        auto leaf = std::span(primitives).subspan(node.offset, node.count);
+        assert(std::ranges::is_partitioned(leaf, [](const BvhPrimitive &p) {
+          return p.kind == PrimitiveKind::kTriangle;
+        }));
+      }
+    }
+  }
+
+  // Цепочка точек, коды Мортона которых отличаются всё более младшим
+  // битом, и пачка совпадающих точек дают дерево глубже kMaxDepth: лишние
+  // уровни сворачиваются в лист, а дыры в массиве узлов убираются
+  const double scale = (1 << kMortonBitsPerAxis) - 1;
+  std::vector<SphereObject> spheres = {Sphere{{1., 1., 1.}, 1e-9}};
+  for (size_t bit = 0; bit < 3 * kMortonBitsPerAxis; ++bit) {
+    Vector center;
+    center[bit % 3] = ((1 << (kMortonBitsPerAxis - 1 - bit / 3)) + .5) / scale;
+    spheres.push_back(Sphere{center, 1e-9});
+  }
+  for (size_t i = 0; i < 1000; ++i) {
+    spheres.push_back(Sphere{{0., 0., 0.}, 1e-9});
+  }
+  Bvh deep({}, spheres, {.split_method = BvhSplitMethod::kLbvh,
+                         .max_leaf_size = 1});
+  assert(deep.GetStats().primitive_count == spheres.size());
+  assert(deep.GetStats().max_depth < Bvh::kMaxDepth);
+  CheckBvhLayout(deep);
+}
+
+void run_multithreaded_render_test() {
+  CameraOptions camera_opts{.screen_width = 800,
+                            .screen_height = 600,
+                            .look_from = {2., 1.5, -.1},
+                            .look_to = {1., 1.2, -2.8}};
+
+  PreparedScene scene{kTestsDir / "mirrors/scene.obj"};
+  auto single = Render(scene, camera_opts, {.depth = 9, .threads = 1});
+  auto multi = Render(scene, camera_opts, {.depth = 9, .threads = 8});
+
+  for (auto y : std::views::iota(0, single.Height())) {
+    for (auto x : std::views::iota(0, single.Width())) {
+      auto lhs = single.GetPixel(y, x);
+      auto rhs = multi.GetPixel(y, x);
+      assert(lhs.r == rhs.r && lhs.g == rhs.g && lhs.b == rhs.b);
+    }
+  }
+}
+
+void run_triangle_kernels_test() {
+  auto scene = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+  const auto &store = scene.GetTriangles();
+  CameraOptions camera_opts{.screen_width = 64,
+                            .screen_height = 64,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+
+  for (auto kind : {TriangleKernelKind::kAvx2, TriangleKernelKind::kAvx512}) {
+    if (!IsTriangleKernelSupported(kind)) {
+      continue;
+    }
+    auto kernel = GetTriangleKernel(kind);
+
+    for (auto y : std::views::iota(0, camera_opts.screen_height)) {
+      for (auto x : std::views::iota(0, camera_opts.screen_width)) {
+        auto ray = CameraRay(camera_opts, x, y);
+        // Диапазоны разной длины и с разным выравниванием начала
+        for (uint32_t first = x % 7; first < store.Size(); first += 97) {
+          uint32_t count = std::min<uint32_t>(1 + (x + y) % 113,
+                                              store.Size() - first);
+          TriangleBatchHit expected, actual;
+          bool expected_found = IntersectTrianglesScalar(
+              store, first, count, ray, 1e9, &expected);
+          bool actual_found = kernel(store, first, count, ray, 1e9, &actual);
+
+          assert(expected_found == actual_found);
+          if (expected_found) {
+            assert(expected.index == actual.index);
+            assert(expected.hit.distance == actual.hit.distance);
+            assert(expected.hit.u == actual.hit.u);
+            assert(expected.hit.v == actual.hit.v);
+          }
+        }
+      }
+    }
+  }
+
+  // То же для ядер одинарной точности
+  FloatTriangleStore float_store(scene.GetObjects(), scene.GetTriangleOrder());
+  for (auto kind : {TriangleKernelKind::kAvx2, TriangleKernelKind::kAvx512}) {
+    if (!IsTriangleKernelSupported(kind)) {
+      continue;
+    }
+    auto kernel = GetTriangleKernel<float>(kind);
+
+    for (auto y : std::views::iota(0, camera_opts.screen_height)) {
+      for (auto x : std::views::iota(0, camera_opts.screen_width)) {
+        FloatRay ray(CameraRay(camera_opts, x, y));
+        for (uint32_t first = x % 7; first < float_store.Size(); first += 97) {
+          uint32_t count = std::min<uint32_t>(1 + (x + y) % 113,
+                                              float_store.Size() - first);
+          TriangleBatchHit expected, actual;
+          bool expected_found = IntersectTrianglesScalar(
+              float_store, first, count, ray, 1e9f, &expected);
+          bool actual_found =
+              kernel(float_store, first, count, ray, 1e9f, &actual);
+
+          assert(expected_found == actual_found);
+          if (expected_found) {
+            assert(expected.index == actual.index);
+            assert(expected.hit.distance == actual.hit.distance);
+            assert(expected.hit.u == actual.hit.u);
+            assert(expected.hit.v == actual.hit.v);
+          }
+        }
+      }
+    }
+  }
+}
+
+void run_compressed_bvh_test() {
+  static_assert(sizeof(CompressedBvhNode) == 64);
+  static_assert(alignof(CompressedBvhNode) == 64);
+
+  CameraOptions deer_camera{.screen_width = 500,
+                            .screen_height = 500,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+  auto deer_path = kTestsDir / "deer/CERF_Free.obj";
+  PreparedScene deer{deer_path, {.compressed_nodes = true}};
+  PreparedScene binary_deer{deer_path};
+  const Bvh &bvh = deer.GetScene().GetBvh();
+  const Bvh &binary = binary_deer.GetScene().GetBvh();
+  assert(bvh.IsCompressed() && bvh.GetNodes().empty());
+  assert(reinterpret_cast<uintptr_t>(bvh.GetCompressedNodes().data()) % 64 ==
+         0);
+  assert(3 * bvh.GetNodeBytes() < binary.GetNodeBytes());
+
+  // Раскодированные коробки содержат свои примитивы, и каждый примитив
+  // лежит ровно в одном листе
+  const auto &objects = deer.GetScene().GetObjects();
+  const auto &order = deer.GetScene().GetTriangleOrder();
+  std::vector<int> primitive_visits(bvh.GetPrimitives().size());
+  for (const CompressedBvhNode &node : bvh.GetCompressedNodes()) {
+    for (size_t child = 0; child < kCompressedBvhWidth; ++child) {
+      if ((node.child_mask >> child & 1) == 0 || !node.IsLeaf(child)) {
+        continue;
+      }
+      BoundingBox bounds = node.GetChildBounds(child);
+      for (uint32_t i = node.child[child];
+           i < node.child[child] + node.count[child]; ++i) {
+        ++primitive_visits[i];
+        BoundingBox triangle = GetBoundingBox(
+            objects[order[bvh.GetPrimitives()[i].index]].polygon);
+        for (size_t axis = 0; axis < 3; ++axis) {
+          assert(bounds.GetMin()[axis] <= triangle.GetMin()[axis]);
+          assert(bounds.GetMax()[axis] >= triangle.GetMax()[axis]);
+        }
+      }
+    }
+  }
+  assert(std::ranges::all_of(primitive_visits, [](int v) { return v == 1; }));
+
+  // SIMD-ядра совпадают со скалярным в обеих точностях
+  CameraOptions kernel_camera = deer_camera;
+  kernel_camera.screen_width = kernel_camera.screen_height = 32;
+  auto check_kernel = [&]<class T>(T t_max) {
+    auto kernel = GetCompressedNodeKernel<T>(DetectTriangleKernel());
+    for (auto y : std::views::iota(0, kernel_camera.screen_height)) {
+      for (auto x : std::views::iota(0, kernel_camera.screen_width)) {
+        BasicBoxRay<T> ray(BasicRay<T>(CameraRay(kernel_camera, x, y)));
+        for (const CompressedBvhNode &node : bvh.GetCompressedNodes()) {
+          std::array<T, kCompressedBvhWidth> expected, actual;
+          uint32_t expected_hit = IntersectCompressedChildrenScalar(
+              node, ray, t_max, expected.data());
+          uint32_t actual_hit = kernel(node, ray, t_max, actual.data());
+          assert(expected_hit == actual_hit);
+          for (; expected_hit != 0; expected_hit &= expected_hit - 1) {
+            size_t child = std::countr_zero(expected_hit);
+            assert(expected[child] == actual[child]);
+          }
+        }
+      }
+    }
+  };
+  check_kernel(1e9);
+  check_kernel(1e9f);
+
+  CheckImage(deer, "deer/result.png", deer_camera, {1});
+  RenderOptions float_opts{1};
+  float_opts.precision = Precision::kFloat;
+  PreparedScene float_deer{deer_path, {.compressed_nodes = true}, {},
+                           Precision::kFloat};
+  assert(float_deer.GetScene().GetBvh().IsCompressed());
+  CheckImage(float_deer, "deer/result.png", deer_camera, float_opts);
+  CheckImage(PreparedScene{kTestsDir / "box/cube.obj",
+                           {.compressed_nodes = true}},
+             "box/cube.png",
+             {.screen_width = 640,
+              .screen_height = 480,
+              .fov = std::numbers::pi / 3,
+              .look_from = {0., .7, 1.75},
+              .look_to = {0., .7, 0.}},
+             {4});
+
+  // Сжатое дерево не подгоняется под новые вершины, а строится заново
+  std::vector<Vector> vertices = deer.GetScene().GetVertices();
+  SceneUpdateStats stats = deer.UpdateVertices(vertices, 1);
+  assert(stats.rebuild_count == 1 && stats.refit_count == 0);
+  assert(bvh.IsCompressed());
+  CheckImage(deer, "deer/result.png", deer_camera, {1});
+}
+
+// Одна и та же сцена с кубами-экземплярами и с кубами, развёрнутыми в
+// обычные грани, рендерится одинаково
+void run_instancing_test() {
+  // Вырожденность проверяется относительно масштаба матрицы
+  Transform tiny({Vector{1e-4, 0., 0.}, {0., 1e-4, 0.}, {0., 0., 1e-4}},
+                 {1., 2., 3.});
+  Vector point(.3, -.2, .7);
+  assert(Length(tiny.Inverse().ApplyToPoint(tiny.ApplyToPoint(point)) -
+                point) < 1e-9);
+  try {
+    Transform({Vector{1., 2., 3.}, {2., 4., 6.}, {0., 0., 1.}}, {}).Inverse();
+    assert(false);
+  } catch (const std::invalid_argument &) {
+  }
+
+  TempSceneDir temp_dir("instancing");
+  const auto &dir = temp_dir.GetPath();
+
+  const std::array<Vector, 8> cube = {
+      Vector{-.5, -.5, -.5}, {.5, -.5, -.5}, {.5, .5, -.5}, {-.5, .5, -.5},
+      {-.5, -.5, .5},        {.5, -.5, .5},  {.5, .5, .5},  {-.5, .5, .5}};
+  const std::array<std::array<int, 4>, 6> faces = {
+      {{1, 4, 3, 2}, {5, 6, 7, 8}, {1, 5, 8, 4},
+       {2, 3, 7, 6}, {1, 2, 6, 5}, {4, 8, 7, 3}}};
+  const std::array<Vector, 6> face_normals = {
+      Vector{0., 0., -1.}, {0., 0., 1.}, {-1., 0., 0.},
+      {1., 0., 0.},        {0., -1., 0.}, {0., 1., 0.}};
+  double angle = std::numbers::pi / 6;
+  const std::vector<Transform> transforms = {
+      Transform({Vector{.5, 0., 0.}, {0., .5, 0.}, {0., 0., .5}},
+                {-1.5, .25, 0.}),
+      Transform({Vector{std::cos(angle), 0., .7 * std::sin(angle)},
+                 {0., .5, 0.},
+                 {-std::sin(angle), 0., .7 * std::cos(angle)}},
+                {0., .25, -.5}),
+      Transform({Vector{1., .3, 0.}, {0., 1., 0.}, {0., 0., 1.}},
+                {1.5, .5, 0.})};
+
+  auto write_floor = [](std::ostream &out, size_t first_vertex) {
+    out << "usemtl white\n"
+           "v -5 0 -5\nv 5 0 -5\nv 5 0 5\nv -5 0 5\n";
+    out << "f " << first_vertex << ' ' << first_vertex + 1 << ' '
+        << first_vertex + 2 << ' ' << first_vertex + 3 << '\n';
+  };
+
+  // Меш с нормалями вершин: после неравномерного масштаба они должны
+  // совпасть с геометрическими нормалями развёрнутых граней
+  {
+    std::ofstream out{dir / "instanced.obj"};
+    out << "mtllib scene.mtl\nP 0 4 3 1 1 1\n";
+    for (const Vector &v : cube) {
+      out << "v " << v[0] << ' ' << v[1] << ' ' << v[2] << '\n';
+    }
+    for (const Vector &n : face_normals) {
+      out << "vn " << n[0] << ' ' << n[1] << ' ' << n[2] << '\n';
+    }
+    out << "mesh cube\nusemtl mirror\n";
+    for (size_t i = 0; i < faces.size(); ++i) {
+      out << 'f';
+      for (int v : faces[i]) {
+        out << ' ' << v << "//" << i + 1;
+      }
+      out << '\n';
+    }
+    out << "endmesh\n";
+    out.precision(17);
+    for (const Transform &transform : transforms) {
+      out << "inst cube";
+      for (size_t row = 0; row < 3; ++row) {
+        const Vector &r = transform.GetRows()[row];
+        out << ' ' << r[0] << ' ' << r[1] << ' ' << r[2] << ' '
+            << transform.GetTranslation()[row];
+      }
+      out << '\n';
+    }
+    out << "inst unknown 1 0 0 0 0 1 0 0 0 0 1 0\n";
+    write_floor(out, cube.size() + 1);
+  }
+  {
+    std::ofstream out{dir / "flat.obj"};
+    out.precision(17);
+    out << "mtllib scene.mtl\nP 0 4 3 1 1 1\nusemtl mirror\n";
+    for (size_t i = 0; i < transforms.size(); ++i) {
+      for (const Vector &v : cube) {
+        Vector p = transforms[i].ApplyToPoint(v);
+        out << "v " << p[0] << ' ' << p[1] << ' ' << p[2] << '\n';
+      }
+      for (const auto &face : faces) {
+        out << 'f';
+        for (int v : face) {
+          out << ' ' << v + i * cube.size();
+        }
+        out << '\n';
+      }
+    }
+    write_floor(out, transforms.size() * cube.size() + 1);
+  }
+
+  PreparedScene instanced{dir / "instanced.obj"};
+  PreparedScene flat{dir / "flat.obj"};
+  const Scene &scene = instanced.GetScene();
+  assert(scene.GetObjects().size() == 2);
+  assert(scene.GetMeshes().size() == 1);
+  assert(scene.GetMeshes()[0].triangles.Size() == 12);
+  assert(scene.GetInstances().size() == transforms.size());
+  assert(flat.GetScene().GetObjects().size() == 2 + 12 * transforms.size());
+
+  CameraOptions camera_opts{.screen_width = 320,
+                            .screen_height = 240,
+                            .look_from = {0., 2., 4.},
+                            .look_to = {0., .3, 0.}};
+  Image expected = Render(flat, camera_opts, {.depth = 4});
+  for (bool ray_packets : {true, false}) {
+    RenderOptions render_opts{.depth = 4};
+    render_opts.ray_packets = ray_packets;
+    Compare(Render(instanced, camera_opts, render_opts), expected);
+  }
+
+  RenderOptions float_opts{.depth = 4};
+  float_opts.precision = Precision::kFloat;
+  PreparedScene float_instanced{dir / "instanced.obj", {}, {},
+                                Precision::kFloat};
+  Compare(Render(float_instanced, camera_opts, float_opts), expected);
+
+  PreparedScene lbvh_instanced{
+      dir / "instanced.obj", {.split_method = BvhSplitMethod::kLbvh}};
+  Compare(Render(lbvh_instanced, camera_opts, {.depth = 4}), expected);
+}
+
+void run_bvh_refit_test() {
+  TempSceneDir temp_dir("refit");
+  const auto &dir = temp_dir.GetPath();
+
+  // Волнистая поверхность из квадратов сетки и два экземпляра куба; в
+  // файле и в сцене вершины идут в одном порядке
+  constexpr int kGrid = 24;
+  std::vector<Vector> vertices;
+  for (int z = 0; z <= kGrid; ++z) {
+    for (int x = 0; x <= kGrid; ++x) {
+      vertices.push_back({-3. + 6. * x / kGrid, 0., -3. + 6. * z / kGrid});
+    }
+  }
+  size_t cube_first = vertices.size();
+  for (int i = 0; i < 8; ++i) {
+    vertices.push_back({i & 1 ? .4 : -.4, i & 2 ? .8 : 0., i & 4 ? .4 : -.4});
+  }
+
+  auto write_scene = [&](const std::filesystem::path &path,
+                         std::span<const Vector> positions) {
+    std::ofstream out{path};
+    out.precision(17);
+    out << "mtllib scene.mtl\nP 0 4 3 1 1 1\n";
+    for (const Vector &v : positions) {
+      out << "v " << v[0] << ' ' << v[1] << ' ' << v[2] << '\n';
+    }
+    out << "usemtl white\n";
+    for (int z = 0; z < kGrid; ++z) {
+      for (int x = 0; x < kGrid; ++x) {
+        int corner = z * (kGrid + 1) + x + 1;
+        out << "f " << corner << ' ' << corner + kGrid + 1 << ' '
+            << corner + kGrid + 2 << ' ' << corner + 1 << '\n';
+      }
+    }
+    out << "mesh cube\nusemtl mirror\n";
+    const std::array<std::array<int, 4>, 6> faces = {
+        {{0, 2, 3, 1}, {4, 5, 7, 6}, {0, 4, 6, 2},
+         {1, 3, 7, 5}, {0, 1, 5, 4}, {2, 6, 7, 3}}};
+    for (const auto &face : faces) {
+      out << 'f';
+      for (int v : face) {
+        out << ' ' << cube_first + v + 1;
+      }
+      out << '\n';
+    }
+    out << "endmesh\n"
+           "inst cube 1 0 0 -1.2 0 1 0 0 0 0 1 0\n"
+           "inst cube 0 0 1 1.2 0 1 0 0 -1 0 0 .5\n";
+  };
+  write_scene(dir / "scene.obj", vertices);
+
+  CameraOptions camera_opts{.screen_width = 160,
+                            .screen_height = 120,
+                            .look_from = {0., 3., 4.},
+                            .look_to = {0., 0., 0.}};
+  // Сцена после UpdateVertices рисуется так же, как прочитанная заново.
+  // Копия, сделанная до обновления, остаётся прежней: обновляется своя
+  // копия сцены, а без других копий - сама сцена на месте.
+  auto check_update = [&](std::span<const Vector> positions,
+                          Precision precision, bool expect_rebuild,
+                          bool keep_copy) {
+    RenderOptions render_opts{.depth = 4};
+    render_opts.precision = precision;
+    PreparedScene scene{dir / "scene.obj", {}, {}, precision};
+    const Scene *original = &scene.GetScene();
+    std::optional<PreparedScene> copy;
+    if (keep_copy) {
+      copy = scene;
+    }
+    SceneUpdateStats stats = scene.UpdateVertices(positions, 1);
+    assert(stats.refit_count + stats.rebuild_count == 2);
+    assert((stats.rebuild_count > 0) == expect_rebuild);
+    assert(scene.GetScene().GetVertices()[0] == positions[0]);
+    assert((&scene.GetScene() == original) == !keep_copy);
+    if (copy) {
+      assert(&copy->GetScene() == original);
+      assert(copy->GetScene().GetVertices()[0] == vertices[0]);
+      Compare(Render(*copy, camera_opts, render_opts),
+              Render(PreparedScene{dir / "scene.obj", {}, {}, precision},
+                     camera_opts, render_opts));
+      // Материалы обновлённой сцены не зависят от старой
+      copy.reset();
+    }
+    if (precision == Precision::kDouble) {
+      CheckBvhLayout(scene.GetScene().GetBvh());
+    }
+    CheckBvhLayout(scene.GetScene().GetMeshes()[0].bvh);
+
+    write_scene(dir / "updated.obj", positions);
+    PreparedScene expected{dir / "updated.obj", {}, {}, precision};
+    Compare(Render(scene, camera_opts, render_opts),
+            Render(expected, camera_opts, render_opts));
+  };
+
+  std::vector<Vector> wave = vertices;
+  for (size_t i = 0; i < cube_first; ++i) {
+    wave[i][1] = .15 * std::sin(2. * wave[i][0]) * std::cos(3. * wave[i][2]);
+  }
+  for (size_t i = cube_first; i < wave.size(); ++i) {
+    wave[i] = 1.1 * wave[i];
+  }
+  check_update(wave, Precision::kDouble, false, true);
+  check_update(wave, Precision::kDouble, false, false);
+  check_update(wave, Precision::kFloat, false, true);
+
+  // Перемешанные вершины: дерево слишком подорожало и строится заново
+  std::vector<Vector> scrambled = vertices;
+  std::mt19937 generator(17);
+  std::shuffle(scrambled.begin(), scrambled.begin() + cube_first, generator);
+  check_update(scrambled, Precision::kDouble, true, false);
+
+  PreparedScene scene{dir / "scene.obj"};
+  bool thrown = false;
+  try {
+    scene.UpdateVertices(std::span{vertices}.first(1));
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
+// Сцена почти из одних сфер: сетка находит те же попадания, что и BVH
+void run_sphere_grid_test() {
+  std::mt19937 generator(5);
+  std::uniform_real_distribution<double> position(-2.0, 2.0);
+  std::uniform_real_distribution<double> radius(0.03, 0.08);
+  std::vector<SphereObject> spheres;
+  for (int i = 0; i < 3000; ++i) {
+    spheres.emplace_back(
+        Sphere({position(generator), position(generator) + 2.0,
+                position(generator)},
+               radius(generator)));
+  }
+
+  SphereGrid grid(spheres);
+  assert(grid.GetCellCount() >= spheres.size());
+  assert(grid.GetReferenceCount() >= spheres.size());
+  // Лучи изнутри и снаружи сетки, в том числе вдоль осей
+  for (int i = 0; i < 2000; ++i) {
+    Vector origin = i % 2 == 0 ? Vector(position(generator),
+                                        position(generator) + 2.0,
+                                        position(generator))
+                               : Vector(6.0, 2.5, position(generator));
+    Vector direction = i % 10 == 1 ? Vector(-1.0, 0.0, 0.0)
+                                   : Vector(position(generator),
+                                            position(generator),
+                                            position(generator));
+    Ray ray(origin, direction.Normalized());
+    double t_max = i % 3 == 0 ? 1.0 : std::numeric_limits<double>::max();
+
+    double expected = t_max;
+    for (const SphereObject &obj : spheres) {
+      auto distance = GetIntersectionDistance(ray, obj.sphere);
+      if (distance.has_value() && *distance < expected) {
+        expected = *distance;
+      }
+    }
+    double actual = t_max;
+    grid.Traverse(ray, actual,
+                  [&](std::span<const uint32_t> indices, double &t) {
+                    for (uint32_t index : indices) {
+                      auto distance =
+                          GetIntersectionDistance(ray, spheres[index].sphere);
+                      if (distance.has_value() && *distance < t) {
+                        t = *distance;
+                      }
+                    }
+                  });
+    assert(actual == expected);
+    bool any = grid.TraverseAny(
+        ray, t_max, [&](std::span<const uint32_t> indices, double t) {
+          return std::ranges::any_of(indices, [&](uint32_t index) {
+            auto distance = GetIntersectionDistance(ray, spheres[index].sphere);
+            return distance.has_value() && *distance < t;
+          });
+        });
+    assert(any == (expected < t_max));
+  }
+
+  // Сетка выбирается для многих сфер близкого размера
+  assert(IsSphereGridSuitable(spheres, 2));
+  assert(!IsSphereGridSuitable(spheres, spheres.size()));
+  assert(!IsSphereGridSuitable({spheres.begin(), spheres.begin() + 100}, 0));
+  std::vector<SphereObject> with_ground = spheres;
+  with_ground.emplace_back(Sphere({0., -1000., 0.}, 1000.));
+  assert(!IsSphereGridSuitable(with_ground, 0));
+
+  TempSceneDir temp_dir("spheres");
+  const auto &dir = temp_dir.GetPath();
+  {
+    std::ofstream out{dir / "scene.obj"};
+    out.precision(17);
+    out << "mtllib scene.mtl\nP 0 6 4 1 1 1\nP 3 3 -3 .5 .5 .5\n"
+           "usemtl white\nv -5 0 -5\nv 5 0 -5\nv 5 0 5\nv -5 0 5\n"
+           "f 1 2 3 4\n";
+    for (size_t i = 0; i < spheres.size(); ++i) {
+      const Sphere &sphere = spheres[i].sphere;
+      out << (i % 2 == 0 ? "usemtl mirror\n" : "usemtl white\n") << "S "
+          << sphere.GetCenter()[0] << ' ' << sphere.GetCenter()[1] << ' '
+          << sphere.GetCenter()[2] << ' ' << sphere.GetRadius() << '\n';
+    }
+  }
+
+  CameraOptions camera_opts{.screen_width = 240,
+                            .screen_height = 180,
+                            .look_from = {0., 3., 6.},
+                            .look_to = {0., 1.5, 0.}};
+  PreparedScene bvh_scene{dir / "scene.obj",
+                          {.sphere_accelerator = SphereAccelerator::kBvh},
+                          {.mode = SceneCacheMode::kDisabled}};
+  assert(bvh_scene.GetScene().GetSphereGrid().IsEmpty());
+  Image expected = Render(bvh_scene, camera_opts, {.depth = 3});
+
+  PreparedScene grid_scene{dir / "scene.obj"};
+  assert(!grid_scene.GetScene().GetSphereGrid().IsEmpty());
+  assert(grid_scene.GetBvhStats().primitive_count == 2);
+  for (bool ray_packets : {true, false}) {
+    RenderOptions render_opts{.depth = 3};
+    render_opts.ray_packets = ray_packets;
+    Compare(Render(grid_scene, camera_opts, render_opts), expected);
+  }
+
+  RenderOptions float_opts{.depth = 3};
+  float_opts.precision = Precision::kFloat;
+  PreparedScene float_scene{dir / "scene.obj", {}, {}, Precision::kFloat};
+  Compare(Render(float_scene, camera_opts, float_opts), expected);
+}
+
+void run_scene_cache_test() {
+  TempSceneDir temp_dir("cache");
+  const auto &dir = temp_dir.GetPath();
+  std::filesystem::copy(kTestsDir / "box", dir);
+  auto path = dir / "cube.obj";
+
+  // По умолчанию кэш только читается
+  ReadScene(path);
+  assert(!std::filesystem::exists(GetSceneCachePath(path)));
+
+  const SceneCacheOptions read_write{.mode = SceneCacheMode::kReadWrite};
+  auto parsed = ReadScene(path, {}, read_write);
+  assert(std::filesystem::exists(GetSceneCachePath(path)));
+  auto cached = ReadScene(path);
+
+  // Дерево из кэша не строится заново
+  assert(cached.GetBvh().GetStats().build_time_ms == 0.0);
+  assert(cached.GetBvh().GetStats().sah_cost ==
+         parsed.GetBvh().GetStats().sah_cost);
+  assert(cached.GetObjects().size() == parsed.GetObjects().size());
+  assert(cached.GetSphereObjects().size() == parsed.GetSphereObjects().size());
+  assert(cached.GetLights().size() == parsed.GetLights().size());
+  assert(cached.GetMaterials().size() == parsed.GetMaterials().size());
+  for (size_t i = 0; i < parsed.GetObjects().size(); ++i) {
+    const auto &lhs = parsed.GetObjects()[i];
+    const auto &rhs = cached.GetObjects()[i];
+    assert(lhs.polygon[0] == rhs.polygon[0] && lhs.polygon[2] == rhs.polygon[2]);
+    assert(lhs.normal_indices == rhs.normal_indices);
+    for (size_t vertex = 0; vertex < 3; ++vertex) {
+      const Vector *lhs_normal = lhs.GetNormal(vertex, parsed.GetNormals());
+      const Vector *rhs_normal = rhs.GetNormal(vertex, cached.GetNormals());
+      assert((lhs_normal == nullptr) == !lhs.HasNormals());
+      assert(!lhs_normal || *lhs_normal == *rhs_normal);
+    }
+    assert(lhs.material->name == rhs.material->name);
+  }
+
+  CameraOptions camera_opts{.screen_width = 640,
+                            .screen_height = 480,
+                            .fov = std::numbers::pi / 3,
+                            .look_from = {0., .7, 1.75},
+                            .look_to = {0., .7, 0.}};
+  CheckImage(path.string(), "box/cube.png", camera_opts, {4});
+
+  // Изменённый .obj читается заново, а не из кэша
+  std::ofstream{path, std::ios::app} << "\nP 0 1 0 1 1 1\n";
+  auto changed = ReadScene(path, {}, read_write);
+  assert(changed.GetLights().size() == parsed.GetLights().size() + 1);
+
+  // Без сохранённого дерева кэш всё равно используется для геометрии
+  ReadScene(path, {}, {.mode = SceneCacheMode::kReadWrite, .store_bvh = false});
+  auto without_bvh = ReadScene(path);
+  assert(without_bvh.GetLights().size() == changed.GetLights().size());
+  assert(without_bvh.GetBvh().GetStats().sah_cost ==
+         parsed.GetBvh().GetStats().sah_cost);
+
+  // Дерево без сфер из кэша дополняется той же сеткой над сферами
+  std::filesystem::remove(GetSceneCachePath(path));
+  const BvhOptions grid_options{.sphere_accelerator = SphereAccelerator::kGrid};
+  auto grid_parsed = ReadScene(path, grid_options, read_write);
+  auto grid_cached = ReadScene(path, grid_options);
+  assert(grid_cached.GetBvh().GetStats().build_time_ms == 0.0);
+  assert(!grid_cached.GetSphereGrid().IsEmpty());
+  assert(grid_cached.GetSphereGrid().GetReferenceCount() ==
+         grid_parsed.GetSphereGrid().GetReferenceCount());
+
+  // Цепочка из depth внутренних узлов: левый ребёнок - следующий узел
+  // цепочки, правый - лист; самый глубокий лист на глубине depth
+  auto make_chain = [](size_t depth) {
+    std::vector<BvhNode> nodes(2 * depth + 1);
+    for (size_t i = 0; i < depth; ++i) {
+      nodes[i].offset = depth + 1 + i;
+    }
+    for (size_t i = depth; i < nodes.size(); ++i) {
+      nodes[i].offset = i - depth;
+      nodes[i].count = 1;
+    }
+    std::vector<BvhPrimitive> primitives(depth + 1,
+                                         {PrimitiveKind::kSphere, 0});
+    return std::pair{nodes, primitives};
+  };
+  auto [deepest, deepest_primitives] = make_chain(Bvh::kMaxDepth - 1);
+  assert(IsValidBvh(deepest, deepest_primitives, {}, 0, 1));
+  // Повреждённое дерево отвергается: обход вышел бы за стек, узел
+  // достижим дважды, примитив не попал ни в один лист
+  auto [too_deep, too_deep_primitives] = make_chain(Bvh::kMaxDepth);
+  assert(!IsValidBvh(too_deep, too_deep_primitives, {}, 0, 1));
+  auto [shared, shared_primitives] = make_chain(3);
+  shared[1].offset = shared[0].offset;
+  assert(!IsValidBvh(shared, shared_primitives, {}, 0, 1));
+  auto [orphan, orphan_primitives] = make_chain(3);
+  orphan_primitives.push_back({PrimitiveKind::kSphere, 0});
+  assert(!IsValidBvh(orphan, orphan_primitives, {}, 0, 1));
+}
+
+void run_ray_weight_cutoff_test() {
+  CameraOptions camera_opts{.screen_width = 800,
+                            .screen_height = 600,
+                            .look_from = {2., 1.5, -.1},
+                            .look_to = {1., 1.2, -2.8}};
+  // Без отсечения лучей по весу
+  CheckImage("mirrors/scene.obj", "mirrors/result.png", camera_opts,
+             {.depth = 9, .min_ray_weight = 0.0});
+  // Глубина почти не влияет на время: далёкие отражения отсекаются по весу
+  CheckImage("mirrors/scene.obj", "mirrors/result.png", camera_opts,
+             {.depth = 1000});
+}
+
+void run_framebuffer_test() {
+  Framebuffer colors(37, 5);
+  assert(colors.Stride() % (kCacheLineSize / sizeof(double)) == 0);
+  assert(reinterpret_cast<uintptr_t>(colors.Channel(0).data()) %
+             kCacheLineSize ==
+         0);
+
+  auto tile = colors.View(16, 2, 21, 3);
+  tile.Set(1, 4, Vector(1., 2., 3.));
+  assert(colors.Get(3, 20) == Vector(1., 2., 3.));
+  assert(colors.Get(3, 19) == Vector(0., 0., 0.));
+
+  Image image(37, 5);
+  image.SetPixel({10, 20, 30}, 4, 36);
+  TempSceneDir temp_dir("framebuffer");
+  auto path = temp_dir.GetPath() / "framebuffer_test.png";
+  image.Write(path);
+  Image read(path);
+  assert(read.Width() == 37 && read.Height() == 5);
+  auto pixel = read.GetPixel(4, 36);
+  assert(pixel.r == 10 && pixel.g == 20 && pixel.b == 30);
+}
+
+void run_gamma_table_test() {
+  GammaTable table(1.0 / 2.2);
+
+  for (int k = 0; k <= 255; ++k) {
+    double boundary = std::pow(k / 255.0, 2.2);
+    double value = boundary;
+    for (int step = 0; step < 4; ++step) {
+      value = std::nextafter(value, 0.0);
+    }
+    for (int step = 0; step < 8; ++step) {
+      assert(table.Quantize(value) == table.Reference(value));
+      value = std::nextafter(value, 2.0);
+    }
+  }
+  for (int i = 0; i <= 1'000'000; ++i) {
+    double value = i / 1e6;
+    assert(table.Quantize(value) == table.Reference(value));
+  }
+
+  assert(table.Quantize(-1.0) == 0);
+  assert(table.Quantize(std::nan("")) == 0);
+  assert(table.Quantize(1e300) == 255);
+}
+
+void run_render_stats_test() {
+  PreparedScene scene{kTestsDir / "box/cube.obj"};
+  CameraOptions camera_opts{.screen_width = 160,
+                            .screen_height = 120,
+                            .fov = std::numbers::pi / 3,
+                            .look_from = {0., .7, 1.75},
+                            .look_to = {0., .7, 0.}};
+
+  RenderStats single, multi;
+  auto plain = Render(scene, camera_opts, {4});
+  auto counted = Render(scene, camera_opts,
+                        {.depth = 4, .threads = 1, .stats = &single});
+  Render(scene, camera_opts, {.depth = 4, .threads = 4, .stats = &multi});
+
+  // Счётчики не меняют картинку и не зависят от числа потоков
+  assert(std::equal(plain.Data(), plain.Data() + 4 * 160 * 120,
+                    counted.Data()));
+  assert(single.ToJson() == multi.ToJson());
+
+  assert(single.primary_rays == 160 * 120);
+  assert(single.depth_histogram[0] == single.primary_rays);
+  uint64_t secondary = 0;
+  for (size_t i = 1; i < RenderStats::kMaxHistogramDepth; ++i) {
+    secondary += single.depth_histogram[i];
+  }
+  assert(secondary == single.reflection_rays + single.refraction_rays);
+  assert(single.reflection_rays > 0 && single.refraction_rays > 0);
+  assert(single.shadow_rays > single.occluded_shadow_rays);
+  assert(single.hits <= single.primary_rays + secondary);
+  assert(single.triangle_tests > 0 && single.sphere_tests > 0);
+  assert(single.node_visits > 0);
+}
+
+void run_progressive_render_test() {
+  PreparedScene scene{kTestsDir / "box/cube.obj"};
+  CameraOptions camera_opts{.screen_width = 150,
+                            .screen_height = 100,
+                            .fov = std::numbers::pi / 3,
+                            .look_from = {0., .7, 1.75},
+                            .look_to = {0., .7, 0.}};
+  auto size = 4 * 150 * 100;
+
+  RenderStats stats;
+  std::vector<int> steps;
+  auto full = Render(scene, camera_opts, {4});
+  auto progressive = RenderProgressive(
+      scene, camera_opts, {.depth = 4, .stats = &stats},
+      [&](const ProgressiveSnapshot &snapshot) {
+        assert(snapshot.pass == static_cast<int>(steps.size()));
+        assert(snapshot.pass_count == 4);
+        steps.push_back(snapshot.step);
+      });
+
+  // Каждый пиксель трассируется один раз, итог совпадает с Render
+  assert((steps == std::vector<int>{8, 4, 2, 1}));
+  assert(stats.primary_rays == 150 * 100);
+  assert(std::equal(full.Data(), full.Data() + size, progressive.Data()));
+
+  // Отмена после первого прохода возвращает его грубую картинку
+  CancellationToken token;
+  std::vector<uint8_t> coarse;
+  auto cancelled = RenderProgressive(
+      scene, camera_opts, {4},
+      [&](const ProgressiveSnapshot &snapshot) {
+        coarse.assign(snapshot.image.Data(), snapshot.image.Data() + size);
+        token.Cancel();
+      },
+      &token);
+  assert(std::equal(coarse.begin(), coarse.end(), cancelled.Data()));
+  assert(!std::equal(coarse.begin(), coarse.end(), full.Data()));
+  for (int y = 0; y < 100; ++y) {
+    for (int x = 0; x < 150; ++x) {
+      auto pixel = cancelled.GetPixel(y, x);
+      auto corner = cancelled.GetPixel(y - y % 8, x - x % 8);
+      assert(pixel.r == corner.r && pixel.g == corner.g && pixel.b == corner.b);
+    }
+  }
+}
+
+void run_camera_test() {
+  CameraOptions camera_opts{.screen_width = 37,
+                            .screen_height = 23,
+                            .fov = std::numbers::pi / 3,
+                            .look_from = {2., 1.5, -.1},
+                            .look_to = {1., 1.2, -2.8}};
+  Camera camera(camera_opts);
+  auto near = [](const Vector &lhs, const Vector &rhs) {
+    return Length(lhs - rhs) < 1e-12;
+  };
+
+  // Центр экрана смотрит в look_to, края - под углом fov / 2
+  Vector forward = (camera_opts.look_to - camera_opts.look_from).Normalized();
+  auto center = Camera({2, 2, camera_opts.fov, camera_opts.look_from,
+                        camera_opts.look_to})
+                    .GetRay(1, 1, 0.0, 0.0);
+  assert(near(center.GetDirection(), forward));
+  auto top = Camera({2, 2, camera_opts.fov, camera_opts.look_from,
+                     camera_opts.look_to})
+                 .GetRay(1, 0, 0.0, 0.0);
+  assert(std::abs(DotProduct(top.GetDirection(), forward) -
+                  std::cos(camera_opts.fov / 2)) < 1e-12);
+
+  // Строки и пучки дают те же лучи, что и по одному
+  std::vector<double> dx(37), dy(37), dz(37);
+  for (int y = 0; y < 23; ++y) {
+    camera.GetRowDirections(y, 0, 37, dx.data(), dy.data(), dz.data());
+    for (int x = 0; x < 37; ++x) {
+      assert(near({dx[x], dy[x], dz[x]}, camera.GetRay(x, y).GetDirection()));
+      assert(near(camera.GetRay(x, y).GetDirection(),
+                  CameraRay(camera_opts, x, y).GetDirection()));
+    }
+  }
+
+  RayPacket packet;
+  camera.GetPacket(34, 20, 3, 3, &packet);
+  assert(packet.Size() == 9);
+  for (size_t i = 0; i < packet.Size(); ++i) {
+    auto ray = packet.GetRay(i);
+    assert(near(ray.GetOrigin(), camera_opts.look_from));
+    assert(near(ray.GetDirection(),
+                camera.GetRay(34 + i % 3, 20 + i / 3).GetDirection()));
+  }
+}
+
+double ImageRmse(const Image &lhs, const Image &rhs) {
+  double sum = 0.0;
+  for (int y = 0; y < lhs.Height(); ++y) {
+    for (int x = 0; x < lhs.Width(); ++x) {
+      auto a = lhs.GetPixel(y, x);
+      auto b = rhs.GetPixel(y, x);
+      for (auto [u, v] : {std::pair{a.r, b.r}, {a.g, b.g}, {a.b, b.b}}) {
+        sum += (u - v) * (u - v);
+      }
+    }
+  }
+  return std::sqrt(sum / (3.0 * lhs.Width() * lhs.Height()));
+}
+
+void run_antialiasing_test() {
+  // Первая четвёрка отсчётов - по одному в каждой четверти пикселя
+  auto offsets = GetSampleOffsets(16);
+  assert(offsets.size() == 16 && GetSampleOffsets(15).size() == 4);
+  std::set<std::pair<double, double>> cells;
+  for (size_t i = 0; i < offsets.size(); ++i) {
+    cells.insert({offsets[i].dx, offsets[i].dy});
+    if (i < 4) {
+      assert((offsets[i].dx < 0.5) == (i == 0 || i == 3));
+      assert((offsets[i].dy < 0.5) == (i == 0 || i == 2));
+    }
+  }
+  assert(cells.size() == 16);
+
+  PreparedScene scene{kTestsDir / "box/cube.obj"};
+  CameraOptions camera_opts{.screen_width = 160,
+                            .screen_height = 120,
+                            .fov = std::numbers::pi / 3,
+                            .look_from = {0., .7, 1.75},
+                            .look_to = {0., .7, 0.}};
+  auto pixels = 160 * 120;
+
+  auto render = [&](AntialiasingMode mode, RenderStats &stats) {
+    RenderOptions render_opts{.depth = 4, .stats = &stats};
+    render_opts.antialiasing.mode = mode;
+    return Render(scene, camera_opts, render_opts);
+  };
+  RenderStats plain_stats, adaptive_stats, supersample_stats;
+  auto plain = render(AntialiasingMode::kNone, plain_stats);
+  auto adaptive = render(AntialiasingMode::kAdaptive, adaptive_stats);
+  auto supersampled = render(AntialiasingMode::kSupersample, supersample_stats);
+
+  assert(plain_stats.primary_rays == static_cast<uint64_t>(pixels));
+  assert(supersample_stats.primary_rays == 16ull * pixels);
+  // Дополнительные отсчёты - только на границах, а результат близок к
+  // равномерным 16 отсчётам на пиксель
+  assert(adaptive_stats.primary_rays < 4ull * pixels);
+  assert(ImageRmse(adaptive, supersampled) <
+         0.25 * ImageRmse(plain, supersampled));
+
+  // Уточнение границ - последний проход прогрессивного рендеринга
+  std::vector<int> steps;
+  RenderOptions render_opts{4};
+  render_opts.antialiasing.mode = AntialiasingMode::kAdaptive;
+  auto progressive = RenderProgressive(
+      scene, camera_opts, render_opts,
+      [&](const ProgressiveSnapshot &snapshot) {
+        steps.push_back(snapshot.step);
+      });
+  assert((steps == std::vector<int>{8, 4, 2, 1, 1}));
+  assert(std::equal(adaptive.Data(), adaptive.Data() + 4 * pixels,
+                    progressive.Data()));
+}
+
+void run_ray_packets_test() {
+  auto scene = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+  const auto &store = scene.GetTriangles();
+  CameraOptions camera_opts{.screen_width = 64,
+                            .screen_height = 64,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+  Camera camera(camera_opts);
+
+  // Векторные ядра пучков находят те же попадания, что и скалярные
+  auto scalar = GetPacketKernels(TriangleKernelKind::kScalar);
+  auto vector = GetPacketKernels(DetectTriangleKernel());
+  for (int y = 0; y < camera_opts.screen_height; y += RayPacket::kSide) {
+    for (int x = 0; x < camera_opts.screen_width; x += RayPacket::kSide) {
+      RayPacket packet;
+      camera.GetPacket(x, y, RayPacket::kSide, RayPacket::kSide, &packet);
+      PacketRays expected, actual;
+      for (size_t i = 0; i < packet.Size(); ++i) {
+        expected.Add(packet.GetRay(i), 1e9);
+        actual.Add(packet.GetRay(i), 1e9);
+      }
+      // Часть лучей выключена, чтобы проверить маски
+      uint32_t active = expected.AllLanes() & ~(uint32_t{1} << (x % 16));
+      for (uint32_t first = y % 7; first < store.Size(); first += 97) {
+        uint32_t count =
+            std::min<uint32_t>(1 + (x + y) % 113, store.Size() - first);
+        BoundingBox box;
+        for (uint32_t i = first; i < first + count; ++i) {
+          box.Extend(GetBoundingBox(store.GetTriangle(i)));
+        }
+        double expected_near, actual_near;
+        assert(scalar.box(box, expected, active, &expected_near) ==
+               vector.box(box, actual, active, &actual_near));
+        assert(expected_near == actual_near);
+
+        PacketTriangleHits expected_hits, actual_hits;
+        assert(scalar.triangles(store, first, count, expected, active,
+                                &expected_hits) ==
+               vector.triangles(store, first, count, actual, active,
+                                &actual_hits));
+        assert(expected.t_max == actual.t_max);
+        assert(expected_hits.index == actual_hits.index);
+        assert(expected_hits.u == actual_hits.u);
+        assert(expected_hits.v == actual_hits.v);
+      }
+    }
+  }
+
+  // Рендеринг пучками совпадает с рендерингом по одному лучу
+  CameraOptions box_opts{.screen_width = 150,
+                         .screen_height = 110,
+                         .fov = std::numbers::pi / 3,
+                         .look_from = {0., .7, 1.75},
+                         .look_to = {0., .7, 0.}};
+  // Пучками трассируется только полный режим; режимы отладки всегда
+  // идут по одному лучу
+  PreparedScene box{kTestsDir / "box/cube.obj"};
+  RenderStats packet_stats, single_stats;
+  RenderOptions packet_opts{.depth = 4};
+  packet_opts.stats = &packet_stats;
+  RenderOptions single_opts = packet_opts;
+  single_opts.ray_packets = false;
+  single_opts.stats = &single_stats;
+  auto packets = Render(box, box_opts, packet_opts);
+  auto single = Render(box, box_opts, single_opts);
+  size_t pixels = box_opts.screen_width * box_opts.screen_height;
+  assert(std::equal(packets.Data(), packets.Data() + 4 * pixels,
+                    single.Data()));
+  assert(packet_stats.primary_rays == single_stats.primary_rays);
+  assert(packet_stats.shadow_rays == single_stats.shadow_rays);
+}
+
+void run_single_precision_test() {
+  // Коробка, округлённая до float, содержит исходную
+  BoundingBox box({0.1, -1.0 / 3.0, 1e-9}, {0.7, 2.0 / 3.0, 1e5 + 0.1});
+  FloatBoundingBox float_box(box);
+  for (size_t axis = 0; axis < 3; ++axis) {
+    assert(float_box.GetMin()[axis] <= box.GetMin()[axis]);
+    assert(float_box.GetMax()[axis] >= box.GetMax()[axis]);
+  }
+
+  auto float_options = [](int depth) {
+    RenderOptions options{depth};
+    options.precision = Precision::kFloat;
+    return options;
+  };
+  auto prepare = [](std::string_view obj_filename) {
+    return PreparedScene{kTestsDir / obj_filename, {}, {}, Precision::kFloat};
+  };
+
+  CheckImage(prepare("shading_parts/scene.obj"), "shading_parts/scene.png",
+             {640, 480}, float_options(1));
+  CheckImage(prepare("box/cube.obj"), "box/cube.png",
+             {.screen_width = 640,
+              .screen_height = 480,
+              .fov = std::numbers::pi / 3,
+              .look_from = {0., .7, 1.75},
+              .look_to = {0., .7, 0.}},
+             float_options(4));
+  CheckImage(prepare("mirrors/scene.obj"), "mirrors/result.png",
+             {.screen_width = 800,
+              .screen_height = 600,
+              .look_from = {2., 1.5, -.1},
+              .look_to = {1., 1.2, -2.8}},
+             float_options(9));
+
+  CameraOptions deer_camera{.screen_width = 500,
+                            .screen_height = 500,
+                            .look_from = {100., 200., 150.},
+                            .look_to = {0., 100., 0.}};
+  auto deer = prepare("deer/CERF_Free.obj");
+  CheckImage(deer, "deer/result.png", deer_camera, float_options(1));
+
+  // Геометрия для обхода хранится только во float и занимает вдвое меньше
+  PreparedScene double_deer{kTestsDir / "deer/CERF_Free.obj"};
+  const Scene &float_scene = deer.GetScene();
+  const Scene &double_scene = double_deer.GetScene();
+  assert(float_scene.GetTriangles().Size() == 0);
+  assert(float_scene.GetBvh().GetNodes().empty());
+  assert(2 * float_scene.GetFloatTriangles().GetGeometryBytes() ==
+         double_scene.GetTriangles().GetGeometryBytes());
+  assert(float_scene.GetBvh().GetNodeBytes() <
+         double_scene.GetBvh().GetNodeBytes());
+
+  // Точность сцены и настроек рендеринга должна совпадать
+  bool thrown = false;
+  try {
+    Render(deer, deer_camera, {1});
+  } catch (const std::invalid_argument &) {
+    thrown = true;
+  }
+  assert(thrown);
+}
+
 int main() {
   run_shading_parts_test();
+  run_triangle_test();
+  run_triangle2_test();
+  run_box_with_spheres_test();
+  run_classic_box_test();
+  run_mirrors_test();
+  run_distored_box_test();
+  run_deer_test();
+  run_bvh_builders_test();
+  run_lbvh_test();
+  run_multithreaded_render_test();
+  run_triangle_kernels_test();
+  run_compressed_bvh_test();
+  run_instancing_test();
+  run_bvh_refit_test();
+  run_sphere_grid_test();
+  run_scene_cache_test();
+  run_ray_weight_cutoff_test();
+  run_framebuffer_test();
+  run_gamma_table_test();
+  run_render_stats_test();
+  run_progressive_render_test();
+  run_antialiasing_test();
+  run_camera_test();
+  run_ray_packets_test();
+  run_single_precision_test();
 }
\ No newline at end of file
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+constexpr size_t kCacheLineSize = 64;
+
+template <class T, size_t Alignment = kCacheLineSize>
+class AlignedAllocator {
+    static_assert(Alignment >= alignof(T), "alignment is too small for the type");
+    static_assert((Alignment & (Alignment - 1)) == 0, "alignment must be a power of two");
+
+public:
+    using value_type = T;
+
+    template <class U>
+    struct rebind {
+        using other = AlignedAllocator<U, Alignment>;
+    };
+
+    AlignedAllocator() = default;
+
+    template <class U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) {
+    }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t{Alignment}));
+    }
+
+    void deallocate(T* ptr, size_t) {
+        ::operator delete(ptr, std::align_val_t{Alignment});
+    }
+
+    template <class U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const {
+        return true;
+    }
+};
+
+template <class T, size_t Alignment = kCacheLineSize>
+using AlignedVector = std::vector<T, AlignedAllocator<T, Alignment>>;
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <atomic>
+
+// Флаг отмены, который можно выставить из любого потока. Рендеринг
+// проверяет его между тайлами, так что отмена срабатывает с задержкой не
+// больше времени одного тайла.
+class CancellationToken {
+public:
+    void Cancel() {
+        cancelled_.store(true, std::memory_order_relaxed);
+    }
+
+    bool IsCancelled() const {
+        return cancelled_.load(std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<bool> cancelled_ = false;
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include "../geometry/vector.h"
+#include "aligned_allocator.h"
+
+#include <cassert>
+#include <cstddef>
+#include <span>
+
+// Окно в кадровом буфере: каналы лежат отдельными плоскостями, строки
+// плоскости идут с шагом stride. Индексы - относительно левого верхнего
+// угла окна.
+class FramebufferView {
+public:
+    static constexpr size_t kChannels = 3;
+
+    FramebufferView(double* data, size_t plane_size, size_t stride, int width, int height)
+        : data_{data}, plane_size_{plane_size}, stride_{stride}, width_{width}, height_{height} {
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    size_t Stride() const {
+        return stride_;
+    }
+
+    double* Row(size_t channel, int y) const {
+        return data_ + channel * plane_size_ + y * stride_;
+    }
+
+    Vector Get(int y, int x) const {
+        return {Row(0, y)[x], Row(1, y)[x], Row(2, y)[x]};
+    }
+
+    void Set(int y, int x, const Vector& color) const {
+        for (size_t channel = 0; channel < kChannels; ++channel) {
+            Row(channel, y)[x] = color[channel];
+        }
+    }
+
+    FramebufferView Subview(int x, int y, int width, int height) const {
+        assert(x >= 0 && y >= 0 && x + width <= width_ && y + height <= height_);
+        return {data_ + y * stride_ + x, plane_size_, stride_, width, height};
+    }
+
+private:
+    double* data_;
+    size_t plane_size_;
+    size_t stride_;
+    int width_;
+    int height_;
+};
+
+// HDR-кадр в одном непрерывном выровненном по кэш-линии блоке. Строки
+// дополнены до целого числа кэш-линий, так что потоки, пишущие соседние
+// тайлы, не делят строк, а проходы по всему кадру работают с плоскими
+// массивами каждого канала.
+class Framebuffer {
+public:
+    static constexpr size_t kChannels = FramebufferView::kChannels;
+
+    Framebuffer(int width, int height)
+        : width_{width},
+          height_{height},
+          stride_{RoundUpToCacheLine(width)},
+          data_(kChannels * stride_ * height) {
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    size_t Stride() const {
+        return stride_;
+    }
+
+    FramebufferView View() {
+        return {data_.data(), stride_ * height_, stride_, width_, height_};
+    }
+
+    FramebufferView View(int x, int y, int width, int height) {
+        return View().Subview(x, y, width, height);
+    }
+
+    Vector Get(int y, int x) const {
+        const double* row = data_.data() + y * stride_ + x;
+        size_t plane_size = stride_ * height_;
+        return {row[0], row[plane_size], row[2 * plane_size]};
+    }
+
+    // Плоскость канала целиком, вместе с дополнением строк
+    std::span<double> Channel(size_t channel) {
+        return {data_.data() + channel * stride_ * height_, stride_ * height_};
+    }
+
+    std::span<const double> Channel(size_t channel) const {
+        return {data_.data() + channel * stride_ * height_, stride_ * height_};
+    }
+
+private:
+    static size_t RoundUpToCacheLine(int width) {
+        constexpr size_t kValuesPerLine = kCacheLineSize / sizeof(double);
+        return (width + kValuesPerLine - 1) / kValuesPerLine * kValuesPerLine;
+    }
+
+    int width_;
+    int height_;
+    size_t stride_;
+    AlignedVector<double> data_;
+};
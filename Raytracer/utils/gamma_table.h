@@ -0,0 +1,71 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// Квантование static_cast<int>(255 * pow(value, gamma)) для value из [0, 1]
+// без pow. Для каждого байта k хранится порог - наименьшее value, которое
+// квантуется в k или больше, а равномерная таблица по value даёт байт в
+// начале каждой корзины. Корзины достаточно мелкие, чтобы внутри каждой
+// было не больше одного порога, поэтому ответ получается одним сравнением
+// и совпадает с pow бит в бит. Значения больше 1 дают 255, отрицательные
+// и NaN - 0.
+class GammaTable {
+public:
+    static constexpr size_t kBuckets = size_t{1} << 16;
+
+    explicit GammaTable(double gamma) : gamma_{gamma} {
+        for (size_t k = 1; k < 256; ++k) {
+            thresholds_[k] = FindThreshold(k);
+        }
+        thresholds_[0] = 0.0;
+        thresholds_[256] = std::numeric_limits<double>::infinity();
+
+        for (size_t i = 0; i < kBuckets; ++i) {
+            buckets_[i] = Reference(static_cast<double>(i) / kBuckets);
+            // Следующий порог после начала корзины лежит за её концом
+            assert(buckets_[i] == 255 ||
+                   thresholds_[buckets_[i] + 2] >= static_cast<double>(i + 1) / kBuckets);
+        }
+    }
+
+    uint8_t Quantize(double value) const {
+        value = value > 0.0 ? std::min(value, 1.0) : 0.0;
+        size_t bucket = std::min(static_cast<size_t>(value * kBuckets), kBuckets - 1);
+        uint8_t start = buckets_[bucket];
+        return start + (value >= thresholds_[start + 1]);
+    }
+
+    // Значение, которое воспроизводит таблица
+    uint8_t Reference(double value) const {
+        int result = static_cast<int>(std::pow(value, gamma_) * 255.0);
+        return result > 255 ? 255 : result < 0 ? 0 : result;
+    }
+
+private:
+    // Двоичный поиск по неотрицательным double: их битовые представления
+    // упорядочены так же, как сами числа
+    double FindThreshold(size_t k) const {
+        uint64_t low = 0;
+        uint64_t high = std::bit_cast<uint64_t>(2.0);
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            if (Reference(std::bit_cast<double>(middle)) >= k) {
+                high = middle;
+            } else {
+                low = middle + 1;
+            }
+        }
+        return std::bit_cast<double>(low);
+    }
+
+    double gamma_;
+    std::array<double, 257> thresholds_;
+    std::array<uint8_t, kBuckets> buckets_;
+};
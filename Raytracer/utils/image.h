@@ -1,10 +1,14 @@
 #pragma once
 
-#include <ranges>
+#include "aligned_allocator.h"
+
 #include <cassert>
+#include <cstddef>
 #include <filesystem>
 #include <cstdio>
-#include <span>
+#include <stdexcept>
+#include <utility>
+#include <vector>
 
 #include <png.h>
 
@@ -24,17 +28,10 @@ public:
         ReadPng(path);
     }
 
-    Image(Image&& other) : width_{other.width_}, height_{other.height_}, bytes_{other.bytes_} {
+    Image(Image&& other)
+        : width_{other.width_}, height_{other.height_}, bytes_{std::move(other.bytes_)} {
         other.width_ = 0;
         other.height_ = 0;
-        other.bytes_ = nullptr;
-    }
-
-    ~Image() {
-        for (auto row : std::span{bytes_, bytes_ + height_}) {
-            delete[] row;
-        }
-        delete[] bytes_;
     }
 
     Image(const Image&) = delete;
@@ -76,7 +73,8 @@ public:
         // Use png_set_filler().
         // png_set_filler(png, 0, PNG_FILLER_AFTER);
 
-        png_write_image(png, bytes_);
+        auto rows = GetRows();
+        png_write_image(png, rows.data());
         png_write_end(png, nullptr);
 
         std::fclose(fp);
@@ -84,12 +82,12 @@ public:
     }
 
     RGB GetPixel(int y, int x) const {
-        auto px = &bytes_[y][4 * x];
+        auto px = &bytes_[(static_cast<size_t>(y) * width_ + x) * 4];
         return {px[0], px[1], px[2]};
     }
 
     void SetPixel(const RGB& pixel, int y, int x) {
-        auto px = &bytes_[y][4 * x];
+        auto px = &bytes_[(static_cast<size_t>(y) * width_ + x) * 4];
         px[0] = pixel.r;
         px[1] = pixel.g;
         px[2] = pixel.b;
@@ -103,17 +101,32 @@ public:
         return width_;
     }
 
+    // Пиксели RGBA построчно, без промежутков между строками
+    png_bytep Data() {
+        return bytes_.data();
+    }
+
+    png_const_bytep Data() const {
+        return bytes_.data();
+    }
+
 private:
     void PrepareImage(int width, int height) {
         height_ = height;
         width_ = width;
-        bytes_ = new png_bytep[height_];
-        for (auto*& row : std::span{bytes_, bytes_ + height_}) {
-            row = new png_byte[4 * width_]{};
-            for (auto x : std::views::iota(0, width_)) {
-                row[4 * x + 3] = 255;
-            }
+        bytes_.assign(static_cast<size_t>(4) * width_ * height_, 0);
+        for (size_t i = 3; i < bytes_.size(); i += 4) {
+            bytes_[i] = 255;
+        }
+    }
+
+    // Указатели на строки нужны только libpng
+    std::vector<png_bytep> GetRows() {
+        std::vector<png_bytep> rows(height_);
+        for (int y = 0; y < height_; ++y) {
+            rows[y] = bytes_.data() + static_cast<size_t>(y) * width_ * 4;
         }
+        return rows;
     }
 
     void ReadPng(const std::filesystem::path& path) {
@@ -176,16 +189,14 @@ private:
 
         png_read_update_info(png, info);
 
-        bytes_ = new png_bytep[height_];
-        for (auto y = 0; y < height_; y++) {
-            bytes_[y] = new png_byte[png_get_rowbytes(png, info)];
-        }
-
-        png_read_image(png, bytes_);
+        assert(png_get_rowbytes(png, info) == static_cast<size_t>(4) * width_);
+        bytes_.resize(static_cast<size_t>(4) * width_ * height_);
+        auto rows = GetRows();
+        png_read_image(png, rows.data());
         png_destroy_read_struct(&png, &info, nullptr);
         std::fclose(fp);
     }
 
     int width_, height_;
-    png_bytepp bytes_;
+    AlignedVector<png_byte> bytes_;
 };
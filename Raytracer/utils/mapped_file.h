@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Файл, целиком отображённый в память только для чтения. Там, где mmap
+// недоступен, содержимое просто читается в строку.
+class MappedFile {
+public:
+    explicit MappedFile(const std::filesystem::path& path) {
+#ifdef __linux__
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error{errno, std::generic_category(), "Can't open " + path.string()};
+        }
+
+        struct stat info;
+        if (::fstat(fd, &info)) {
+            ::close(fd);
+            throw std::system_error{errno, std::generic_category(), "Can't stat " + path.string()};
+        }
+
+        size_ = info.st_size;
+        if (size_ > 0) {
+            void* data = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                throw std::system_error{errno, std::generic_category(), "Can't map " + path.string()};
+            }
+            ::madvise(data, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+        }
+        ::close(fd);
+#else
+        std::ifstream in{path, std::ios::binary};
+        if (!in) {
+            throw std::runtime_error{"Can't open file " + path.string()};
+        }
+        buffer_.assign(std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{});
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    MappedFile(MappedFile&& other)
+        : data_{std::exchange(other.data_, nullptr)},
+          size_{std::exchange(other.size_, 0)},
+          buffer_{std::move(other.buffer_)} {
+        if (!buffer_.empty()) {
+            data_ = buffer_.data();
+        }
+    }
+
+    ~MappedFile() {
+#ifdef __linux__
+        if (data_) {
+            ::munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile& operator=(MappedFile&&) = delete;
+
+    std::string_view View() const {
+        return {data_, size_};
+    }
+
+    const char* Data() const {
+        return data_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    std::string buffer_;
+};
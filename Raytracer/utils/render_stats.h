@@ -0,0 +1,156 @@
+#pragma once
+
+#include "aligned_allocator.h"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum class RayKind { kPrimary, kShadow, kReflection, kRefraction };
+
+// Счётчики одного рендеринга. Заполняются, только если RenderOptions::stats
+// указывает на этот объект.
+struct RenderStats {
+    // Последняя ячейка гистограммы собирает все более глубокие лучи
+    static constexpr size_t kMaxHistogramDepth = 32;
+
+    uint64_t primary_rays = 0;
+    uint64_t shadow_rays = 0;
+    uint64_t reflection_rays = 0;
+    uint64_t refraction_rays = 0;
+    uint64_t triangle_tests = 0;
+    uint64_t sphere_tests = 0;
+    // Лучи, для которых нашлось ближайшее пересечение
+    uint64_t hits = 0;
+    // Теневые лучи, упёршиеся в препятствие
+    uint64_t occluded_shadow_rays = 0;
+    uint64_t node_visits = 0;
+    // Число трассированных отрезков пути по номеру отскока, 0 - первичный луч
+    std::array<uint64_t, kMaxHistogramDepth> depth_histogram = {};
+
+    uint64_t TotalRays() const {
+        return primary_rays + shadow_rays + reflection_rays + refraction_rays;
+    }
+
+    RenderStats& operator+=(const RenderStats& other) {
+        primary_rays += other.primary_rays;
+        shadow_rays += other.shadow_rays;
+        reflection_rays += other.reflection_rays;
+        refraction_rays += other.refraction_rays;
+        triangle_tests += other.triangle_tests;
+        sphere_tests += other.sphere_tests;
+        hits += other.hits;
+        occluded_shadow_rays += other.occluded_shadow_rays;
+        node_visits += other.node_visits;
+        for (size_t i = 0; i < kMaxHistogramDepth; ++i) {
+            depth_histogram[i] += other.depth_histogram[i];
+        }
+        return *this;
+    }
+
+    // Объект JSON без переводов строк
+    std::string ToJson() const {
+        std::string json = "{";
+        auto add = [&json](const char* name, uint64_t value) {
+            json += "\"";
+            json += name;
+            json += "\": " + std::to_string(value) + ", ";
+        };
+        add("primary_rays", primary_rays);
+        add("shadow_rays", shadow_rays);
+        add("reflection_rays", reflection_rays);
+        add("refraction_rays", refraction_rays);
+        add("triangle_tests", triangle_tests);
+        add("sphere_tests", sphere_tests);
+        add("hits", hits);
+        add("occluded_shadow_rays", occluded_shadow_rays);
+        add("node_visits", node_visits);
+
+        size_t used_depth = kMaxHistogramDepth;
+        while (used_depth > 0 && depth_histogram[used_depth - 1] == 0) {
+            --used_depth;
+        }
+        json += "\"depth_histogram\": [";
+        for (size_t i = 0; i < used_depth; ++i) {
+            json += (i ? ", " : "") + std::to_string(depth_histogram[i]);
+        }
+        json += "]}";
+        return json;
+    }
+};
+
+// Счётчики одного потока. Выровнены по кэш-линии, чтобы потоки не делили
+// строк при записи.
+class RayCounters {
+public:
+    void CountRay(RayKind kind, int bounce) {
+        switch (kind) {
+            case RayKind::kPrimary:
+                ++stats_.primary_rays;
+                break;
+            case RayKind::kShadow:
+                ++stats_.shadow_rays;
+                return;
+            case RayKind::kReflection:
+                ++stats_.reflection_rays;
+                break;
+            case RayKind::kRefraction:
+                ++stats_.refraction_rays;
+                break;
+        }
+        size_t bucket = std::min<size_t>(bounce, RenderStats::kMaxHistogramDepth - 1);
+        ++stats_.depth_histogram[bucket];
+    }
+
+    void CountTriangleTests(size_t count) {
+        stats_.triangle_tests += count;
+    }
+
+    void CountSphereTest() {
+        ++stats_.sphere_tests;
+    }
+
+    void CountHit() {
+        ++stats_.hits;
+    }
+
+    void CountOccluded() {
+        ++stats_.occluded_shadow_rays;
+    }
+
+    void CountNodeVisit() {
+        ++stats_.node_visits;
+    }
+
+    const RenderStats& GetStats() const {
+        return stats_;
+    }
+
+private:
+    alignas(kCacheLineSize) RenderStats stats_;
+};
+
+// Подставляется, когда статистика не нужна: все вызовы пустые и исчезают
+// после встраивания
+class NoRayCounters {
+public:
+    void CountRay(RayKind, int) {
+    }
+
+    void CountTriangleTests(size_t) {
+    }
+
+    void CountSphereTest() {
+    }
+
+    void CountHit() {
+    }
+
+    void CountOccluded() {
+    }
+
+    void CountNodeVisit() {
+    }
+};
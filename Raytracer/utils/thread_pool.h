@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Пул потоков с очередью задач на каждого исполнителя. Исполнитель берёт
+// задачи из начала своей очереди, а закончив их, ворует с конца чужих.
+// Вызывающий поток тоже работает как исполнитель с номером 0, поэтому пул
+// на один поток не создаёт ни одного дополнительного.
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t thread_count = 0) : queues_(ResolveThreadCount(thread_count)) {
+        threads_.reserve(queues_.size() - 1);
+        for (size_t worker = 1; worker < queues_.size(); ++worker) {
+            threads_.emplace_back([this, worker] { WorkerLoop(worker); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard lock{mutex_};
+            stop_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t ThreadCount() const {
+        return queues_.size();
+    }
+
+    static size_t ResolveThreadCount(size_t thread_count) {
+        if (thread_count == 0) {
+            return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+        }
+        return thread_count;
+    }
+
+    // Вызывает func(index, worker) для каждого index из [0, count) и ждёт
+    // завершения. worker - номер исполнителя из [0, ThreadCount()), по нему
+    // удобно держать состояние на поток. Вложенные вызовы не поддерживаются.
+    template <class Func>
+    void ParallelFor(size_t count, Func&& func) {
+        if (count == 0) {
+            return;
+        }
+
+        std::function<void(size_t, size_t)> job = std::forward<Func>(func);
+        {
+            std::lock_guard lock{mutex_};
+            job_ = &job;
+            error_ = nullptr;
+            remaining_.store(count);
+
+            // Раздаём подряд идущие блоки, чтобы соседние задачи попадали
+            // к одному исполнителю
+            size_t workers = queues_.size();
+            for (size_t worker = 0; worker < workers; ++worker) {
+                std::lock_guard queue_lock{queues_[worker].mutex};
+                for (size_t index = worker * count / workers;
+                     index < (worker + 1) * count / workers; ++index) {
+                    queues_[worker].tasks.push_back(index);
+                }
+            }
+            ++generation_;
+        }
+        wake_.notify_all();
+
+        RunTasks(0);
+
+        std::unique_lock lock{mutex_};
+        done_.wait(lock, [this] { return remaining_.load() == 0; });
+        job_ = nullptr;
+        if (error_) {
+            std::rethrow_exception(std::exchange(error_, nullptr));
+        }
+    }
+
+    // Делит [0, count) на блоки подряд идущих индексов, по несколько на
+    // исполнителя, и вызывает func(begin, end) для каждого блока. Удобно,
+    // когда работа на один индекс дешевле задачи пула.
+    template <class Func>
+    void ParallelForBlocks(size_t count, Func&& func) {
+        size_t blocks = std::min(count, 4 * ThreadCount());
+        ParallelFor(blocks, [&](size_t block, size_t) {
+            func(block * count / blocks, (block + 1) * count / blocks);
+        });
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    std::optional<size_t> PopTask(size_t worker) {
+        {
+            auto& own = queues_[worker];
+            std::lock_guard lock{own.mutex};
+            if (!own.tasks.empty()) {
+                auto index = own.tasks.front();
+                own.tasks.pop_front();
+                return index;
+            }
+        }
+
+        for (size_t shift = 1; shift < queues_.size(); ++shift) {
+            auto& victim = queues_[(worker + shift) % queues_.size()];
+            std::lock_guard lock{victim.mutex};
+            if (!victim.tasks.empty()) {
+                auto index = victim.tasks.back();
+                victim.tasks.pop_back();
+                return index;
+            }
+        }
+        return std::nullopt;
+    }
+
+    void RunTasks(size_t worker) {
+        while (auto index = PopTask(worker)) {
+            try {
+                (*job_)(*index, worker);
+            } catch (...) {
+                std::lock_guard lock{mutex_};
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+            }
+
+            if (remaining_.fetch_sub(1) == 1) {
+                std::lock_guard lock{mutex_};
+                done_.notify_all();
+            }
+        }
+    }
+
+    void WorkerLoop(size_t worker) {
+        size_t seen_generation = 0;
+        while (true) {
+            {
+                std::unique_lock lock{mutex_};
+                wake_.wait(lock, [&] { return stop_ || generation_ != seen_generation; });
+                if (stop_) {
+                    return;
+                }
+                seen_generation = generation_;
+            }
+            RunTasks(worker);
+        }
+    }
+
+    std::vector<WorkerQueue> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    size_t generation_ = 0;
+    bool stop_ = false;
+
+    std::function<void(size_t, size_t)>* job_ = nullptr;
+    std::atomic<size_t> remaining_ = 0;
+    std::exception_ptr error_;
+};